@@ -0,0 +1,640 @@
+#include "bf/bf.hpp"
+#include "bf/codegen/codegen.hpp"
+#include "bf/extent.hpp"
+#include "bf/logger.hpp"
+#include "bf/optimizer.hpp"
+#include "bf/stats.hpp"
+#include "cli.hpp"
+#include "engines.hpp"
+#include "process.hpp"
+#include "series.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+
+#include <fmt/ostream.h>
+
+#include <unistd.h>
+
+namespace
+{
+constexpr std::string_view benchinfo = "Benchmark";
+
+enum class BenchFlag
+{
+	runs = 0,
+	engines,
+	optimize,
+	generated,
+	baseline,
+	save_baseline,
+	threshold,
+	threads,
+	cc,
+	clang
+};
+
+struct BenchFlags
+{
+	std::array<CommandlineFlag, 10> flags = {
+		{{"runs", 'n', "5"},                               // Measurements of every program, engine and optimization level
+		 {"engines", '\0', "interpreter,c,llvm,asm,elf"}, // Engines to measure, comma separated
+		 {"optimize", 'O', "both", {"0", "1", "both"}},
+		 {"generated", '\0', "1", {"0", "1"}}, // Also measure large generated programs
+		 {"baseline", '\0', ""},               // Medians of a previous run to compare against
+		 {"save-baseline", '\0', ""},          // File to write the medians of this run to
+		 {"threshold", '\0', "10"},            // Slowdown over the baseline, in percent, that fails the benchmark
+		 {"threads", 'j', "1"},                // Optimizer and codegen worker threads, 1 for steadier timings
+		 {"cc", '\0', "cc"},                   // Compiler driver building the output of the c and asm engines
+		 {"clang", '\0', "clang"}}};           // Compiler building the output of the llvm engine
+
+	CommandlineFlag& operator[](BenchFlag flag) { return flags[static_cast<size_t>(flag)]; }
+};
+
+//! Program of the corpus, along with what it reads and what it should write.
+struct Workload
+{
+	std::string name;
+	std::string source;
+	std::string input{};
+
+	//! When unknown, the output of the unoptimized interpreter is taken as the reference.
+	std::optional<std::string> output{};
+
+	//! Where `input` is written for executables to read it from.
+	std::filesystem::path input_path{};
+};
+
+//! Differences below this are timer, scheduling and process startup noise, whatever their ratio to the baseline.
+constexpr double noise_floor_ms = 1.0;
+
+struct BenchParams
+{
+	size_t thread_count;
+	std::filesystem::path scratch_directory;
+	std::string cc;
+	std::string clang;
+};
+
+//! Command building the source the code generator of `engine` writes, to which the source and output paths get
+//! appended, or nothing for engines that do not need a toolchain.
+std::vector<std::string> build_command(Engine engine, const BenchParams& params)
+{
+	switch (engine)
+	{
+	case Engine::c: return {params.cc, "-O2", "-w"};
+	case Engine::llvm: return {params.clang, "-O2", "-w"};
+	case Engine::asm_x86_64:
+	case Engine::asm_x86_64_v3: return {params.cc, "-nostdlib", "-static"};
+	default: return {};
+	}
+}
+
+//! Loads every `name.b` of `directory`, with its input from `name.in` and expected output from `name.out` if present.
+bool load_corpus(const std::filesystem::path& directory, std::vector<Workload>& workloads)
+{
+	std::vector<std::filesystem::path> paths;
+
+	if (!list_corpus(directory, paths))
+	{
+		fmt::print(errout(benchinfo), "Failed to list the corpus in '{}'\n", directory.string());
+		return false;
+	}
+
+	for (const auto& path : paths)
+	{
+		auto source = read_file(path);
+
+		if (!source)
+		{
+			fmt::print(errout(benchinfo), "Failed to read '{}'\n", path.string());
+			return false;
+		}
+
+		auto input_path = path;
+		auto output_path = path;
+
+		workloads.push_back({
+			.name = path.stem().string(),
+			.source = std::move(*source),
+			.input = read_file(input_path.replace_extension(".in")).value_or(""),
+			.output = read_file(output_path.replace_extension(".out")),
+		});
+	}
+
+	return true;
+}
+
+//! Moves the tape pointer from `from` to `to`.
+void move_to(std::string& out, int& from, int to)
+{
+	out.append(size_t(std::abs(to - from)), to > from ? '>' : '<');
+	from = to;
+}
+
+//! A megabyte of straight-line arithmetic, clears, moves and output over a window of cells, as left by code generators
+//! and macro expanders. Stresses parsing and optimization rather than execution.
+std::string generate_straight_line(std::mt19937& rng)
+{
+	constexpr int window = 32;
+
+	std::string out;
+	int cell = 0;
+
+	// Cells are tracked so that loops are only emitted over nonzero cells, as the optimizer warns about the others.
+	std::array<std::uint8_t, window> cells{};
+
+	const auto add = [&](char c, unsigned count) {
+		out.append(count, c);
+		cells[size_t(cell)] += std::uint8_t((c == '+') ? count : -count);
+	};
+
+	while (out.size() < (1 << 20))
+	{
+		switch (rng() % 8)
+		{
+		case 0:
+		case 1: add('+', 1 + rng() % 8); break;
+		case 2: add('-', 1 + rng() % 8); break;
+		case 3: move_to(out, cell, int(rng() % window)); break;
+		case 4:
+		{
+			if (cells[size_t(cell)] == 0)
+			{
+				add('+', 1);
+				break;
+			}
+
+			out += "[-]";
+			cells[size_t(cell)] = 0;
+			break;
+		}
+		case 5:
+		{
+			if (cells[size_t(cell)] == 0)
+			{
+				add('-', 1);
+				break;
+			}
+
+			// Adds the current cell to another one.
+			const int target = (cell + 1 + int(rng() % (window - 1))) % window;
+			int pos = cell;
+
+			out += "[-";
+			move_to(out, pos, target);
+			out += '+';
+			move_to(out, pos, cell);
+			out += ']';
+
+			cells[size_t(target)] += cells[size_t(cell)];
+			cells[size_t(cell)] = 0;
+			break;
+		}
+		case 6:
+		{
+			if (rng() % 16 == 0)
+			{
+				out += '.';
+				break;
+			}
+
+			add('+', 1);
+			break;
+		}
+		default: move_to(out, cell, (cell + 1) % window); break;
+		}
+	}
+
+	return out;
+}
+
+//! Thousands of loop nests with small trip counts around arithmetic, as written by hand. Stresses loop optimizations.
+std::string generate_nested_loops(std::mt19937& rng)
+{
+	constexpr int max_depth = 5, work_cells = 8;
+
+	std::string out;
+	int cell = 0;
+
+	// Counters of the nesting levels come first, followed by the cells the innermost bodies work on.
+	const auto emit_nest = [&](const auto& self, int depth) -> void {
+		// Counters are left zeroed by the loops they count.
+		move_to(out, cell, depth);
+		out.append(2 + rng() % 3, '+');
+		out += '[';
+
+		if (depth + 1 < max_depth && rng() % 4 != 0)
+		{
+			self(self, depth + 1);
+		}
+		else
+		{
+			for (unsigned i = 0, count = 1 + rng() % 4; i < count; ++i)
+			{
+				move_to(out, cell, max_depth + int(rng() % work_cells));
+				out.append(1 + rng() % 5, (rng() % 2 != 0) ? '+' : '-');
+			}
+		}
+
+		move_to(out, cell, depth);
+		out += "-]";
+	};
+
+	for (int i = 0; i < 2000; ++i)
+	{
+		emit_nest(emit_nest, 0);
+		move_to(out, cell, max_depth + int(rng() % work_cells));
+		out += '.';
+	}
+
+	return out;
+}
+
+//! Runs of nonzero cells with strides of 1 to 3, scanned over back and forth then cleared. Stresses `suz`.
+std::string generate_scans(std::mt19937& rng)
+{
+	// The first cell counts the repetitions, and the second stays zero so that backwards scans stop there.
+	std::string out = "++++++++++[>";
+
+	for (int i = 0; i < 64; ++i)
+	{
+		const int stride = 1 + int(rng() % 3), length = 10 + int(rng() % 90);
+		const std::string forward(size_t(stride), '>'), backward(size_t(stride), '<');
+
+		for (int j = 0; j < length; ++j)
+		{
+			out += forward;
+			out.append(1 + rng() % 3, '+');
+		}
+
+		out += forward;
+		out += backward + '[' + backward + ']';
+		out += forward + '[' + forward + ']';
+		out += backward + "[[-]" + backward + ']';
+	}
+
+	out += "<-]";
+	return out;
+}
+
+void add_generated_workloads(std::vector<Workload>& workloads)
+{
+	// Fixed seeds, so that baselines compare the same programs.
+	std::mt19937 rng{42};
+
+	workloads.push_back({.name = "generated/straight-line", .source = generate_straight_line(rng)});
+	workloads.push_back({.name = "generated/nested-loops", .source = generate_nested_loops(rng)});
+	workloads.push_back({.name = "generated/scans", .source = generate_scans(rng)});
+}
+
+//! Runs `workload` through the pipeline of `engine` as `ashbf` would, timing every phase in `stats`, and sets `output` to
+//! what the program wrote. The source written by the c, llvm and asm engines is built with the toolchain of `params`
+//! first, which gets timed as the `build` phase.
+bool run_pipeline(
+	const Workload& workload,
+	Engine engine,
+	bool optimize,
+	const BenchParams& params,
+	bf::PipelineStats& stats,
+	std::optional<std::string>& output
+)
+{
+	bf::Brainfuck bfi;
+	stats.time_phase("parse", bfi.program, [&] { return bfi.compile(workload.source); });
+
+	if (optimize)
+	{
+		bf::Optimizer opt;
+		opt.legal_overflow = false;
+		opt.thread_count   = params.thread_count;
+
+		stats.time_phase("optimize", bfi.program, [&] {
+			opt.optimize(bfi.program, bfi.data);
+			return true;
+		});
+	}
+
+	const auto extent = bf::analyze_extent(bfi.program, bfi.data);
+	const size_t memory_size = (extent.required_memory_size() != 0) ? extent.required_memory_size() : 30000;
+
+	const auto program_path = params.scratch_directory / "program";
+
+	const auto codegen = [&](const std::filesystem::path& path, const auto& backend) {
+		std::ofstream file{path, std::ios::binary};
+
+		return file && stats.time_phase("codegen", bfi.program, [&] {
+			return backend(bf::codegen::Context{bfi.program, bfi.data, file, memory_size, nullptr, params.thread_count});
+		});
+	};
+
+	const auto execute = [&] {
+		return stats.time_phase("execute", bfi.program, [&] {
+			output = run_process({program_path.string()}, workload.input_path);
+			return output.has_value();
+		});
+	};
+
+	const auto build_and_execute = [&](std::string_view extension, const auto& backend) {
+		const auto source_path = params.scratch_directory / fmt::format("program.{}", extension);
+
+		if (!codegen(source_path, backend))
+		{
+			return false;
+		}
+
+		auto command = build_command(engine, params);
+		command.insert(command.end(), {source_path.string(), "-o", program_path.string()});
+
+		if (!stats.time_phase("build", bfi.program, [&] { return run_process(command, "/dev/null").has_value(); }))
+		{
+			fmt::print(errout(benchinfo), "Failed to build '{}' with '{}'\n", workload.name, command.front());
+			return false;
+		}
+
+		return execute();
+	};
+
+	// C and LLVM codegen occurs before linking
+	if (engine == Engine::c)
+	{
+		return build_and_execute("c", bf::codegen::c);
+	}
+
+	if (engine == Engine::llvm)
+	{
+		return build_and_execute("ll", bf::codegen::llvm);
+	}
+
+	if (!stats.time_phase("link", bfi.program, [&] { return bfi.link(); }))
+	{
+		fmt::print(errout(benchinfo), "Failed to link '{}'\n", workload.name);
+		return false;
+	}
+
+	switch (engine)
+	{
+	case Engine::interpreter:
+	{
+		const bf::Bytecode bytecode{bfi.program};
+		std::istringstream in{workload.input};
+		std::ostringstream out;
+
+		const bool ok = stats.time_phase("execute", bfi.program, [&] {
+			const auto vm_params = bf::VmParams{.memory_size = memory_size, .in_stream = &in, .out_stream = &out, .data = bfi.data};
+			return bf::interpret(vm_params, bytecode) == bf::VmStatus::ok;
+		});
+
+		output = std::move(out).str();
+		return ok;
+	}
+
+	case Engine::asm_x86_64:
+	{
+		return build_and_execute("s", [](bf::codegen::Context ctx) { return bf::codegen::asm_x86_64(ctx); });
+	}
+
+	case Engine::asm_x86_64_v3:
+	{
+		return build_and_execute("s", [](bf::codegen::Context ctx) {
+			return bf::codegen::asm_x86_64(ctx, bf::codegen::X86Target::x86_64_v3);
+		});
+	}
+
+	case Engine::elf_x86_64:
+	{
+		if (!codegen(program_path, bf::codegen::elf_x86_64))
+		{
+			return false;
+		}
+
+		std::error_code error;
+		std::filesystem::permissions(program_path, std::filesystem::perms::owner_exec, std::filesystem::perm_options::add, error);
+
+		return execute();
+	}
+
+	default: return false;
+	}
+}
+
+//! Baselines are a line per series, holding its key then its median in milliseconds, separated by a tab.
+bool load_baseline(const std::string& path, std::map<std::string, double, std::less<>>& baseline)
+{
+	std::ifstream file{path};
+
+	if (!file)
+	{
+		return false;
+	}
+
+	for (std::string line; std::getline(file, line);)
+	{
+		if (const size_t tab = line.rfind('\t'); tab != std::string::npos)
+		{
+			baseline[line.substr(0, tab)] = std::strtod(line.c_str() + tab + 1, nullptr);
+		}
+	}
+
+	return true;
+}
+
+bool save_baseline(const std::string& path, const std::vector<Series>& series)
+{
+	std::ofstream file{path};
+
+	for (const auto& s : series)
+	{
+		fmt::print(file, "{}\t{}\n", s.key, bf::format_fixed(s.median(), 6));
+	}
+
+	return bool(file);
+}
+}
+
+int main(int argc, char** argv)
+{
+	const std::vector<std::string_view> args(argv, argv + argc);
+
+	if (args.size() < 2)
+	{
+		fmt::print(errout(cmdinfo), "Syntax : ./ashbf-bench <corpus directory> (flags)\n");
+		return 1;
+	}
+
+	BenchFlags flags;
+	if (!parse_flags(flags.flags, args, 2))
+	{
+		return 1;
+	}
+
+	std::vector<Engine> engines;
+	if (!parse_engines(flags[BenchFlag::engines].value, engines))
+	{
+		return 1;
+	}
+
+	std::vector<bool> optimization_levels;
+	if (flags[BenchFlag::optimize].value != "1")
+	{
+		optimization_levels.push_back(false);
+	}
+	if (flags[BenchFlag::optimize].value != "0")
+	{
+		optimization_levels.push_back(true);
+	}
+
+	const size_t runs = std::max(1ul, std::stoul(flags[BenchFlag::runs]));
+	const double threshold_percent = std::strtod(flags[BenchFlag::threshold].value.c_str(), nullptr);
+
+	std::vector<Workload> workloads;
+	if (!load_corpus(std::string{args[1]}, workloads))
+	{
+		return 1;
+	}
+
+	if (flags[BenchFlag::generated])
+	{
+		add_generated_workloads(workloads);
+	}
+
+	const BenchParams params{
+		.thread_count = std::max(1ul, std::stoul(flags[BenchFlag::threads])),
+		.scratch_directory = std::filesystem::temp_directory_path() / fmt::format("ashbf-bench-{}", getpid()),
+		.cc = flags[BenchFlag::cc],
+		.clang = flags[BenchFlag::clang],
+	};
+
+	// Engines whose toolchain is missing are left out rather than failing every program.
+	std::erase_if(engines, [&](Engine engine) {
+		const auto command = build_command(engine, params);
+
+		if (command.empty() || run_process({command.front(), "--version"}, "/dev/null"))
+		{
+			return false;
+		}
+
+		fmt::print(warnout(benchinfo), "Skipping {}, as '{}' cannot be run\n", engine_name(engine), command.front());
+		return true;
+	});
+
+	std::error_code error;
+	std::filesystem::create_directories(params.scratch_directory, error);
+
+	bool failed = false;
+
+	for (size_t i = 0; i < workloads.size(); ++i)
+	{
+		auto& workload = workloads[i];
+		workload.input_path = params.scratch_directory / fmt::format("input{}", i);
+
+		std::ofstream input{workload.input_path, std::ios::binary};
+		input << workload.input;
+
+		if (!workload.output)
+		{
+			bf::PipelineStats stats;
+			run_pipeline(workload, Engine::interpreter, false, params, stats, workload.output);
+		}
+	}
+
+	std::map<std::string, double, std::less<>> baseline;
+	const std::string& baseline_path = flags[BenchFlag::baseline];
+
+	if (!baseline_path.empty() && !load_baseline(baseline_path, baseline))
+	{
+		fmt::print(warnout(benchinfo), "No baseline in '{}', nothing to compare against\n", baseline_path);
+	}
+
+	fmt::print("{:<56} {:>12} {:>8} {:>12} {:>8}\n", "Benchmark", "Median (ms)", "Dev (%)", "Base (ms)", "Change");
+
+	std::vector<Series> all_series;
+
+	for (const auto& workload : workloads)
+	{
+		for (const Engine engine : engines)
+		{
+			for (const bool optimize : optimization_levels)
+			{
+				std::vector<Series> series;
+				bool wrong_output = false;
+
+				for (size_t run = 0; run < runs; ++run)
+				{
+					bf::PipelineStats stats;
+					std::optional<std::string> output;
+
+					if (!run_pipeline(workload, engine, optimize, params, stats, output))
+					{
+						fmt::print(errout(benchinfo), "{} failed through {}\n", workload.name, engine_name(engine));
+						failed = true;
+						break;
+					}
+
+					wrong_output |= output.has_value() && output != workload.output;
+
+					series.resize(stats.phases.size());
+					for (size_t p = 0; p < stats.phases.size(); ++p)
+					{
+						const auto& phase = stats.phases[p];
+						series[p].key = fmt::format("{} {} -O{} {}", workload.name, engine_name(engine), int(optimize), phase.name);
+						series[p].samples.push_back(std::chrono::duration<double, std::milli>(phase.time).count());
+					}
+				}
+
+				if (wrong_output)
+				{
+					fmt::print(errout(benchinfo), "{} wrote a wrong output through {}\n", workload.name, engine_name(engine));
+					failed = true;
+				}
+
+				for (const auto& s : series)
+				{
+					const double median = s.median();
+					const auto base = baseline.find(s.key);
+
+					if (base == baseline.end())
+					{
+						fmt::print("{:<56} {:>12} {:>8}\n", s.key, bf::format_fixed(median, 3), bf::format_fixed(s.deviation_percent(), 1));
+						continue;
+					}
+
+					const double change_percent = (base->second > 0) ? 100 * (median / base->second - 1) : 0;
+					const bool regressed = change_percent > threshold_percent && median - base->second > noise_floor_ms;
+
+					fmt::print(
+						"{:<56} {:>12} {:>8} {:>12} {:>7}%{}\n",
+						s.key,
+						bf::format_fixed(median, 3),
+						bf::format_fixed(s.deviation_percent(), 1),
+						bf::format_fixed(base->second, 3),
+						(change_percent >= 0 ? "+" : "") + bf::format_fixed(change_percent, 1),
+						regressed ? " REGRESSED" : ""
+					);
+
+					failed |= regressed;
+				}
+
+				all_series.insert(all_series.end(), series.begin(), series.end());
+			}
+		}
+	}
+
+	std::filesystem::remove_all(params.scratch_directory, error);
+
+	if (const std::string& path = flags[BenchFlag::save_baseline]; !path.empty() && !save_baseline(path, all_series))
+	{
+		fmt::print(errout(benchinfo), "Failed to write the baseline to '{}'\n", path);
+		return 1;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+#include "bf/bf.hpp"
+#include "bf/logger.hpp"
+#include "bf/perf.hpp"
+#include "bf/stats.hpp"
+#include "bf/vm.hpp"
+#include "cli.hpp"
+#include "series.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+
+#include <linux/perf_event.h>
+
+namespace
+{
+constexpr std::string_view microinfo = "Micro-benchmark";
+
+enum class MicroFlag
+{
+	samples = 0,
+	filter
+};
+
+struct MicroFlags
+{
+	std::array<CommandlineFlag, 2> flags = {
+		{{"samples", 'n', "15"}, // Timed batches of runs of every benchmark
+		 {"filter", '\0', ""}}}; // Only run benchmarks whose name contains this
+
+	CommandlineFlag& operator[](MicroFlag flag) { return flags[static_cast<size_t>(flag)]; }
+};
+
+constexpr size_t tape_size = 1 << 16;
+
+//! Instructions in the body of the loop of most benchmarks, enough for the loop itself to weigh little.
+constexpr size_t body_size = 1024;
+
+//! Batches of runs are made at least this long, far above the resolution of the clock.
+constexpr auto min_batch_time = std::chrono::milliseconds{2};
+
+//! Linked program exercising a handler, along with how much work a run of it does.
+struct MicroBench
+{
+	std::string name;
+	bf::Brainfuck bfi{};
+
+	//! What the work is counted in, instructions dispatched unless a handler does a variable amount of work.
+	std::string_view unit = "op";
+	size_t units = 0;
+};
+
+//! Runs `body` 255 times over the counter in cell 0, after `prologue`. The body must leave cell 0 and the tape pointer
+//! as it found them, and dispatches `body_dispatches` instructions. Counts dispatched instructions as units of work,
+//! unless `units_per_iteration` is given.
+MicroBench make_bench(
+	std::string name,
+	const bf::Program& prologue,
+	const bf::Program& body,
+	size_t body_dispatches,
+	bf::DataSegment data = {},
+	std::optional<size_t> units_per_iteration = std::nullopt
+)
+{
+	constexpr bf::VMArg iterations = 255;
+
+	MicroBench bench{.name = std::move(name)};
+	auto& program = bench.bfi.program;
+
+	program = prologue;
+	program.emplace_back(bf::bfSet, iterations);
+	program.emplace_back(bf::bfLoopBegin, -1);
+	program.insert(program.end(), body.begin(), body.end());
+	program.emplace_back(bf::bfAdd, -1);
+	program.emplace_back(bf::bfLoopEnd);
+	program.emplace_back(bf::bfEnd);
+
+	bench.bfi.data = std::move(data);
+	bench.bfi.link();
+
+	if (units_per_iteration)
+	{
+		bench.unit = "cell";
+		bench.units = iterations * *units_per_iteration;
+	}
+	else
+	{
+		// The prologue, the counter and its `jz`, and `end` run once. The body, the decrement and `jnz` every iteration.
+		bench.units = prologue.size() + 3 + iterations * (body_dispatches + 2);
+	}
+
+	return bench;
+}
+
+//! `op` repeated over the cells after the counter.
+MicroBench make_straight_line(std::string name, bf::VMOp op)
+{
+	bf::Program body;
+	body.emplace_back(bf::bfShift, 1);
+	body.insert(body.end(), body_size, op);
+	body.emplace_back(bf::bfShift, -1);
+	return make_bench(std::move(name), {}, body, body.size());
+}
+
+MicroBench make_shifts()
+{
+	bf::Program body;
+
+	for (size_t i = 0; i < body_size / 2; ++i)
+	{
+		body.emplace_back(bf::bfShift, 1);
+		body.emplace_back(bf::bfShift, -1);
+	}
+
+	return make_bench("shift", {}, body, body.size());
+}
+
+//! `opcode` with offsets cycling over [1, `spread`], so that they do not all hit the same cell.
+MicroBench make_offsets(std::string name, bf::Opcode opcode, bf::VMArg value, bf::VMArg spread)
+{
+	bf::Program body;
+	body.emplace_back(bf::bfShift, 1);
+
+	for (size_t i = 0; i < body_size; ++i)
+	{
+		body.emplace_back(opcode, value, 1 + bf::VMArg(i) % spread);
+	}
+
+	body.emplace_back(bf::bfShift, -1);
+	return make_bench(std::move(name), {}, body, body.size());
+}
+
+//! Inner loops running `trip_count` times, as many as fit the body.
+MicroBench make_loops(bf::VMArg trip_count)
+{
+	bf::Program body;
+	body.emplace_back(bf::bfShift, 1);
+
+	size_t dispatches = 2;
+	while (dispatches < body_size)
+	{
+		body.emplace_back(bf::bfSet, trip_count);
+		body.emplace_back(bf::bfLoopBegin, -1);
+		body.emplace_back(bf::bfAdd, -1);
+		body.emplace_back(bf::bfLoopEnd);
+		dispatches += 2 + 2 * size_t(trip_count);
+	}
+
+	body.emplace_back(bf::bfShift, -1);
+	return make_bench(fmt::format("loop-{}", trip_count), {}, body, dispatches);
+}
+
+MicroBench make_ifs(bool taken)
+{
+	bf::Program body;
+	body.emplace_back(bf::bfShift, 1);
+
+	size_t dispatches = 2;
+	while (dispatches < body_size)
+	{
+		body.emplace_back(bf::bfSet, taken ? 1 : 0);
+		body.emplace_back(bf::bfIfBegin, -1);
+		body.emplace_back(bf::bfAdd, 1);
+		body.emplace_back(bf::bfIfEnd);
+		dispatches += taken ? 3 : 2;
+	}
+
+	body.emplace_back(bf::bfShift, -1);
+	return make_bench(taken ? "if-taken" : "if-skipped", {}, body, dispatches);
+}
+
+//! Scans over a run of `length` nonzero cells, forth then back. Work is counted in cells scanned over.
+MicroBench make_scan(bf::VMArg length)
+{
+	// The run is surrounded by a zero cell on both sides: the one after the counter and the one after the run.
+	bf::DataSegment data;
+	const std::vector<std::uint8_t> ones(size_t(length), 1);
+
+	const bf::Program prologue{{bf::bfSetBlock, bf::append_block(data, ones), 2}};
+	const bf::Program body{
+		{bf::bfShift, 2},
+		{bf::bfShiftUntilZero, 1},
+		{bf::bfShift, -1},
+		{bf::bfShiftUntilZero, -1},
+		{bf::bfShift, -1},
+	};
+
+	return make_bench(fmt::format("scan-{}", length), prologue, body, body.size(), std::move(data), 2 * size_t(length));
+}
+
+MicroBench make_add_blocks(size_t size)
+{
+	bf::DataSegment data;
+	std::vector<std::uint8_t> block(size);
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		block[i] = std::uint8_t(i * 7 + 1);
+	}
+
+	const auto offset = bf::append_block(data, block);
+	const bf::Program body(body_size / 4, bf::VMOp{bf::bfAddBlock, offset, 1});
+
+	return make_bench(fmt::format("add-block-{}", size), {}, body, body.size(), std::move(data));
+}
+
+std::vector<MicroBench> make_benches()
+{
+	std::vector<MicroBench> benches;
+
+	benches.push_back(make_straight_line("add", {bf::bfAdd, 1}));
+	benches.push_back(make_straight_line("set", {bf::bfSet, 1}));
+	benches.push_back(make_shifts());
+	benches.push_back(make_offsets("add-offset", bf::bfAddOffset, 1, 8));
+	benches.push_back(make_offsets("set-offset", bf::bfSetOffset, 1, 8));
+
+	for (const bf::VMArg spread : {1, 8, 64})
+	{
+		benches.push_back(make_offsets(fmt::format("mac-{}", spread), bf::bfMAC, 3, spread));
+	}
+
+	for (const bf::VMArg trip_count : {1, 4, 16})
+	{
+		benches.push_back(make_loops(trip_count));
+	}
+
+	benches.push_back(make_ifs(true));
+	benches.push_back(make_ifs(false));
+
+	for (const bf::VMArg length : {4, 64, 1024})
+	{
+		benches.push_back(make_scan(length));
+	}
+
+	benches.push_back(make_add_blocks(16));
+	benches.push_back(make_add_blocks(256));
+
+	return benches;
+}
+
+bool run(const bf::Bytecode& program, const bf::DataSegment& data)
+{
+	// None of the benchmarks does I/O.
+	std::istringstream in;
+	std::ostringstream out;
+
+	return bf::interpret({.memory_size = tape_size, .in_stream = &in, .out_stream = &out, .data = data}, program)
+		== bf::VmStatus::ok;
+}
+
+//! Runs `program` `count` times, returning how long it took.
+std::chrono::nanoseconds run_batch(const bf::Bytecode& program, const bf::DataSegment& data, size_t count)
+{
+	const auto begin = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		run(program, data);
+	}
+
+	return std::chrono::steady_clock::now() - begin;
+}
+
+//! Formats an event count per unit of work, or a dash when it could not be counted.
+std::string per_unit(bf::PerfCounter& counter, std::uint64_t units, const auto& f)
+{
+	if (!counter.valid())
+	{
+		return "-";
+	}
+
+	counter.start();
+	f();
+
+	const auto count = counter.stop();
+	return count ? bf::format_fixed(double(*count) / double(units), 3) : "-";
+}
+}
+
+int main(int argc, char** argv)
+{
+	const std::vector<std::string_view> args(argv, argv + argc);
+
+	MicroFlags flags;
+	if (!parse_flags(flags.flags, args, 1))
+	{
+		return 1;
+	}
+
+	const size_t samples = std::max(1ul, std::stoul(flags[MicroFlag::samples]));
+	const std::string& filter = flags[MicroFlag::filter];
+
+	bf::PerfCounter instructions{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+	bf::PerfCounter branch_misses{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+
+	if (!instructions.valid() || !branch_misses.valid())
+	{
+		fmt::print(warnout(microinfo), "Hardware counters are unavailable, see /proc/sys/kernel/perf_event_paranoid\n");
+	}
+
+	fmt::print("{:<16} {:>5} {:>10} {:>8} {:>12} {:>14}\n", "Benchmark", "Unit", "ns/unit", "Dev (%)", "Insns/unit", "Br. miss/unit");
+
+	for (const auto& bench : make_benches())
+	{
+		if (bench.name.find(filter) == std::string::npos)
+		{
+			continue;
+		}
+
+		const bf::Bytecode program{bench.bfi.program};
+		const auto& data = bench.bfi.data;
+
+		if (!run(program, data))
+		{
+			fmt::print(errout(microinfo), "Benchmark {} failed to run\n", bench.name);
+			return 1;
+		}
+
+		// Doubles the batch size until the batch is long enough to time, which also warms up caches and predictors.
+		size_t batch = 1;
+		while (run_batch(program, data, batch) < min_batch_time)
+		{
+			batch *= 2;
+		}
+
+		Series series{.key = bench.name};
+		for (size_t i = 0; i < samples; ++i)
+		{
+			const auto time = run_batch(program, data, batch);
+			series.samples.push_back(double(time.count()) / double(batch * bench.units));
+		}
+
+		const auto units = std::uint64_t(batch * bench.units);
+		const auto run_once = [&] { run_batch(program, data, batch); };
+
+		fmt::print(
+			"{:<16} {:>5} {:>10} {:>8} {:>12} {:>14}\n",
+			bench.name,
+			bench.unit,
+			bf::format_fixed(series.median(), 3),
+			bf::format_fixed(series.deviation_percent(), 1),
+			per_unit(instructions, units, run_once),
+			per_unit(branch_misses, units, run_once)
+		);
+	}
+}
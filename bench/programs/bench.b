@@ -0,0 +1,3 @@
+Prints the alphabet backwards with a countdown of nested loops between letters
+
+>++[<+++++++++++++>-]<[[>+>+<<-]>[<+>-]++++++++[>++++++++<-]>.[-]<<>++++++++++[>++++++++++[>++++++++++[>++++++++++[-]<-]<-]<-]<-]++++++++++.
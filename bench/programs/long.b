@@ -0,0 +1,28 @@
+Four levels of nested loops running for a long while then printing a single byte
+
+>+>+>+>+>++<[>[<+++>-
+
+ >>>>>
+ >+>+>+>+>++<[>[<+++>-
+
+   >>>>>
+   >+>+>+>+>++<[>[<+++>-
+
+     >>>>>
+     >+>+>+>+>++<[>[<+++>-
+
+       >>>>>
+       +++[->+++++<]>[-]<
+
+       <<<<<
+
+     ]<<]>[-]
+     <<<<<
+
+   ]<<]>[-]
+   <<<<<
+
+ ]<<]>[-]
+ <<<<<
+
+]<<]>.
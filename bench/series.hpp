@@ -0,0 +1,43 @@
+#ifndef SERIES_HPP
+#define SERIES_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+//! Repeated measurements of the same thing, summarized by their median as it ignores the odd preempted run.
+struct Series
+{
+	std::string key;
+	std::vector<double> samples{};
+
+	double median() const
+	{
+		auto sorted = samples;
+		std::sort(sorted.begin(), sorted.end());
+
+		const size_t middle = sorted.size() / 2;
+		return (sorted.size() % 2 != 0) ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+	}
+
+	//! Standard deviation relative to the mean, in percent.
+	double deviation_percent() const
+	{
+		double mean = 0, variance = 0;
+
+		for (const double sample : samples)
+		{
+			mean += sample / double(samples.size());
+		}
+
+		for (const double sample : samples)
+		{
+			variance += (sample - mean) * (sample - mean) / double(samples.size());
+		}
+
+		return (mean > 0) ? 100 * std::sqrt(variance) / mean : 0;
+	}
+};
+
+#endif // SERIES_HPP
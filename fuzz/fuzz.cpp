@@ -0,0 +1,677 @@
+#include "bf/bf.hpp"
+#include "bf/codegen/codegen.hpp"
+#include "bf/logger.hpp"
+#include "bf/optimizer.hpp"
+#include "bf/threadpool.hpp"
+#include "cli.hpp"
+#include "engines.hpp"
+#include "process.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+
+#include <fmt/ostream.h>
+
+#include <unistd.h>
+
+namespace
+{
+constexpr std::string_view fuzzinfo = "Fuzzer";
+
+enum class FuzzFlag
+{
+	cases = 0,
+	seed,
+	engines,
+	corpus,
+	steps,
+	memory_size,
+	legalize_overflow,
+	optimize_suz,
+	threads,
+	max_failures,
+	cc,
+	lli
+};
+
+struct FuzzFlags
+{
+	std::array<CommandlineFlag, 12> flags = {
+		{{"cases", 'n', "10000"},       // Programs to compare
+		 {"seed", '\0', "1"},           // Seed of the first case, the following ones take the next seeds
+		 {"engines", '\0', "vm,elf"},   // Engines compared against the unoptimized interpreter, comma separated
+		 {"corpus", '\0', ""},          // Directory of programs to mutate for half of the cases
+		 {"steps", '\0', "100000"},     // Instructions the unoptimized interpreter may run before a case is skipped
+		 {"memory-size", 'm', "30000"}, // Cells of the tape
+		 {"legalize-overflow", '\0', "0", {"0", "1"}},
+		 {"optimize-suz", '\0', "1", {"0", "1"}},
+		 {"threads", 'j', "0"},       // Cases compared concurrently (0: one per hardware thread)
+		 {"max-failures", '\0', "8"}, // Divergences to report before stopping
+		 {"cc", '\0', "cc"},          // Compiler driver building the output of the c and asm engines
+		 {"lli", '\0', "lli"}}};      // LLVM interpreter running the output of the llvm engine
+
+	CommandlineFlag& operator[](FuzzFlag flag) { return flags[static_cast<size_t>(flag)]; }
+};
+
+struct FuzzParams
+{
+	size_t step_limit;
+	size_t memory_size;
+	bool legal_overflow;
+	bool allow_suz;
+	std::string cc;
+	std::string lli;
+
+	//! Native programs are given this long to run. Their reference ran within the step limit, so it is plenty.
+	std::chrono::milliseconds timeout{5000};
+};
+
+struct Case
+{
+	std::string source;
+	std::string input;
+};
+
+//! How the unoptimized interpreter ran a case.
+struct Outcome
+{
+	std::string output;
+	std::vector<std::uint8_t> tape;
+};
+
+bool is_command(char c) { return std::string_view{"+-<>[].,"}.find(c) != std::string_view::npos; }
+
+//! Position of the bracket matching the one at `pos`, or `npos` when it has none.
+size_t find_match(std::string_view source, size_t pos)
+{
+	const int direction = (source[pos] == '[') ? 1 : -1;
+	int depth = 0;
+
+	for (size_t i = pos; i < source.size(); i += size_t(direction))
+	{
+		depth += (source[i] == '[') ? direction : (source[i] == ']') ? -direction : 0;
+
+		if (depth == 0)
+		{
+			return i;
+		}
+	}
+
+	return std::string_view::npos;
+}
+
+bool balanced(std::string_view source)
+{
+	int depth = 0;
+
+	for (const char c : source)
+	{
+		depth += (c == '[') ? 1 : (c == ']') ? -1 : 0;
+
+		if (depth < 0)
+		{
+			return false;
+		}
+	}
+
+	return depth == 0;
+}
+
+//! Random code in the image of hand-written programs: arithmetic, moves, I/O, clears, copy loops, scans and loops.
+void generate_body(std::string& out, std::mt19937_64& rng, int depth)
+{
+	for (unsigned i = 0, count = 1 + rng() % 8; i < count; ++i)
+	{
+		const unsigned choice = rng() % 100;
+
+		if (choice < 30)
+		{
+			out.append(1 + rng() % 5, (rng() % 2 != 0) ? '+' : '-');
+		}
+		else if (choice < 50)
+		{
+			out.append(1 + rng() % 3, (rng() % 2 != 0) ? '>' : '<');
+		}
+		else if (choice < 60)
+		{
+			out += '.';
+		}
+		else if (choice < 63)
+		{
+			out += ',';
+		}
+		else if (choice < 70)
+		{
+			out += "[-]";
+		}
+		else if (choice < 90 && depth < 3)
+		{
+			out += '[';
+			generate_body(out, rng, depth + 1);
+			out += ']';
+		}
+		else if (choice < 95)
+		{
+			out += "[->+<]";
+		}
+		else
+		{
+			out += (rng() % 2 != 0) ? "[>]" : "[<]";
+		}
+	}
+}
+
+std::string generate_program(std::mt19937_64& rng)
+{
+	// Room on the left, as programs start on the first cell of the tape.
+	std::string out(8, '>');
+
+	for (unsigned i = 0, count = 1 + rng() % 4; i < count; ++i)
+	{
+		generate_body(out, rng, 0);
+	}
+
+	return out;
+}
+
+//! Applies a few random edits to `source`, keeping its brackets balanced.
+std::string mutate(std::string source, std::mt19937_64& rng)
+{
+	constexpr std::array<std::string_view, 5> snippets = {"[-]", "[->+<]", "[>]", "[<]", "[-<+>]"};
+	constexpr std::string_view commands = "+-<>.,";
+
+	for (unsigned i = 0, count = 1 + rng() % 8; i < count && !source.empty(); ++i)
+	{
+		const size_t pos = rng() % source.size();
+
+		switch (rng() % 4)
+		{
+		case 0: source.insert(pos, 1, commands[rng() % commands.size()]); break;
+		case 1: source.insert(pos, snippets[rng() % snippets.size()]); break;
+		case 2:
+		{
+			if (source[pos] == '[' || source[pos] == ']')
+			{
+				// Unwraps the loop, keeping its body.
+				const size_t match = find_match(source, pos);
+				source.erase(std::max(pos, match), 1);
+				source.erase(std::min(pos, match), 1);
+			}
+			else
+			{
+				source.erase(pos, 1);
+			}
+
+			break;
+		}
+		default:
+		{
+			if (source[pos] != '[' && source[pos] != ']')
+			{
+				source[pos] = commands[rng() % commands.size()];
+			}
+
+			break;
+		}
+		}
+	}
+
+	return source;
+}
+
+Case make_case(std::uint64_t seed, const std::vector<std::string>& corpus)
+{
+	std::mt19937_64 rng{seed};
+	Case c;
+
+	if (!corpus.empty() && rng() % 2 != 0)
+	{
+		c.source = mutate(corpus[rng() % corpus.size()], rng);
+	}
+	else
+	{
+		c.source = generate_program(rng);
+	}
+
+	for (unsigned i = 0, count = rng() % 16; i < count; ++i)
+	{
+		c.input += char(rng());
+	}
+
+	return c;
+}
+
+//! Runs `c` through the unoptimized interpreter. Cases that do not complete within the step limit or leave the tape
+//! have no behavior to compare to, and give nothing.
+std::optional<Outcome> run_reference(const Case& c, const FuzzParams& params)
+{
+	bf::Brainfuck bfi;
+
+	if (!bfi.compile(c.source) || !bfi.link())
+	{
+		return std::nullopt;
+	}
+
+	Outcome outcome;
+	std::istringstream in{c.input};
+	std::ostringstream out;
+
+	const auto status = bf::interpret(
+		bf::VmParams{
+			.memory_size = params.memory_size,
+			.in_stream = &in,
+			.out_stream = &out,
+			.data = bfi.data,
+			.step_limit = params.step_limit,
+			.check_bounds = true,
+			.final_tape = &outcome.tape,
+		},
+		bf::Bytecode{bfi.program}
+	);
+
+	if (status != bf::VmStatus::ok)
+	{
+		return std::nullopt;
+	}
+
+	outcome.output = std::move(out).str();
+	return outcome;
+}
+
+//! Quotes `str` for a report, escaping bytes that are not printable.
+std::string quote(std::string_view str)
+{
+	constexpr size_t max_length = 64;
+	std::string quoted = "\"";
+
+	for (const char c : str.substr(0, max_length))
+	{
+		quoted += (c >= ' ' && c <= '~' && c != '"' && c != '\\') ? std::string(1, c) : fmt::format("\\x{:02x}", std::uint8_t(c));
+	}
+
+	return quoted + ((str.size() > max_length) ? "\"..." : "\"");
+}
+
+bool write_file(const std::filesystem::path& path, const std::function<bool(std::ostream&)>& write)
+{
+	std::ofstream file{path, std::ios::binary};
+	return file && write(file) && file.flush();
+}
+
+//! Runs `c` through `engine` from its optimized program. Returns how it behaved differently from `reference`, if it did.
+std::optional<std::string> find_divergence(
+	const Case& c,
+	Engine engine,
+	const Outcome& reference,
+	const FuzzParams& params,
+	const std::filesystem::path& scratch_directory
+)
+{
+	bf::Brainfuck bfi;
+	bfi.compile(c.source);
+
+	bf::Optimizer opt;
+	opt.legal_overflow = params.legal_overflow;
+	opt.allow_suz      = params.allow_suz;
+	opt.warnings       = false;
+	opt.thread_count   = 1;
+
+	// Cases are only compared when they stay within the tape, which the optimized program must not break by accessing
+	// cells that the original does not.
+	opt.bounds_checked = true;
+	opt.optimize(bfi.program, bfi.data);
+
+	const auto codegen = [&](const std::filesystem::path& path, const auto& backend) {
+		return write_file(path, [&](std::ostream& out) {
+			return backend(bf::codegen::Context{bfi.program, bfi.data, out, params.memory_size});
+		});
+	};
+
+	const auto compare_output = [&](const std::optional<std::string>& output) -> std::optional<std::string> {
+		if (!output)
+		{
+			return "does not exit normally";
+		}
+
+		if (*output != reference.output)
+		{
+			const std::string_view actual = *output, expected = reference.output;
+			const size_t offset = size_t(
+				std::mismatch(actual.begin(), actual.end(), expected.begin(), expected.end()).first - actual.begin()
+			);
+
+			return fmt::format(
+				"writes {} instead of {} from byte {}",
+				quote(actual.substr(offset)),
+				quote(expected.substr(offset)),
+				offset
+			);
+		}
+
+		return std::nullopt;
+	};
+
+	const auto input_path = scratch_directory / "input";
+	const auto program_path = scratch_directory / "program";
+	const size_t output_limit = reference.output.size() + 1;
+
+	if (!write_file(input_path, [&](std::ostream& out) { return bool(out << c.input); }))
+	{
+		return "cannot be run, the input file cannot be written";
+	}
+
+	// C and LLVM codegen occurs before linking
+	if (engine == Engine::c)
+	{
+		const auto source_path = scratch_directory / "program.c";
+
+		if (!codegen(source_path, bf::codegen::c)
+			|| !run_process({params.cc, "-O1", "-w", source_path.string(), "-o", program_path.string()}, "/dev/null"))
+		{
+			return "emits C that does not build";
+		}
+
+		return compare_output(run_process({program_path.string()}, input_path, params.timeout, output_limit));
+	}
+
+	if (engine == Engine::llvm)
+	{
+		const auto source_path = scratch_directory / "program.ll";
+
+		if (!codegen(source_path, bf::codegen::llvm))
+		{
+			return "fails to emit LLVM IR";
+		}
+
+		return compare_output(run_process({params.lli, source_path.string()}, input_path, params.timeout, output_limit));
+	}
+
+	if (!bfi.link())
+	{
+		return "fails to link";
+	}
+
+	switch (engine)
+	{
+	case Engine::interpreter:
+	{
+		std::vector<std::uint8_t> tape;
+		std::istringstream in{c.input};
+		std::ostringstream out;
+
+		const auto status = bf::interpret(
+			bf::VmParams{
+				.memory_size = params.memory_size,
+				.in_stream = &in,
+				.out_stream = &out,
+				.data = bfi.data,
+				.step_limit = params.step_limit,
+				.check_bounds = true,
+				.final_tape = &tape,
+			},
+			bf::Bytecode{bfi.program}
+		);
+
+		if (status == bf::VmStatus::step_limit_reached)
+		{
+			return "exceeds the step limit";
+		}
+
+		if (status == bf::VmStatus::out_of_bounds)
+		{
+			return "accesses memory out of the tape";
+		}
+
+		if (auto divergence = compare_output(std::move(out).str()))
+		{
+			return divergence;
+		}
+
+		const auto cell = std::mismatch(tape.begin(), tape.end(), reference.tape.begin());
+
+		if (cell.first != tape.end())
+		{
+			return fmt::format("leaves cell {} at {} instead of {}", cell.first - tape.begin(), *cell.first, *cell.second);
+		}
+
+		return std::nullopt;
+	}
+
+	case Engine::asm_x86_64:
+	case Engine::asm_x86_64_v3:
+	{
+		const auto source_path = scratch_directory / "program.s";
+		const auto target = (engine == Engine::asm_x86_64_v3) ? bf::codegen::X86Target::x86_64_v3 : bf::codegen::X86Target::x86_64;
+
+		if (!codegen(source_path, [&](bf::codegen::Context ctx) { return bf::codegen::asm_x86_64(ctx, target); })
+			|| !run_process({params.cc, "-nostdlib", "-static", source_path.string(), "-o", program_path.string()}, "/dev/null"))
+		{
+			return "emits assembly that does not build";
+		}
+
+		return compare_output(run_process({program_path.string()}, input_path, params.timeout, output_limit));
+	}
+
+	case Engine::elf_x86_64:
+	{
+		if (!codegen(program_path, bf::codegen::elf_x86_64))
+		{
+			return "fails to emit an executable";
+		}
+
+		std::error_code error;
+		std::filesystem::permissions(program_path, std::filesystem::perms::owner_exec, std::filesystem::perm_options::add, error);
+
+		return compare_output(run_process({program_path.string()}, input_path, params.timeout, output_limit));
+	}
+
+	default: return std::nullopt;
+	}
+}
+
+//! Shrinks `c` for as long as `fails` holds: removes chunks of the program of decreasing sizes, unwraps loops and
+//! truncates the input, until none of those makes progress.
+void minimize(Case& c, const std::function<bool(const Case&)>& fails)
+{
+	for (bool progress = true; progress;)
+	{
+		progress = false;
+
+		const auto attempt = [&](Case candidate) {
+			if (balanced(candidate.source) && fails(candidate))
+			{
+				c = std::move(candidate);
+				progress = true;
+				return true;
+			}
+
+			return false;
+		};
+
+		for (size_t chunk = std::max<size_t>(c.source.size() / 2, 1);; chunk /= 2)
+		{
+			for (size_t i = 0; i + chunk <= c.source.size();)
+			{
+				Case candidate = c;
+				candidate.source.erase(i, chunk);
+
+				if (!attempt(std::move(candidate)))
+				{
+					i += chunk;
+				}
+			}
+
+			if (chunk == 1)
+			{
+				break;
+			}
+		}
+
+		// Loops whose body is needed but not the loop itself, which removing chunks cannot get rid of.
+		for (size_t i = 0; i < c.source.size(); ++i)
+		{
+			if (c.source[i] == '[')
+			{
+				Case candidate = c;
+				candidate.source.erase(find_match(candidate.source, i), 1);
+				candidate.source.erase(i, 1);
+				attempt(std::move(candidate));
+			}
+		}
+
+		while (!c.input.empty())
+		{
+			Case candidate = c;
+			candidate.input.pop_back();
+
+			if (!attempt(std::move(candidate)))
+			{
+				break;
+			}
+		}
+	}
+}
+
+//! Programs of `directory` with everything but commands stripped, to be mutated.
+bool load_corpus(const std::filesystem::path& directory, std::vector<std::string>& corpus)
+{
+	std::vector<std::filesystem::path> paths;
+
+	if (!list_corpus(directory, paths))
+	{
+		fmt::print(errout(fuzzinfo), "Failed to list the corpus in '{}'\n", directory.string());
+		return false;
+	}
+
+	for (const auto& path : paths)
+	{
+		std::string source = read_file(path).value_or("");
+		std::erase_if(source, [](char c) { return !is_command(c); });
+
+		if (balanced(source) && !source.empty())
+		{
+			corpus.push_back(std::move(source));
+		}
+	}
+
+	return true;
+}
+}
+
+int main(int argc, char** argv)
+{
+	const std::vector<std::string_view> args(argv, argv + argc);
+
+	FuzzFlags flags;
+	if (!parse_flags(flags.flags, args, 1))
+	{
+		return 1;
+	}
+
+	std::vector<Engine> engines;
+	if (!parse_engines(flags[FuzzFlag::engines].value, engines))
+	{
+		return 1;
+	}
+
+	std::vector<std::string> corpus;
+	if (const std::string& directory = flags[FuzzFlag::corpus]; !directory.empty() && !load_corpus(directory, corpus))
+	{
+		return 1;
+	}
+
+	const FuzzParams params{
+		.step_limit = std::stoul(flags[FuzzFlag::steps]),
+		.memory_size = std::stoul(flags[FuzzFlag::memory_size]),
+		.legal_overflow = flags[FuzzFlag::legalize_overflow],
+		.allow_suz = flags[FuzzFlag::optimize_suz],
+		.cc = flags[FuzzFlag::cc],
+		.lli = flags[FuzzFlag::lli],
+	};
+
+	const size_t case_count = std::stoul(flags[FuzzFlag::cases]);
+	const std::uint64_t first_seed = std::stoull(flags[FuzzFlag::seed]);
+	const size_t max_failures = std::stoul(flags[FuzzFlag::max_failures]);
+
+	const auto scratch_root = std::filesystem::temp_directory_path() / fmt::format("ashbf-fuzz-{}", getpid());
+
+	std::atomic<size_t> compared = 0, skipped = 0, failures = 0;
+	std::mutex report_mutex;
+
+	bf::ThreadPool pool{std::stoul(flags[FuzzFlag::threads])};
+	pool.parallel_for(case_count, [&](size_t i) {
+		if (failures >= max_failures)
+		{
+			return;
+		}
+
+		const std::uint64_t seed = first_seed + i;
+		Case c = make_case(seed, corpus);
+
+		const auto reference = run_reference(c, params);
+		if (!reference)
+		{
+			++skipped;
+			return;
+		}
+
+		++compared;
+
+		std::error_code error;
+		const auto scratch_directory = scratch_root / fmt::format("case{}", i);
+		std::filesystem::create_directories(scratch_directory, error);
+
+		for (const Engine engine : engines)
+		{
+			if (!find_divergence(c, engine, *reference, params, scratch_directory))
+			{
+				continue;
+			}
+
+			if (failures++ >= max_failures)
+			{
+				break;
+			}
+
+			minimize(c, [&](const Case& candidate) {
+				const auto candidate_reference = run_reference(candidate, params);
+				return candidate_reference && find_divergence(candidate, engine, *candidate_reference, params, scratch_directory);
+			});
+
+			const auto divergence = find_divergence(c, engine, *run_reference(c, params), params, scratch_directory);
+
+			std::lock_guard lock{report_mutex};
+			fmt::print(
+				errout(fuzzinfo),
+				"Seed {} diverges through {}: the optimized program {}\n",
+				seed,
+				engine_name(engine),
+				divergence.value_or("")
+			);
+			fmt::print(std::clog, "\tProgram (minimized): {}\n\tInput (minimized): {}\n", c.source, quote(c.input));
+			break;
+		}
+
+		std::filesystem::remove_all(scratch_directory, error);
+	});
+
+	std::error_code error;
+	std::filesystem::remove_all(scratch_root, error);
+
+	fmt::print(
+		infoout(fuzzinfo),
+		"{} cases compared, {} skipped as they do not complete or leave the tape, {} divergences\n",
+		size_t(compared),
+		size_t(skipped),
+		std::min(size_t(failures), max_failures)
+	);
+
+	return (failures != 0) ? 1 : 0;
+}
@@ -4,6 +4,7 @@
 #include "vm.hpp"
 
 #include <cstdint>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -12,6 +13,29 @@ namespace bf
 using Program = std::vector<VMOp>;
 using ProgramIt = Program::iterator;
 
+//! Constant data referred to by instructions, e.g. text written by bfWriteConst.
+using DataSegment = std::vector<std::uint8_t>;
+
+//! Blocks of cells used by bfSetBlock and bfAddBlock are stored in the data segment as their 16-bit little endian size
+//! followed by their bytes.
+constexpr std::size_t max_block_size = 0xFFFF;
+
+//! Appends a block of at most `max_block_size` bytes to `data`, returning the offset instructions refer to it by.
+inline VMArg append_block(DataSegment& data, std::span<const std::uint8_t> bytes)
+{
+	const auto offset = VMArg(data.size());
+	data.push_back(std::uint8_t(bytes.size()));
+	data.push_back(std::uint8_t(bytes.size() >> 8));
+	data.insert(data.end(), bytes.begin(), bytes.end());
+	return offset;
+}
+
+inline std::span<const std::uint8_t> get_block(std::span<const std::uint8_t> data, VMArg offset)
+{
+	const std::size_t size = data[offset] | (std::size_t(data[offset + 1]) << 8);
+	return data.subspan(offset + 2, size);
+}
+
 struct Brainfuck
 {
 	bool compile(std::string_view fname);
@@ -19,6 +43,7 @@ struct Brainfuck
 	bool link();
 		
 	std::vector<VMOp> program;
+	DataSegment data;
 };
 }
 
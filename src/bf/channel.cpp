@@ -0,0 +1,166 @@
+#include "channel.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace bf
+{
+ByteChannel::ByteChannel(std::size_t capacity) :
+	capacity(std::bit_ceil(std::max<std::size_t>(capacity, 1))),
+	ring(std::make_unique<char[]>(this->capacity))
+{}
+
+void ByteChannel::close_writer()
+{
+	write_end.publish();
+	tail.close();
+}
+
+void ByteChannel::close_reader()
+{
+	read_end.release();
+	head.close();
+}
+
+// A side announces that it waits before checking the position a last time, and the other side checks for that after
+// storing the position. Both being sequentially consistent, either the waiting side sees the new position, or the
+// storing side sees it waiting and wakes it.
+void ByteChannel::Position::store(std::uint64_t new_value)
+{
+	value.store(new_value);
+
+	if (waited_on.load())
+	{
+		value.notify_one();
+	}
+}
+
+void ByteChannel::Position::close()
+{
+	value.fetch_or(closed_bit);
+	value.notify_one();
+}
+
+std::uint64_t ByteChannel::Position::wait(std::uint64_t seen)
+{
+	waited_on.store(true);
+	value.wait(seen);
+	waited_on.store(false, std::memory_order_relaxed);
+
+	return value.load(std::memory_order_acquire);
+}
+
+void ByteChannel::Writer::publish()
+{
+	const auto count = std::size_t(pptr() - pbase());
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	written += count;
+	setp(pptr(), epptr());
+
+	channel.tail.store(written);
+}
+
+ByteChannel::Writer::int_type ByteChannel::Writer::overflow(int_type c)
+{
+	publish();
+
+	std::uint64_t head = channel.head.value.load(std::memory_order_acquire);
+	std::size_t room = 0;
+
+	for (;;)
+	{
+		// Output nobody reads is dropped, failing the stream so that the writer can tell it should stop.
+		if (head & closed_bit)
+		{
+			setp(nullptr, nullptr);
+			return traits_type::eof();
+		}
+
+		room = channel.capacity - std::size_t(written - head);
+
+		if (room != 0)
+		{
+			break;
+		}
+
+		head = channel.head.wait(head);
+	}
+
+	const std::size_t begin = written & (channel.capacity - 1);
+	const std::size_t size = std::min({room, channel.capacity - begin, publish_granularity});
+
+	setp(channel.ring.get() + begin, channel.ring.get() + begin + size);
+
+	if (!traits_type::eq_int_type(c, traits_type::eof()))
+	{
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(c);
+}
+
+int ByteChannel::Writer::sync()
+{
+	publish();
+	return (channel.head.value.load(std::memory_order_acquire) & closed_bit) ? -1 : 0;
+}
+
+void ByteChannel::Reader::release()
+{
+	const auto count = std::size_t(gptr() - eback());
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	read += count;
+	setg(gptr(), gptr(), egptr());
+
+	channel.head.store(read);
+}
+
+ByteChannel::Reader::int_type ByteChannel::Reader::underflow()
+{
+	release();
+
+	std::uint64_t tail = channel.tail.value.load(std::memory_order_acquire);
+	std::size_t available = 0;
+
+	for (;;)
+	{
+		available = std::size_t((tail & ~closed_bit) - read);
+
+		if (available != 0)
+		{
+			break;
+		}
+
+		if (tail & closed_bit)
+		{
+			return traits_type::eof();
+		}
+
+		if (tied != nullptr)
+		{
+			tied->pubsync();
+		}
+
+		tail = channel.tail.wait(tail);
+	}
+
+	const std::size_t begin = read & (channel.capacity - 1);
+	const std::size_t size = std::min(available, channel.capacity - begin);
+
+	char* window = channel.ring.get() + begin;
+	setg(window, window, window + size);
+
+	return traits_type::to_int_type(*gptr());
+}
+}
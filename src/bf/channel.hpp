@@ -0,0 +1,111 @@
+#ifndef CHANNEL_HPP
+#define CHANNEL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+
+namespace bf
+{
+//! Single-producer single-consumer byte queue between two threads, written through `writer()` and read through
+//! `reader()`.
+//!
+//! The put area of the writer and the get area of the reader are windows of the ring buffer itself, so that bytes get
+//! stored right into it and loaded right out of it. Written bytes are published to the reader when the window is full
+//! and when the writer gets flushed. Either side blocks while the ring is full or empty.
+class ByteChannel
+{
+public:
+	static constexpr std::size_t default_capacity = 1 << 16;
+
+	//! `capacity` is rounded up to a power of two.
+	explicit ByteChannel(std::size_t capacity = default_capacity);
+
+	ByteChannel(const ByteChannel&) = delete;
+	ByteChannel& operator=(const ByteChannel&) = delete;
+
+	std::streambuf& writer() { return write_end; }
+	std::streambuf& reader() { return read_end; }
+
+	//! Publishes the bytes written so far and ends the stream: the reader gets EOF once it has read them.
+	void close_writer();
+
+	//! Tells the writer that nothing gets read anymore: it stops waiting for room, and its writes and flushes fail from
+	//! then on, as writing to a pipe without reader would.
+	void close_reader();
+
+	//! Has the reader flush `output` before waiting for bytes. Unlike `std::ios::tie`, reads that do not wait flush
+	//! nothing, so that a thread reading the channel and writing `output` hands its output over before it blocks.
+	void tie_reader(std::streambuf* output) { read_end.tied = output; }
+
+private:
+	//! Set in `head` and `tail` once their side is closed. The other bits count the bytes ever read and written.
+	static constexpr std::uint64_t closed_bit = std::uint64_t(1) << 63;
+
+	//! Most bytes the writer holds before publishing them, so that the reader can start on them early.
+	static constexpr std::size_t publish_granularity = 1 << 12;
+
+	class Writer : public std::streambuf
+	{
+	public:
+		explicit Writer(ByteChannel& channel) : channel(channel) {}
+
+		void publish();
+
+	protected:
+		int_type overflow(int_type c) override;
+		int sync() override;
+
+	private:
+		ByteChannel& channel;
+		std::uint64_t written = 0;
+	};
+
+	class Reader : public std::streambuf
+	{
+	public:
+		explicit Reader(ByteChannel& channel) : channel(channel) {}
+
+		void release();
+
+		std::streambuf* tied = nullptr;
+
+	protected:
+		int_type underflow() override;
+
+	private:
+		ByteChannel& channel;
+		std::uint64_t read = 0;
+	};
+
+	//! Bytes read or written by one side. Storing it only wakes the other side when that one waits, as waking costs a
+	//! system call even when nobody waits.
+	struct Position
+	{
+		std::atomic<std::uint64_t> value{0};
+		std::atomic<bool> waited_on{false};
+
+		void store(std::uint64_t new_value);
+
+		//! Stores `new_value | closed_bit`.
+		void close();
+
+		//! Waits for the position to differ from `seen`, and returns it.
+		std::uint64_t wait(std::uint64_t seen);
+	};
+
+	std::size_t capacity;
+	std::unique_ptr<char[]> ring;
+
+	// Kept on separate cache lines, as each is written by one thread and polled by the other.
+	alignas(64) Position head;
+	alignas(64) Position tail;
+
+	alignas(64) Writer write_end{*this};
+	Reader read_end{*this};
+};
+}
+
+#endif // CHANNEL_HPP
@@ -1,206 +1,746 @@
+#include "chunks.hpp"
 #include "codegen.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <cstdint>
 #include <fmt/core.h>
-#include <sstream>
+#include <map>
+#include <set>
+#include <span>
+#include <string>
 #include <string_view>
+#include <vector>
 
 namespace bf::codegen
 {
-bool asm_x86_64(Context ctx)
+namespace
 {
-	fmt::print(ctx.out,
-R"(
-.text
-.globl _start
-_start:
+//! Size of the output and input buffers.
+constexpr size_t io_buffer_size = 65536;
+
+//! Routines the generated code calls for I/O. Registers they rely on are:
+//! - %r13: bytes pending in the output buffer, %r14: the output buffer;
+//! - %r15: bytes consumed from the input buffer, %rbx: bytes available in it.
+//! Syscalls clobber %rcx and %r11, so the routines preserve %rcx for `cout` loops, and %rsi, the tape pointer.
+constexpr std::string_view runtime = R"(
+# Runtime
+
+# Writes %rdx bytes at %rsi to stdout. Clobbers %rax, %rdi, %rsi, %rdx, %rcx and %r11.
+bfwriteall:
+testq %rdx, %rdx
+jz bfwritealldone
+movq $1, %rax
+movq $1, %rdi
+syscall
+testq %rax, %rax
+jle bfwritealldone # Output is gone, drop the rest
+addq %rax, %rsi
+subq %rax, %rdx
+jmp bfwriteall
+bfwritealldone:
+ret
+
+# Writes the output buffer out.
+bfflush:
+pushq %rax
+pushq %rcx
+pushq %rsi
+movq %r14, %rsi
+movq %r13, %rdx
+call bfwriteall
+xorq %r13, %r13
+popq %rsi
+popq %rcx
+popq %rax
+ret
+
+# Outputs the byte in %al.
+bfputc:
+movb %al, (%r14, %r13)
+incq %r13
+cmpq ${0}, %r13
+je bfflush
+ret
+
+# Outputs %r9 bytes at %r8.
+bfwrite:
+leaq (%r13, %r9), %rax
+cmpq ${0}, %rax
+ja bfwritelarge
+pushq %rcx
+pushq %rsi
+movq %r8, %rsi
+leaq (%r14, %r13), %rdi
+movq %r9, %rcx
+rep movsb
+addq %r9, %r13
+popq %rsi
+popq %rcx
+ret
+bfwritelarge:
+call bfflush
+pushq %rcx
+pushq %rsi
+movq %r8, %rsi
+movq %r9, %rdx
+call bfwriteall
+popq %rsi
+popq %rcx
+ret
+
+# Reads a byte into %al, 255 at the end of input. Pending output is written out before blocking on a read.
+bfgetc:
+cmpq %rbx, %r15
+jb bfgetcbuffered
+call bfflush
+pushq %rcx
+pushq %rsi
+movq $0, %rax
+movq $0, %rdi
+leaq bfinbuf(%rip), %rsi
+movq ${0}, %rdx
+syscall
+popq %rsi
+popq %rcx
+xorq %r15, %r15
+movq %rax, %rbx
+testq %rax, %rax
+jg bfgetcbuffered
+xorq %rbx, %rbx
+movb $255, %al
+ret
+bfgetcbuffered:
+leaq bfinbuf(%rip), %rdi
+movb (%rdi, %r15), %al
+incq %r15
+ret
+)";
+
+//! Registers cells can be cached in. The runtime clobbers some of them, which does not matter as cached cells are written
+//! back before anything calls into it.
+constexpr std::array<std::string_view, 8> cell_registers{"%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%bpl", "%dl", "%dil"};
+
+void shift_pointer(fmt::memory_buffer& out, VMArg by)
+{
+	switch (by)
+	{
+	case -1: emit(out, "decq %rsi\n"); break;
+	case  1: emit(out, "incq %rsi\n"); break;
+	default: emit(out, "addq ${}, %rsi\n", by);
+	}
+}
 
-# Stack initialization
-movq $30000, %rcx
+//! Emits `%eax *= factor`, for a factor above 0, through `lea` and shifts when they can do.
+void multiply_eax(fmt::memory_buffer& out, std::uint32_t factor)
+{
+	const int shift = std::countr_zero(factor);
+	const std::uint32_t odd = factor >> shift;
 
-bfzeromemory:
-movq $0, (%rsp)
-decq %rsp
-loopq bfzeromemory
+	if (odd == 3 || odd == 5 || odd == 9)
+	{
+		emit(out, "leal (%rax, %rax, {}), %eax\n", odd - 1);
+	}
+	else if (odd != 1)
+	{
+		emit(out, "imull ${}, %eax, %eax\n", factor);
+		return;
+	}
 
-# Init tape pointer
-movq %rsp, %rsi
-)");
+	if (shift != 0)
+	{
+		emit(out, "shll ${}, %eax\n", shift);
+	}
+}
+
+//! Lanes of a compare mask on the cells of a scan with a power-of-two stride, from the first lane on.
+std::uint32_t stride_lanes(VMArg stride)
+{
+	switch (std::abs(stride))
+	{
+	case 2: return 0x55555555;
+	case 4: return 0x11111111;
+	case 8: return 0x01010101;
+	default: return 0xFFFFFFFF;
+	}
+}
+
+//! Emits the scan of `suz` instruction `i`, knowing the current cell is not zero, then jumps back after it.
+//!
+//! Strides of up to 8 cells that are powers of two search whole aligned vectors at once, keeping the lanes that are on
+//! the stride with a mask. Aligned loads cannot fault as long as the tape itself is aligned, even when part of the vector
+//! is off the tape, and those lanes are masked out of the first vector. Other strides use a scalar loop.
+void emit_scan(fmt::memory_buffer& out, VMArg stride, X86Target target, size_t i)
+{
+	const VMArg magnitude = std::abs(stride);
 
-	std::stringstream late_labels;
+	if (magnitude > 8 || !std::has_single_bit(std::uint32_t(magnitude)))
+	{
+		shift_pointer(out, stride);
+		emit(out,
+			"cmpb $0, (%rsi)\n"
+			"jne bfoplate{}\n"
+			"jmp bfop{}\n",
+			i,
+			i + 1);
+		return;
+	}
 
-	auto shift_ptr = [](VMArg by, std::ostream& out) {
-		switch (by)
+	const bool is_avx2 = target == X86Target::x86_64_v3;
+	const int width = is_avx2 ? 32 : 16;
+	const bool is_forward = stride > 0;
+
+	// Compares the vector at %rax against zero, into a mask in %edx.
+	const auto compare = [&] {
+		if (is_avx2)
 		{
-		case -1: fmt::print(out, "decq %rsi\n"); break;
-		case  1: fmt::print("incq %rsi\n"); break;
-		default: fmt::print("addq ${}, %rsi\n", by);
+			emit(out,
+				"vpcmpeqb (%rax), %ymm0, %ymm1\n"
+				"vpmovmskb %ymm1, %edx\n");
+		}
+		else
+		{
+			emit(out,
+				"movdqa (%rax), %xmm1\n"
+				"pcmpeqb %xmm0, %xmm1\n"
+				"pmovmskb %xmm1, %edx\n");
 		}
 	};
 
-	auto is_power_of_two = [](auto x) {
-		return !(x & (x - 1)); // Bitwise magic
+	// First vector: only lanes from the current cell onward, in the direction of the scan, and on the stride.
+	emit(out,
+		"movq %rsi, %rax\n"
+		"andq ${0}, %rax\n"
+		"movl %esi, %ecx\n"
+		"andl ${1}, %ecx\n",
+		-width, width - 1);
+
+	if (is_forward)
+	{
+		emit(out,
+			"movl $-1, %r8d\n"
+			"shll %cl, %r8d\n");
+	}
+	else
+	{
+		emit(out,
+			"movl $2, %r8d\n"
+			"shll %cl, %r8d\n"
+			"decl %r8d\n");
+	}
+
+	if (magnitude > 1)
+	{
+		// The vector is aligned on a multiple of the stride, so the cells on it share the lane of the current cell
+		// modulo the stride.
+		emit(out,
+			"andl ${0}, %ecx\n"
+			"movl ${1:#x}, %edi\n"
+			"shll %cl, %edi\n"
+			"andl %edi, %r8d\n",
+			magnitude - 1, stride_lanes(stride));
+	}
+
+	emit(out, "{}\n", is_avx2 ? "vpxor %ymm0, %ymm0, %ymm0" : "pxor %xmm0, %xmm0");
+	compare();
+	emit(out,
+		"andl %r8d, %edx\n"
+		"jnz bfopscanfound{0}\n"
+		"bfopscanloop{0}:\n"
+		"{1} ${2}, %rax\n",
+		i, is_forward ? "addq" : "subq", width);
+	compare();
+	emit(out, "{}\n", (magnitude > 1) ? "andl %edi, %edx" : "testl %edx, %edx");
+	emit(out,
+		"jz bfopscanloop{0}\n"
+		"bfopscanfound{0}:\n"
+		"{1} %edx, %edx\n"
+		"leaq (%rax, %rdx), %rsi\n"
+		"{2}"
+		"jmp bfop{3}\n",
+		i, is_forward ? "bsfl" : "bsrl", is_avx2 ? "vzeroupper\n" : "", i + 1);
+}
+
+//! Whether `op` only accesses cells at a fixed offset of the tape pointer.
+bool is_cell_op(const VMOp& op)
+{
+	switch (op.opcode)
+	{
+	case bfAdd:
+	case bfSet:
+	case bfAddOffset:
+	case bfSetOffset:
+	case bfShift:
+	case bfMAC: return true;
+	default: return false;
+	}
+}
+
+//! Calls `f` with the cells accessed by `op`, relative to where the tape pointer is `pos`.
+template<class F>
+void for_each_cell(const VMOp& op, VMArg pos, F&& f)
+{
+	switch (op.opcode)
+	{
+	case bfAdd:
+	case bfSet: f(pos); break;
+	case bfAddOffset:
+	case bfSetOffset: f(pos + op.args[1]); break;
+	case bfMAC:
+	{
+		f(pos);
+		f(pos + op.args[1]);
+		break;
+	}
+	default: break;
+	}
+}
+
+//! Lowers the cell accesses of straight-line code.
+//!
+//! Shifts of the tape pointer are deferred and folded into the displacement of the accesses that follow them, and the
+//! cells a block accesses more than once are kept in registers. `flush` writes the registers back and applies the pending
+//! shift, which has to happen before anything that jumps, is jumped to or calls into the runtime.
+class CellLowering
+{
+public:
+	CellLowering(fmt::memory_buffer*& out, std::span<const VMOp> program, const std::vector<bool>& jump_targets) :
+		out{out},
+		program{program},
+		jump_targets{jump_targets}
+	{}
+
+	void shift(VMArg by) { delta += by; }
+
+	//! Operand for reading the cell at `offset` from the tape pointer.
+	std::string read(VMArg offset) { return operand(offset, false); }
+
+	//! Operand for writing the cell at `offset` from the tape pointer. `overwrite` tells that its value is not read first.
+	std::string write(VMArg offset, bool overwrite = false)
+	{
+		std::string result = operand(offset, overwrite);
+
+		if (auto it = loaded.find(delta + offset); it != loaded.end())
+		{
+			it->second.dirty = true;
+		}
+
+		return result;
+	}
+
+	//! Picks the cells to keep in registers for the block starting at `begin`, unless that was done already.
+	void plan(size_t begin)
+	{
+		if (planned)
+		{
+			return;
+		}
+
+		planned = true;
+
+		std::map<VMArg, size_t> accesses;
+		VMArg pos = delta;
+
+		for (size_t i = begin; i < program.size() && is_cell_op(program[i]) && (i == begin || !jump_targets[i]); ++i)
+		{
+			for_each_cell(program[i], pos, [&](VMArg cell) { ++accesses[cell]; });
+
+			if (program[i].opcode == bfShift)
+			{
+				pos += program[i].args[0];
+			}
+		}
+
+		std::vector<std::pair<size_t, VMArg>> candidates;
+		for (const auto& [cell, count] : accesses)
+		{
+			if (count > 1)
+			{
+				candidates.emplace_back(count, cell);
+			}
+		}
+
+		std::stable_sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+		candidates.resize(std::min(candidates.size(), cell_registers.size()));
+
+		for (size_t reg = 0; reg < candidates.size(); ++reg)
+		{
+			assigned[candidates[reg].second] = reg;
+		}
+	}
+
+	//! Loads every cell of the body of a balanced innermost loop into registers, so that they stay there across iterations.
+	//! Returns false when the body is not such a loop or accesses too many cells. The lowering must be flushed.
+	bool load_loop(std::span<const VMOp> body)
+	{
+		std::set<VMArg> cells{0};
+		VMArg pos = 0;
+
+		for (const auto& op : body)
+		{
+			if (!is_cell_op(op))
+			{
+				return false;
+			}
+
+			for_each_cell(op, pos, [&](VMArg cell) { cells.insert(cell); });
+
+			if (op.opcode == bfShift)
+			{
+				pos += op.args[0];
+			}
+		}
+
+		if (pos != 0 || cells.size() > cell_registers.size())
+		{
+			return false;
+		}
+
+		planned = true;
+
+		size_t reg = 0;
+		for (const VMArg cell : cells)
+		{
+			assigned[cell] = reg;
+			loaded[cell] = {reg, false};
+			emit(*out, "movb {}, {}\n", memory(cell), cell_registers[reg]);
+			++reg;
+		}
+
+		return true;
+	}
+
+	//! Register of the cell under the tape pointer, within a loop loaded by `load_loop`.
+	std::string_view current_register() const { return cell_registers[loaded.at(delta).reg]; }
+
+	void flush()
+	{
+		for (const auto& [cell, entry] : loaded)
+		{
+			if (entry.dirty)
+			{
+				emit(*out, "movb {}, {}\n", cell_registers[entry.reg], memory(cell));
+			}
+		}
+
+		loaded.clear();
+		assigned.clear();
+		planned = false;
+
+		if (delta != 0)
+		{
+			shift_pointer(*out, delta);
+			delta = 0;
+		}
+	}
+
+private:
+	struct Entry
+	{
+		size_t reg;
+		bool dirty;
 	};
 
-	// assuming is_power_of_two(x)
-	auto get_power_of_two = [](auto x) {
-		for (size_t i = 0;; ++i)
+	static std::string memory(VMArg cell) { return (cell == 0) ? "(%rsi)" : fmt::format("{}(%rsi)", cell); }
+
+	std::string operand(VMArg offset, bool overwrite)
+	{
+		const VMArg cell = delta + offset;
+
+		if (auto it = loaded.find(cell); it != loaded.end())
+		{
+			return std::string{cell_registers[it->second.reg]};
+		}
+
+		if (auto it = assigned.find(cell); it != assigned.end())
 		{
-			if ((1 << i) == x)
+			if (!overwrite)
 			{
-				return i;
+				emit(*out, "movb {}, {}\n", memory(cell), cell_registers[it->second]);
 			}
+
+			loaded[cell] = {it->second, false};
+			return std::string{cell_registers[it->second]};
 		}
+
+		return memory(cell);
+	}
+
+	fmt::memory_buffer*& out;
+	std::span<const VMOp> program;
+	const std::vector<bool>& jump_targets;
+
+	//! Shift of the tape pointer not applied yet.
+	VMArg delta = 0;
+
+	bool planned = false;
+
+	//! Registers of the cells picked by the plan, and of those loaded so far, relative to the unshifted tape pointer.
+	std::map<VMArg, size_t> assigned;
+	std::map<VMArg, Entry> loaded;
+};
+
+//! Assembly of a chunk of the program. Late labels and cold code go after the code of every chunk.
+struct ChunkOutput
+{
+	fmt::memory_buffer code, late_labels, cold_code;
+};
+
+//! Emits the instructions of `chunk`, which starts and ends outside of any loop or if.
+bool emit_chunk(
+	const Context&           ctx,
+	X86Target                target,
+	const std::vector<bool>& jump_targets,
+	Chunk                    chunk,
+	ChunkOutput&             output)
+{
+	auto make_late_label = [&output](auto x) -> fmt::memory_buffer& {
+		emit(output.late_labels, "\nbfoplate{}:\n", x);
+		return output.late_labels;
+	};
+
+	// Loops and ifs that rarely run according to the profile get their body emitted to `cold_code`, after the rest.
+	fmt::memory_buffer* out = &output.code;
+	std::size_t cold_end = 0;
+
+	auto is_cold = [&](VMArg loop_id) {
+		const LoopProfile* loop = (ctx.profile != nullptr) ? ctx.profile->find(loop_id) : nullptr;
+		return loop != nullptr && loop->is_cold();
 	};
 
-	auto make_late_label = [&late_labels](auto x) -> std::stringstream& {
-		fmt::print(late_labels, "\nbfoplate{}:\n", x);
-		return late_labels;
+	auto leave_cold_code = [&](size_t i) {
+		if (out == &output.cold_code && i == cold_end)
+		{
+			emit(*out, "jmp bfop{}\n", i);
+			out = &output.code;
+		}
 	};
 
-	std::size_t i = 0;
-	for (auto& op : ctx.program)
+	CellLowering lower{out, ctx.program, jump_targets};
+
+	// Index of the `jnz` ending the loop whose cells are all held in registers, if any.
+	std::size_t register_loop_end = 0;
+
+	for (size_t i = chunk.begin; i < chunk.end; ++i)
 	{
-		fmt::print(ctx.out, "\nbfop{}:\n", i);
+		const auto& op = ctx.program[i];
+
+		if (jump_targets[i] && register_loop_end == 0)
+		{
+			lower.flush();
+		}
+
+		leave_cold_code(i);
+
+		emit(*out, "\nbfop{}:\n", i);
+
+		if (is_cell_op(op))
+		{
+			lower.plan(i);
+		}
+		else if (op.opcode != bfCheckRange && !(op.opcode == bfJmpNotZero && i == register_loop_end))
+		{
+			lower.flush();
+		}
 
 		switch (op.opcode)
 		{
 		case bf::Opcode::bfAdd:
-			fmt::print(ctx.out, "addb ${}, (%rsi)\n", op.args[0]);
+			emit(*out, "addb ${}, {}\n", op.args[0], lower.write(0));
 			break;
 
 		case bf::Opcode::bfAddOffset:
-			fmt::print(ctx.out, "addb ${}, {}(%rsi)\n", op.args[0], op.args[1]);
+			emit(*out, "addb ${}, {}\n", op.args[0], lower.write(op.args[1]));
 			break;
 
 		case bf::Opcode::bfShift:
-		    shift_ptr(op.args[0], ctx.out);
+			lower.shift(op.args[0]);
 			break;
 
 		case bf::Opcode::bfMAC:
-			// TODO: optimize out at a maximum
-			fmt::print(ctx.out,
-                "movq ${}, %rdx\n"
-				"movb (%rsi, %rdx), %al\n",
-                op.args[1]
-            );
+		{
+			// Only the low byte of the product matters, so a negative factor is a subtraction of its opposite.
+			const auto factor = std::uint8_t(op.args[0]);
+			if (factor == 0)
+			{
+				break;
+			}
 
-			// TODO: handle negative power of two
-			// not currently doing it as i have to write a testcase
+			const bool is_negative = factor > 128;
 
-			if (op.args[0] == 1)
+			emit(*out, "movzbl {}, %eax\n", lower.read(op.args[1]));
+			multiply_eax(*out, is_negative ? 256 - factor : factor);
+			emit(*out, "{} %al, {}\n", is_negative ? "subb" : "addb", lower.write(0));
+			break;
+		}
+
+		case bf::Opcode::bfCharOut: {
+			bool is_looped = (op.args[0] > 1);
+
+			emit(*out, "movb (%rsi), %al\n");
+
+			if (is_looped)
 			{
-				fmt::print(ctx.out, "addb %al, (%rsi)\n");
+				emit(*out,
+					"movq ${}, %rcx\n"
+					"bfopcore{}:\n"
+					"call bfputc\n"
+					"loop bfopcore{}\n",
+					op.args[0], i, i);
 			}
-			else if (op.args[0] == -1)
+			else
 			{
-				fmt::print(ctx.out, "subb %al, (%rsi)\n");
+				emit(*out, "call bfputc\n");
 			}
-			else if (op.args[0] > 0 && is_power_of_two(op.args[0]))
+
+			} break;
+
+		case bf::Opcode::bfWriteConst:
+			emit(*out,
+				"leaq bfdata+{}(%rip), %r8\n"
+				"movq ${}, %r9\n"
+				"call bfwrite\n",
+				op.args[0], op.args[1]);
+			break;
+
+		case bf::Opcode::bfCharIn:
+			emit(*out,
+				"call bfgetc\n"
+				"movb %al, (%rsi)\n");
+			break;
+
+		case bf::Opcode::bfSetBlock:
+		case bf::Opcode::bfAddBlock:
+		{
+			// SSE2 is part of the x86-64 baseline, so 16 cells at once. The rest is done cell by cell.
+			const auto block = get_block(ctx.data, op.args[0]);
+			const bool is_set = op.opcode == bf::Opcode::bfSetBlock;
+			size_t j = 0;
+
+			for (; j + 16 <= block.size(); j += 16)
 			{
-				fmt::print(ctx.out,
-                    "shll ${}, %eax\n"
-						"addb %al, (%rsi)\n",
-                        get_power_of_two(op.args[0])
-                );
+				if (is_set)
+				{
+					emit(*out,
+						"movdqu bfdata+{}(%rip), %xmm0\n"
+						"movdqu %xmm0, {}(%rsi)\n",
+						op.args[0] + 2 + j, op.args[1] + j);
+				}
+				else
+				{
+					emit(*out,
+						"movdqu bfdata+{}(%rip), %xmm0\n"
+						"movdqu {}(%rsi), %xmm1\n"
+						"paddb %xmm0, %xmm1\n"
+						"movdqu %xmm1, {}(%rsi)\n",
+						op.args[0] + 2 + j, op.args[1] + j, op.args[1] + j);
+				}
 			}
-			else
+
+			for (; j < block.size(); ++j)
 			{
-				fmt::print(ctx.out,
-                    "imull ${}, %eax\n"
-					    "addb %al, (%rsi)\n",
-                        op.args[0]
-                );
+				if (is_set)
+				{
+					emit(*out, "movb ${}, {}(%rsi)\n", block[j], op.args[1] + j);
+				}
+				else if (block[j] != 0)
+				{
+					emit(*out, "addb ${}, {}(%rsi)\n", block[j], op.args[1] + j);
+				}
 			}
 
+			break;
+		}
 
+		case bf::Opcode::bfCheckRange:
+			// Bounds are only checked by the interpreter.
 			break;
 
-		case bf::Opcode::bfCharOut: {
-			bool is_looped = (op.args[0] > 2);
+		case bf::Opcode::bfJmpZero:
+		{
+			const auto target = size_t(op.args[0]);
 
-			if (is_looped)
+			if (out == &output.code && is_cold(op.args[1]))
 			{
-				fmt::print(ctx.out,
-R"(
-mov ${}, %rcx
+				// Move the body out of the way of the hot path, jumping back past it once done.
+				emit(*out,
+					"cmpb $0, (%rsi)\n"
+					"jne bfop{}\n",
+					i + 1);
+
+				out = &output.cold_code;
+				cold_end = target;
+				break;
+			}
 
-# Write syscall (output character)
-bfopcore{}:
-movq %rcx, %r15 # Because %rcx is overriden by syscall
-movq $1, %rax
-movq $1, %rdi
-movq $1, %rdx
-syscall
+			const bool is_loop = ctx.program[target - 1].opcode == bfJmpNotZero
+				&& size_t(ctx.program[target - 1].args[0]) == i + 1;
 
-movq %r15, %rcx
-loop bfopcore{}
-)", op.args[0], i, i);
-			}
-			else
+			if (is_loop && lower.load_loop(std::span{ctx.program}.subspan(i + 1, target - i - 2)))
 			{
-				fmt::print(ctx.out,
-R"(
-# Write syscall (output character)
-bfopcore{}:
-movq $1, %rax
-movq $1, %rdi
-movq $1, %rdx
-syscall
-)", i);
+				// The cells stay in registers across iterations and get written back once the loop exits.
+				emit(*out,
+					"testb {0}, {0}\n"
+					"je bfloopexit{1}\n",
+					lower.current_register(), i);
+
+				register_loop_end = target - 1;
+				break;
 			}
 
-			} break;
-
-		/*case bf::Opcode::bfCharIn:
-
-			break;*/
-
-		case bf::Opcode::bfJmpZero:
-			fmt::print(ctx.out,
+			emit(*out,
 				"cmpb $0, (%rsi)\n"
 				"je bfop{}\n",
-                op.args[0]);
+				op.args[0]);
 			break;
+		}
 
 		case bf::Opcode::bfJmpNotZero:
-			fmt::print(ctx.out,
+			if (i == register_loop_end)
+			{
+				emit(*out,
+					"testb {0}, {0}\n"
+					"jne bfop{1}\n"
+					"bfloopexit{2}:\n",
+					lower.current_register(), op.args[0], op.args[0] - 1);
+
+				lower.flush();
+				register_loop_end = 0;
+				break;
+			}
+
+			emit(*out,
 				"cmpb $0, (%rsi)\n"
 				"jne bfop{}\n",
-                op.args[0]);
+				op.args[0]);
 			break;
 
 		case bf::Opcode::bfSet:
-			fmt::print(ctx.out, "movb ${}, (%rsi)\n", op.args[0]);
+			emit(*out, "movb ${}, {}\n", op.args[0], lower.write(0, true));
 			break;
 
 		case bf::Opcode::bfSetOffset:
-			fmt::print(ctx.out, "movb ${}, {}(%rsi)\n", op.args[0], op.args[1]);
+			emit(*out, "movb ${}, {}\n", op.args[0], lower.write(op.args[1], true));
 			break;
 
 		case bf::Opcode::bfShiftUntilZero:
-            fmt::print(ctx.out,
+			emit(*out,
 				"cmpb $0, (%rsi)\n"
-				"jne bfoplate{}\n", i);
+				"jne bfoplate{}\n",
+				i);
 
-			make_late_label(i);
-			shift_ptr(op.args[0], late_labels);
-			fmt::print(ctx.out,
-				"cmpb $0, (%rsi)\n"
-				"jne bfoplate{}\n"
-				"jmp bfop{}\n",
-                i,
-                i+1
-            );
+			emit_scan(make_late_label(i), op.args[0], target, i);
 
 			break;
 
 		case bf::Opcode::bfEnd:
-			fmt::print(ctx.out,
-				"# Cleanup stack pointer - unnecessary as proceeding with exit()\n"
-				"# addq $30000, %rsp\n"
+			emit(*out,
+				"call bfflush\n"
 				"\n"
 				"# Exit syscall\n"
 				"movq $60, %rax\n"
-				"movq $0, %rsi\n"
+				"xorq %rdi, %rdi\n"
 				"syscall\n");
 			break;
 
@@ -209,14 +749,116 @@ syscall
 			return false;
 		}
 
-		++i;
 	}
 
+	lower.flush();
+	leave_cold_code(chunk.end);
+
+	return true;
+}
+}
+
+bool asm_x86_64(Context ctx, X86Target target)
+{
+	// Cached cells have to be written back wherever control flow joins.
+	std::vector<bool> jump_targets(ctx.program.size() + 1);
+	for (const auto& op : ctx.program)
+	{
+		if (op.opcode == bfJmpZero || op.opcode == bfJmpNotZero)
+		{
+			jump_targets[size_t(op.args[0])] = true;
+		}
+	}
+
+	// Chunks start at loops and ifs outside of any other, where no cell is cached and no cold code is being emitted.
+	std::vector<bool> is_top_level_block(ctx.program.size());
+	std::vector<size_t> block_ends;
+
+	for (size_t i = 0; i < ctx.program.size(); ++i)
+	{
+		while (!block_ends.empty() && block_ends.back() == i)
+		{
+			block_ends.pop_back();
+		}
+
+		if (ctx.program[i].opcode == bfJmpZero)
+		{
+			is_top_level_block[i] = block_ends.empty();
+			block_ends.push_back(size_t(ctx.program[i].args[0]));
+		}
+	}
+
+	const auto chunks = split_chunks(ctx.program.size(), ctx.thread_count, [&](size_t i) { return is_top_level_block[i]; });
+
+	std::vector<ChunkOutput> outputs;
+	if (!emit_chunks(chunks, ctx.thread_count, outputs, [&](Chunk chunk, ChunkOutput& output) {
+			return emit_chunk(ctx, target, jump_targets, chunk, output);
+		}))
+	{
+		return false;
+	}
+
+	fmt::print(ctx.out,
+R"(
+.text
+.globl _start
+_start:
+
+# The tape is in .bss, which the kernel maps zeroed
+leaq bftape(%rip), %rsi
+leaq bfoutbuf(%rip), %r14
+xorq %r13, %r13
+xorq %r15, %r15
+xorq %rbx, %rbx
+)");
+
+	for (const auto& output : outputs)
+	{
+		write(ctx.out, output.code);
+	}
+
+	fmt::print(ctx.out, "\n# Late labels, reducing unnecessary branching in a few occasions\n");
+
+	for (const auto& output : outputs)
+	{
+		write(ctx.out, output.late_labels);
+	}
+
+	if (std::any_of(outputs.begin(), outputs.end(), [](const auto& output) { return output.cold_code.size() != 0; }))
+	{
+		fmt::print(ctx.out, "\n# Cold code, rarely executed according to the profile\n");
+
+		for (const auto& output : outputs)
+		{
+			write(ctx.out, output.cold_code);
+		}
+	}
+
+	fmt::print(ctx.out, runtime, io_buffer_size);
+
 	fmt::print(ctx.out,
-		"\n# Late labels, reducing unnecessary branching in a few occasions\n"
-        "{}\n",
-        late_labels.str()
-    );
+		"\n.bss\n"
+		"# Scans load aligned vectors, which must not cross the start of the tape\n"
+		".balign 32\n"
+		"bftape:\n"
+		".skip {}\n"
+		".lcomm bfoutbuf, {}\n"
+		".lcomm bfinbuf, {}\n",
+		ctx.memory_size, io_buffer_size, io_buffer_size);
+
+	if (!ctx.data.empty())
+	{
+		fmt::memory_buffer data;
+		emit(data, "\n.section .rodata\nbfdata:");
+
+		for (size_t i = 0; i < ctx.data.size(); ++i)
+		{
+			emit(data, "{}{}", (i % 16 == 0) ? "\n.byte " : ", ", ctx.data[i]);
+		}
+
+		emit(data, "\n");
+		write(ctx.out, data);
+	}
 
 	return true;
 }
@@ -4,7 +4,15 @@
 namespace bf::codegen
 {
 struct Context;
-bool asm_x86_64(Context ctx);
+
+//! Instruction set the generated code may use, as with the `-march` option of C compilers.
+enum class X86Target
+{
+	x86_64,   //!< Baseline, which includes SSE2
+	x86_64_v3 //!< With AVX2
+};
+
+bool asm_x86_64(Context ctx, X86Target target = X86Target::x86_64);
 }
 
 #endif
@@ -1,89 +1,265 @@
+#include "chunks.hpp"
 #include "codegen.hpp"
 
+#include <algorithm>
+#include <vector>
+
 namespace bf::codegen
 {
-bool c(Context ctx)
+namespace
 {
-	fmt::print(ctx.out,
-		"#include <stdio.h>\n"
-		"\n"
-		"int main()\n"
-		"{{\n"
-		"\tunsigned char memory[30000] = {{0}};\n"
-		"\tunsigned char *sp = memory;\n"
-		"\n");
+//! Condition of a loop or if, hinted with the polarity the profile observed when it is clear-cut.
+std::string condition(const Context& ctx, VMArg loop_id, bool is_loop)
+{
+	const LoopProfile* loop = (ctx.profile != nullptr) ? ctx.profile->find(loop_id) : nullptr;
 
-	for (size_t i = 0; i < ctx.program.size(); ++i)
+	if (loop == nullptr || loop->reached == 0)
+	{
+		return "*sp != 0";
+	}
+
+	const double probability = is_loop ? loop->loop_probability() : loop->entry_probability();
+
+	if (probability > 0.9)
+	{
+		return "__builtin_expect(*sp != 0, 1)";
+	}
+
+	if (probability < 0.1)
+	{
+		return "__builtin_expect(*sp != 0, 0)";
+	}
+
+	return "*sp != 0";
+}
+
+//! Emits the statements of `chunk`, which starts and ends outside of any loop or if.
+bool emit_chunk(const Context& ctx, Chunk chunk, fmt::memory_buffer& out)
+{
+	size_t depth = 1;
+
+	for (size_t i = chunk.begin; i < chunk.end; ++i)
 	{
-		auto& op = ctx.program[i];
+		const auto& op = ctx.program[i];
+
+		if (op.opcode == Opcode::bfLoopEnd || op.opcode == Opcode::bfIfEnd)
+		{
+			--depth;
+		}
 
-		fmt::print(ctx.out, "\tbfop{}: ", i);
+		emit(out, "{:\t>{}}", "", depth);
 
 		switch (op.opcode)
 		{
 		case Opcode::bfAdd:
-			fmt::print(ctx.out, "*sp += {};\n", op.args[0]);
+			emit(out, "*sp += {};\n", op.args[0]);
 			break;
 
 		case Opcode::bfAddOffset:
-			fmt::print(ctx.out, "*(sp + {}) += {};\n", op.args[1], op.args[0]);
+			emit(out, "sp[{}] += {};\n", op.args[1], op.args[0]);
 			break;
 
 		case Opcode::bfShift:
-			fmt::print(ctx.out, "sp += {};\n", op.args[0]);
+			emit(out, "sp += {};\n", op.args[0]);
 			break;
 
 		case Opcode::bfMAC:
-			fmt::print(ctx.out, "*sp += {} * *(sp + {});\n", op.args[0], op.args[1]);
+			emit(out, "*sp += {} * sp[{}];\n", op.args[0], op.args[1]);
 			break;
 
 		case Opcode::bfCharOut:
-			fmt::print(ctx.out, "for (int i = 0; i < {}; ++i) {{ putchar((char)(*sp)); }}\n", op.args[0]);
+			if (op.args[0] == 1)
+			{
+				emit(out, "bf_putc(*sp);\n");
+			}
+			else
+			{
+				emit(out, "for (int i = 0; i < {}; ++i) {{ bf_putc(*sp); }}\n", op.args[0]);
+			}
 			break;
 
-		/*case Opcode::bfCharIn:
+		case Opcode::bfCharIn:
+			emit(out, "*sp = bf_getc();\n");
+			break;
 
-			break;*/
+		case Opcode::bfWriteConst:
+			emit(out, "bf_write(data + {}, {});\n", op.args[0], op.args[1]);
+			break;
+
+		case Opcode::bfSetBlock:
+		{
+			const auto block = get_block(ctx.data, op.args[0]);
+
+			if (std::all_of(block.begin(), block.end(), [&](auto byte) { return byte == block.front(); }))
+			{
+				emit(out, "memset(sp + {}, {}, {});\n", op.args[1], block.front(), block.size());
+			}
+			else
+			{
+				emit(out, "memcpy(sp + {}, data + {}, {});\n", op.args[1], op.args[0] + 2, block.size());
+			}
 
-		case Opcode::bfJmpZero:
-			fmt::print(ctx.out, "if (*sp == 0) {{ goto bfop{}; }}\n", op.args[0]);
 			break;
+		}
 
-		case Opcode::bfJmpNotZero:
-			fmt::print(ctx.out, "if (*sp != 0) {{ goto bfop{}; }}\n", op.args[0]);
+		case Opcode::bfAddBlock:
+		{
+			const auto block = get_block(ctx.data, op.args[0]);
+			emit(
+				out,
+				"for (int i = 0; i < {}; ++i) {{ sp[{} + i] += data[{} + i]; }}\n",
+				block.size(),
+				op.args[1],
+				op.args[0] + 2
+			);
 			break;
+		}
 
 		case Opcode::bfLoopBegin:
-			fmt::print(ctx.out, "while (*sp != 0) {{\n");
+			emit(out, "while ({}) {{\n", condition(ctx, op.args[0], true));
+			++depth;
+			break;
+
+		case Opcode::bfIfBegin:
+			emit(out, "if ({}) {{\n", condition(ctx, op.args[0], false));
+			++depth;
 			break;
 
 		case Opcode::bfLoopEnd:
-			fmt::print(ctx.out, "(void)0; }}\n");
+		case Opcode::bfIfEnd:
+			emit(out, "}}\n");
 			break;
 
 		case Opcode::bfSet:
-			fmt::print(ctx.out, "*sp = {};\n", op.args[0]);
+			emit(out, "*sp = {};\n", op.args[0]);
 			break;
 
 		case Opcode::bfSetOffset:
-			fmt::print(ctx.out, "*(sp + {}) = {};\n", op.args[1], op.args[0]);
+			emit(out, "sp[{}] = {};\n", op.args[1], op.args[0]);
 			break;
 
 		case Opcode::bfShiftUntilZero:
-			fmt::print(ctx.out, "while (*sp != 0) {{ sp += {}; }}\n", op.args[0]);
+			emit(out, "while (*sp != 0) {{ sp += {}; }}\n", op.args[0]);
 			break;
 
 		case Opcode::bfEnd:
-			fmt::print(ctx.out, "return 0;\n");
+			emit(out, "return;\n");
 			break;
 
 		default:
-			fmt::print(errout(codegenx8664info), "Unhandled opcode: {}\n", op.opcode);
+			fmt::print(errout(codegencinfo), "Unhandled opcode: {}\n", op.opcode);
 			return false;
 		}
 	}
 
-	fmt::print(ctx.out, "}}\n");
+
+	return true;
+}
+}
+
+bool c(Context ctx)
+{
+	// Output goes through a buffer of our own, written out with a single fwrite when full, before reading input and at
+	// exit. Input goes through the stdio buffer, as fread would block until its own buffer is full.
+	fmt::print(ctx.out,
+		"#include <stdio.h>\n"
+		"#include <string.h>\n"
+		"\n"
+		"static unsigned char memory[{}];\n"
+		"\n"
+		"static unsigned char out_buffer[65536];\n"
+		"static size_t out_size;\n"
+		"\n"
+		"static void bf_flush(void)\n"
+		"{{\n"
+		"\tfwrite(out_buffer, 1, out_size, stdout);\n"
+		"\tout_size = 0;\n"
+		"}}\n"
+		"\n"
+		"static inline void bf_putc(unsigned char c)\n"
+		"{{\n"
+		"\tout_buffer[out_size++] = c;\n"
+		"\tif (out_size == sizeof(out_buffer)) {{ bf_flush(); }}\n"
+		"}}\n"
+		"\n"
+		"static inline void bf_write(const unsigned char *bytes, size_t size)\n"
+		"{{\n"
+		"\tif (out_size + size > sizeof(out_buffer)) {{ bf_flush(); }}\n"
+		"\tif (size > sizeof(out_buffer)) {{ fwrite(bytes, 1, size, stdout); return; }}\n"
+		"\tmemcpy(out_buffer + out_size, bytes, size);\n"
+		"\tout_size += size;\n"
+		"}}\n"
+		"\n"
+		"/* Reads a byte, 255 at the end of input as with the interpreter. */\n"
+		"static inline unsigned char bf_getc(void)\n"
+		"{{\n"
+		"\tif (out_size != 0) {{ bf_flush(); }}\n"
+		"\tint c = getchar();\n"
+		"\treturn (c == EOF) ? 255 : (unsigned char)c;\n"
+		"}}\n"
+		"\n",
+		ctx.memory_size);
+
+	if (!ctx.data.empty())
+	{
+		fmt::memory_buffer out;
+		emit(out, "static const unsigned char data[{}] = {{", ctx.data.size());
+
+		for (size_t i = 0; i < ctx.data.size(); ++i)
+		{
+			emit(out, "{}{}, ", (i % 16 == 0) ? "\n\t" : "", ctx.data[i]);
+		}
+
+		emit(out, "\n}};\n\n");
+		write(ctx.out, out);
+	}
+
+	// The tape is only ever accessed through `sp`, which `restrict` tells the C compiler.
+	fmt::print(ctx.out,
+		"static void run(unsigned char *restrict sp)\n"
+		"{{\n");
+
+	// Chunks start at loops and ifs outside of any other.
+	std::vector<bool> is_top_level_block(ctx.program.size());
+	size_t depth = 0;
+
+	for (size_t i = 0; i < ctx.program.size(); ++i)
+	{
+		switch (ctx.program[i].opcode)
+		{
+		case Opcode::bfLoopBegin:
+		case Opcode::bfIfBegin: is_top_level_block[i] = (depth++ == 0); break;
+		case Opcode::bfLoopEnd:
+		case Opcode::bfIfEnd: --depth; break;
+		default: break;
+		}
+	}
+
+	const auto chunks = split_chunks(ctx.program.size(), ctx.thread_count, [&](size_t i) { return is_top_level_block[i]; });
+
+	std::vector<fmt::memory_buffer> outputs;
+	if (!emit_chunks(chunks, ctx.thread_count, outputs, [&](Chunk chunk, fmt::memory_buffer& out) {
+			return emit_chunk(ctx, chunk, out);
+		}))
+	{
+		return false;
+	}
+
+	for (const auto& output : outputs)
+	{
+		write(ctx.out, output);
+	}
+
+	fmt::print(ctx.out,
+		"}}\n"
+		"\n"
+		"int main(void)\n"
+		"{{\n"
+		"\tsetvbuf(stdout, NULL, _IONBF, 0);\n"
+		"\trun(memory);\n"
+		"\tbf_flush();\n"
+		"\treturn 0;\n"
+		"}}\n");
 
 	return true;
 }
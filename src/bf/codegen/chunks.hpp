@@ -0,0 +1,89 @@
+#ifndef CHUNKS_HPP
+#define CHUNKS_HPP
+
+#include "../threadpool.hpp"
+#include <algorithm>
+#include <fmt/format.h>
+#include <iterator>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace bf::codegen
+{
+//! Appends formatted text to `buffer`.
+template<class... Args>
+void emit(fmt::memory_buffer& buffer, fmt::format_string<Args...> format, Args&&... args)
+{
+	fmt::format_to(std::back_inserter(buffer), format, std::forward<Args>(args)...);
+}
+
+inline void write(std::ostream& out, const fmt::memory_buffer& buffer)
+{
+	out.write(buffer.data(), std::streamsize(buffer.size()));
+}
+
+//! Range of instructions [begin, end) that gets emitted on its own.
+struct Chunk
+{
+	size_t begin, end;
+};
+
+//! Programs are only split in chunks of at least this many instructions, below which threads cost more than they save.
+constexpr size_t min_chunk_size = 1 << 16;
+
+//! Splits a program of `size` instructions in chunks, cutting only before instructions for which `can_cut` holds.
+template<class F>
+std::vector<Chunk> split_chunks(size_t size, size_t thread_count, F&& can_cut)
+{
+	if (thread_count <= 1)
+	{
+		return {{0, size}};
+	}
+
+	// A few chunks per thread even out the differences in cost between them.
+	const size_t target_size = std::max(min_chunk_size, size / (thread_count * 4) + 1);
+
+	std::vector<Chunk> chunks;
+	size_t begin = 0;
+
+	for (size_t i = begin + target_size; i < size; ++i)
+	{
+		if (can_cut(i))
+		{
+			chunks.push_back({begin, i});
+			begin = i;
+			i = begin + target_size - 1;
+		}
+	}
+
+	chunks.push_back({begin, size});
+	return chunks;
+}
+
+//! Emits every chunk into its own `Output` with `emit_chunk(chunk, output)`, concurrently when there are several of
+//! them. Returns whether every chunk was emitted.
+template<class Output, class F>
+bool emit_chunks(const std::vector<Chunk>& chunks, size_t thread_count, std::vector<Output>& outputs, F&& emit_chunk)
+{
+	outputs.resize(chunks.size());
+
+	// Not a vector<bool>, which chunks could not write to concurrently.
+	std::vector<char> succeeded(chunks.size(), false);
+	const auto run = [&](size_t i) { succeeded[i] = emit_chunk(chunks[i], outputs[i]); };
+
+	if (chunks.size() == 1)
+	{
+		run(0);
+	}
+	else
+	{
+		ThreadPool pool{std::min(thread_count, chunks.size())};
+		pool.parallel_for(chunks.size(), run);
+	}
+
+	return std::all_of(succeeded.begin(), succeeded.end(), [](char ok) { return ok; });
+}
+}
+
+#endif // CHUNKS_HPP
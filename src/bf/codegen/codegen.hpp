@@ -3,18 +3,31 @@
 
 #include "../bf.hpp"
 #include "../logger.hpp"
+#include "../profile.hpp"
 #include <ostream>
 
 namespace bf::codegen
 {
 struct Context
 {
-	bf::Program&  program;
-	std::ostream& out;
+	bf::Program&           program;
+	const bf::DataSegment& data;
+	std::ostream&          out;
+
+	//! Cells of the tape.
+	size_t                 memory_size;
+
+	//! Profile of a previous run, used to lay out and hint branches. May be null.
+	const bf::Profile*     profile = nullptr;
+
+	//! Threads emitting independent chunks of large programs concurrently, at least 1.
+	size_t                 thread_count = 1;
 };
 } // namespace bf::codegen
 
 #include "asm-x86-64.hpp"
 #include "c.hpp"
+#include "elf-x86-64.hpp"
+#include "llvm.hpp"
 
 #endif
@@ -0,0 +1,651 @@
+#include "codegen.hpp"
+#include <bit>
+#include <cstdint>
+#include <fmt/core.h>
+#include <initializer_list>
+#include <vector>
+
+namespace bf::codegen
+{
+namespace
+{
+//! Where the executable gets loaded, as `ld` does by default for non-PIE executables.
+constexpr std::uint64_t load_address = 0x400000;
+constexpr std::uint64_t page_size = 0x1000;
+
+constexpr size_t elf_header_size = 64, program_header_size = 56;
+constexpr size_t headers_size = elf_header_size + 2 * program_header_size;
+
+//! Size of the output and input buffers.
+constexpr size_t io_buffer_size = 65536;
+
+enum Reg : std::uint8_t
+{
+	rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15
+};
+
+enum Condition : std::uint8_t
+{
+	cond_b = 0x2,
+	cond_e = 0x4,
+	cond_ne = 0x5,
+	cond_le = 0xE
+};
+
+//! Opcodes of the `op r/m, r` forms of the ALU instructions, and extensions of their `op r/m, imm32` forms.
+enum AluOp : std::uint8_t
+{
+	op_add = 0x01,
+	op_sub = 0x29,
+	op_xor = 0x31,
+	op_cmp = 0x39,
+	op_test = 0x85,
+	op_mov = 0x89
+};
+
+enum AluExt : std::uint8_t
+{
+	ext_add = 0,
+	ext_cmp = 7
+};
+
+//! Segment an absolute address points to. Addresses get resolved once the size of the code is known.
+enum class Segment
+{
+	data,
+	bss
+};
+
+//! Encodes the few x86-64 instructions the backend needs, with labels and fixups resolved by `link`.
+class Encoder
+{
+public:
+	using Label = size_t;
+
+	std::vector<std::uint8_t> code;
+
+	Label new_label()
+	{
+		labels.push_back(0);
+		return labels.size() - 1;
+	}
+
+	void bind(Label label) { labels[label] = code.size(); }
+
+	void byte(std::uint8_t value) { code.push_back(value); }
+
+	void imm32(std::uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			byte(std::uint8_t(value >> (i * 8)));
+		}
+	}
+
+	//! REX prefix for registers in the reg and r/m fields of the ModRM byte, when one is needed.
+	void rex(bool wide, unsigned reg, unsigned rm)
+	{
+		const std::uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+
+		if (prefix != 0x40)
+		{
+			byte(prefix);
+		}
+	}
+
+	//! Instruction with the register or opcode extension `reg` and the register `rm`.
+	void op_rr(std::uint8_t opcode, bool wide, unsigned reg, unsigned rm)
+	{
+		rex(wide, reg, rm);
+		byte(opcode);
+		byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+	}
+
+	//! Instruction with the register or opcode extension `reg` and the memory operand `disp(base)`.
+	void op_rm(std::initializer_list<std::uint8_t> opcode, bool wide, unsigned reg, unsigned base, std::int32_t disp)
+	{
+		rex(wide, reg, base);
+
+		for (const auto value : opcode)
+		{
+			byte(value);
+		}
+
+		const std::uint8_t fields = ((reg & 7) << 3) | (base & 7);
+		const bool needs_sib = (base & 7) == rsp;
+
+		// rbp and r13 as a base always take a displacement
+		if (disp == 0 && (base & 7) != rbp)
+		{
+			byte(fields);
+			if (needs_sib) { byte(0x24); }
+		}
+		else if (disp >= -128 && disp <= 127)
+		{
+			byte(0x40 | fields);
+			if (needs_sib) { byte(0x24); }
+			byte(std::uint8_t(disp));
+		}
+		else
+		{
+			byte(0x80 | fields);
+			if (needs_sib) { byte(0x24); }
+			imm32(std::uint32_t(disp));
+		}
+	}
+
+	void alu(AluOp op, bool wide, Reg dst, Reg src) { op_rr(op, wide, src, dst); }
+
+	void alu(AluExt ext, Reg dst, std::int32_t value)
+	{
+		op_rr(0x81, true, ext, dst);
+		imm32(std::uint32_t(value));
+	}
+
+	void alu(AluExt ext, Reg dst, Segment segment, std::uint32_t offset)
+	{
+		op_rr(0x81, true, ext, dst);
+		relocate(segment, offset);
+	}
+
+	//! `mov $value, %r32`, which zeroes the upper half of the register.
+	void mov(Reg dst, std::uint32_t value)
+	{
+		rex(false, 0, dst);
+		byte(0xB8 + (dst & 7));
+		imm32(value);
+	}
+
+	void mov(Reg dst, Segment segment, std::uint32_t offset)
+	{
+		rex(false, 0, dst);
+		byte(0xB8 + (dst & 7));
+		relocate(segment, offset);
+	}
+
+	void inc(Reg reg) { op_rr(0xFF, true, 0, reg); }
+	void dec(Reg reg) { op_rr(0xFF, true, 1, reg); }
+
+	void push(Reg reg)
+	{
+		rex(false, 0, reg);
+		byte(0x50 + (reg & 7));
+	}
+
+	void pop(Reg reg)
+	{
+		rex(false, 0, reg);
+		byte(0x58 + (reg & 7));
+	}
+
+	void call(Label label) { branch({0xE8}, label); }
+	void jmp(Label label) { branch({0xE9}, label); }
+	void jcc(Condition condition, Label label) { branch({0x0F, std::uint8_t(0x80 | condition)}, label); }
+
+	//! `loop` back to a label bound at most 128 bytes before.
+	void loop(Label label)
+	{
+		byte(0xE2);
+		byte(std::uint8_t(labels[label] - (code.size() + 1)));
+	}
+
+	void ret() { byte(0xC3); }
+
+	void syscall()
+	{
+		byte(0x0F);
+		byte(0x05);
+	}
+
+	//! Resolves branches and absolute addresses, given where the code, data and .bss segments get loaded.
+	void link(std::uint64_t data_address, std::uint64_t bss_address)
+	{
+		for (const auto& fixup : branches)
+		{
+			patch(fixup.position, std::uint32_t(labels[fixup.label] - (fixup.position + 4)));
+		}
+
+		for (const auto& relocation : relocations)
+		{
+			const auto base = (relocation.segment == Segment::data) ? data_address : bss_address;
+			patch(relocation.position, std::uint32_t(base + relocation.offset));
+		}
+	}
+
+private:
+	struct Branch
+	{
+		size_t position;
+		Label  label;
+	};
+
+	struct Relocation
+	{
+		size_t        position;
+		Segment       segment;
+		std::uint32_t offset;
+	};
+
+	void branch(std::initializer_list<std::uint8_t> opcode, Label label)
+	{
+		for (const auto value : opcode)
+		{
+			byte(value);
+		}
+
+		branches.push_back({code.size(), label});
+		imm32(0);
+	}
+
+	void relocate(Segment segment, std::uint32_t offset)
+	{
+		relocations.push_back({code.size(), segment, offset});
+		imm32(0);
+	}
+
+	void patch(size_t position, std::uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			code[position + i] = std::uint8_t(value >> (i * 8));
+		}
+	}
+
+	std::vector<size_t>     labels;
+	std::vector<Branch>     branches;
+	std::vector<Relocation> relocations;
+};
+
+//! Layout of the .bss segment.
+struct BssLayout
+{
+	std::uint32_t tape = 0, out_buffer, in_buffer, size;
+
+	explicit BssLayout(size_t memory_size) :
+		out_buffer{std::uint32_t((memory_size + 63) & ~size_t(63))},
+		in_buffer{std::uint32_t(out_buffer + io_buffer_size)},
+		size{std::uint32_t(in_buffer + io_buffer_size)}
+	{}
+};
+
+//! Routines the generated code calls for I/O, equivalent to the runtime of the assembly backend. Registers they rely
+//! on are:
+//! - %r13: end of the pending output in the output buffer;
+//! - %r15: next byte to read in the input buffer, %rbx: end of the input read so far.
+struct Runtime
+{
+	Encoder::Label writeall, flush, putc, write, getc;
+
+	explicit Runtime(Encoder& e) :
+		writeall{e.new_label()},
+		flush{e.new_label()},
+		putc{e.new_label()},
+		write{e.new_label()},
+		getc{e.new_label()}
+	{}
+
+	void emit(Encoder& e, const BssLayout& bss) const
+	{
+		// Writes %rdx bytes at %rsi to stdout. Clobbers %rax, %rdi, %rsi, %rdx, %rcx and %r11.
+		const auto writeall_done = e.new_label();
+		e.bind(writeall);
+		e.alu(op_test, true, rdx, rdx);
+		e.jcc(cond_e, writeall_done);
+		e.mov(rax, 1);
+		e.mov(rdi, 1);
+		e.syscall();
+		e.alu(op_test, true, rax, rax);
+		e.jcc(cond_le, writeall_done); // Output is gone, drop the rest
+		e.alu(op_add, true, rsi, rax);
+		e.alu(op_sub, true, rdx, rax);
+		e.jmp(writeall);
+		e.bind(writeall_done);
+		e.ret();
+
+		// Writes the output buffer out.
+		e.bind(flush);
+		e.push(rax);
+		e.push(rcx);
+		e.push(rsi);
+		e.mov(rsi, Segment::bss, bss.out_buffer);
+		e.alu(op_mov, true, rdx, r13);
+		e.alu(op_sub, true, rdx, rsi);
+		e.call(writeall);
+		e.mov(r13, Segment::bss, bss.out_buffer);
+		e.pop(rsi);
+		e.pop(rcx);
+		e.pop(rax);
+		e.ret();
+
+		// Outputs the byte in %al.
+		e.bind(putc);
+		e.op_rm({0x88}, false, rax, r13, 0);
+		e.inc(r13);
+		e.alu(ext_cmp, r13, Segment::bss, bss.out_buffer + io_buffer_size);
+		e.jcc(cond_e, flush);
+		e.ret();
+
+		// Outputs %r9 bytes at %r8.
+		const auto write_done = e.new_label();
+		e.bind(write);
+		e.alu(op_test, true, r9, r9);
+		e.jcc(cond_e, write_done);
+		e.op_rm({0x8A}, false, rax, r8, 0);
+		e.call(putc);
+		e.inc(r8);
+		e.dec(r9);
+		e.jmp(write);
+		e.bind(write_done);
+		e.ret();
+
+		// Reads a byte into %al, 255 at the end of input. Pending output is written out before blocking on a read.
+		const auto getc_buffered = e.new_label(), getc_eof = e.new_label();
+		e.bind(getc);
+		e.alu(op_cmp, true, r15, rbx);
+		e.jcc(cond_b, getc_buffered);
+		e.call(flush);
+		e.push(rcx);
+		e.push(rsi);
+		e.mov(rax, 0);
+		e.mov(rdi, 0);
+		e.mov(rsi, Segment::bss, bss.in_buffer);
+		e.mov(rdx, io_buffer_size);
+		e.syscall();
+		e.pop(rsi);
+		e.pop(rcx);
+		e.mov(r15, Segment::bss, bss.in_buffer);
+		e.alu(op_test, true, rax, rax);
+		e.jcc(cond_le, getc_eof);
+		e.alu(op_mov, true, rbx, r15);
+		e.alu(op_add, true, rbx, rax);
+		e.bind(getc_buffered);
+		e.op_rm({0x8A}, false, rax, r15, 0);
+		e.inc(r15);
+		e.ret();
+		e.bind(getc_eof);
+		e.alu(op_mov, true, rbx, r15);
+		e.mov(rax, 255);
+		e.ret();
+	}
+};
+
+template<class T>
+void put(std::vector<std::uint8_t>& bytes, T value)
+{
+	for (size_t i = 0; i < sizeof(T); ++i)
+	{
+		bytes.push_back(std::uint8_t(std::uint64_t(value) >> (i * 8)));
+	}
+}
+
+void put_program_header(
+	std::vector<std::uint8_t>& bytes,
+	std::uint32_t              flags,
+	std::uint64_t              offset,
+	std::uint64_t              address,
+	std::uint64_t              file_size,
+	std::uint64_t              memory_size)
+{
+	put<std::uint32_t>(bytes, 1); // PT_LOAD
+	put<std::uint32_t>(bytes, flags);
+	put<std::uint64_t>(bytes, offset);
+	put<std::uint64_t>(bytes, address);
+	put<std::uint64_t>(bytes, address);
+	put<std::uint64_t>(bytes, file_size);
+	put<std::uint64_t>(bytes, memory_size);
+	put<std::uint64_t>(bytes, page_size);
+}
+}
+
+bool elf_x86_64(Context ctx)
+{
+	const BssLayout bss{ctx.memory_size};
+	Encoder e;
+
+	std::vector<Encoder::Label> op_labels(ctx.program.size() + 1);
+	for (auto& label : op_labels)
+	{
+		label = e.new_label();
+	}
+
+	// Shifts get applied before anything that is jumped to or needs the tape pointer itself.
+	std::vector<bool> jump_targets(ctx.program.size() + 1);
+	for (const auto& op : ctx.program)
+	{
+		if (op.opcode == bfJmpZero || op.opcode == bfJmpNotZero)
+		{
+			jump_targets[size_t(op.args[0])] = true;
+		}
+	}
+
+	std::int32_t delta = 0;
+	const auto apply_shift = [&] {
+		if (delta != 0)
+		{
+			e.alu(ext_add, rsi, delta);
+			delta = 0;
+		}
+	};
+
+	// The program starts at the entry point, and the runtime comes after it.
+	const Runtime runtime{e};
+
+	e.mov(rsi, Segment::bss, bss.tape);
+	e.mov(r13, Segment::bss, bss.out_buffer);
+	e.alu(op_xor, false, r15, r15);
+	e.alu(op_xor, false, rbx, rbx);
+
+	for (size_t i = 0; i < ctx.program.size(); ++i)
+	{
+		const auto& op = ctx.program[i];
+
+		const bool is_cell_op = op.opcode == bfAdd || op.opcode == bfSet || op.opcode == bfAddOffset
+			|| op.opcode == bfSetOffset || op.opcode == bfShift || op.opcode == bfMAC || op.opcode == bfSetBlock
+			|| op.opcode == bfAddBlock || op.opcode == bfCheckRange;
+
+		if (jump_targets[i] || !is_cell_op)
+		{
+			apply_shift();
+		}
+
+		e.bind(op_labels[i]);
+
+		switch (op.opcode)
+		{
+		case bfAdd:
+		case bfAddOffset:
+		{
+			e.op_rm({0x80}, false, 0, rsi, delta + (op.opcode == bfAddOffset ? op.args[1] : 0));
+			e.byte(std::uint8_t(op.args[0]));
+			break;
+		}
+
+		case bfSet:
+		case bfSetOffset:
+		{
+			e.op_rm({0xC6}, false, 0, rsi, delta + (op.opcode == bfSetOffset ? op.args[1] : 0));
+			e.byte(std::uint8_t(op.args[0]));
+			break;
+		}
+
+		case bfShift: delta += op.args[0]; break;
+
+		case bfMAC:
+		{
+			// Only the low byte of the product matters, so a negative factor is a subtraction of its opposite.
+			const auto factor = std::uint8_t(op.args[0]);
+			if (factor == 0)
+			{
+				break;
+			}
+
+			const bool is_negative = factor > 128;
+			const std::uint32_t magnitude = is_negative ? 256 - factor : factor;
+
+			e.op_rm({0x0F, 0xB6}, false, rax, rsi, delta + op.args[1]);
+
+			if (std::has_single_bit(magnitude))
+			{
+				if (magnitude != 1)
+				{
+					e.op_rr(0xC1, false, 4, rax);
+					e.byte(std::uint8_t(std::countr_zero(magnitude)));
+				}
+			}
+			else
+			{
+				e.op_rr(0x69, false, rax, rax);
+				e.imm32(magnitude);
+			}
+
+			e.op_rm({std::uint8_t(is_negative ? 0x28 : 0x00)}, false, rax, rsi, delta);
+			break;
+		}
+
+		case bfSetBlock:
+		case bfAddBlock:
+		{
+			const auto block = get_block(ctx.data, op.args[0]);
+			const bool is_set = op.opcode == bfSetBlock;
+
+			for (size_t j = 0; j < block.size(); ++j)
+			{
+				if (is_set || block[j] != 0)
+				{
+					e.op_rm({std::uint8_t(is_set ? 0xC6 : 0x80)}, false, 0, rsi, delta + op.args[1] + std::int32_t(j));
+					e.byte(block[j]);
+				}
+			}
+
+			break;
+		}
+
+		case bfCheckRange:
+			// Bounds are only checked by the interpreter.
+			break;
+
+		case bfCharOut:
+		{
+			e.op_rm({0x8A}, false, rax, rsi, 0);
+
+			if (op.args[0] > 1)
+			{
+				const auto repeat = e.new_label();
+				e.mov(rcx, std::uint32_t(op.args[0]));
+				e.bind(repeat);
+				e.call(runtime.putc);
+				e.loop(repeat);
+			}
+			else
+			{
+				e.call(runtime.putc);
+			}
+
+			break;
+		}
+
+		case bfWriteConst:
+		{
+			e.mov(r8, Segment::data, std::uint32_t(op.args[0]));
+			e.mov(r9, std::uint32_t(op.args[1]));
+			e.call(runtime.write);
+			break;
+		}
+
+		case bfCharIn:
+		{
+			e.call(runtime.getc);
+			e.op_rm({0x88}, false, rax, rsi, 0);
+			break;
+		}
+
+		case bfJmpZero:
+		case bfJmpNotZero:
+		{
+			e.op_rm({0x80}, false, ext_cmp, rsi, 0);
+			e.byte(0);
+			e.jcc(op.opcode == bfJmpZero ? cond_e : cond_ne, op_labels[size_t(op.args[0])]);
+			break;
+		}
+
+		case bfShiftUntilZero:
+		{
+			const auto scan = e.new_label();
+			e.op_rm({0x80}, false, ext_cmp, rsi, 0);
+			e.byte(0);
+			e.jcc(cond_e, op_labels[i + 1]);
+			e.bind(scan);
+			e.alu(ext_add, rsi, op.args[0]);
+			e.op_rm({0x80}, false, ext_cmp, rsi, 0);
+			e.byte(0);
+			e.jcc(cond_ne, scan);
+			break;
+		}
+
+		case bfEnd:
+		{
+			e.call(runtime.flush);
+			e.mov(rax, 60);
+			e.alu(op_xor, false, rdi, rdi);
+			e.syscall();
+			break;
+		}
+
+		default:
+			fmt::print(errout(codegenelfinfo), "Unhandled opcode: {}\n", op.opcode);
+			return false;
+		}
+	}
+
+	e.bind(op_labels.back());
+	runtime.emit(e, bss);
+
+	// Code and data share the first segment after the headers, .bss gets the next page on its own.
+	const std::uint64_t code_address = load_address + headers_size;
+	const std::uint64_t data_address = code_address + e.code.size();
+	const std::uint64_t file_size = headers_size + e.code.size() + ctx.data.size();
+	const std::uint64_t bss_address = (load_address + file_size + page_size - 1) & ~(page_size - 1);
+
+	// Addresses are 32-bit immediates, sign-extended by some instructions.
+	if (bss_address + bss.size > 0x7FFFFFFF)
+	{
+		fmt::print(errout(codegenelfinfo), "The program and its tape of {} cells do not fit below 2GiB\n", ctx.memory_size);
+		return false;
+	}
+
+	e.link(data_address, bss_address);
+
+	std::vector<std::uint8_t> headers;
+	headers.reserve(headers_size);
+
+	// ELF header: 64-bit, little endian, System V, executable for x86-64
+	headers = {0x7F, 'E', 'L', 'F', 2, 1, 1, 0};
+	headers.resize(16);
+	put<std::uint16_t>(headers, 2);
+	put<std::uint16_t>(headers, 62);
+	put<std::uint32_t>(headers, 1);
+	put<std::uint64_t>(headers, code_address);
+	put<std::uint64_t>(headers, elf_header_size);
+	put<std::uint64_t>(headers, 0);
+	put<std::uint32_t>(headers, 0);
+	put<std::uint16_t>(headers, elf_header_size);
+	put<std::uint16_t>(headers, program_header_size);
+	put<std::uint16_t>(headers, 2);
+	put<std::uint16_t>(headers, 64);
+	put<std::uint16_t>(headers, 0);
+	put<std::uint16_t>(headers, 0);
+
+	put_program_header(headers, 0x4 | 0x1, 0, load_address, file_size, file_size);
+	put_program_header(headers, 0x4 | 0x2, 0, bss_address, 0, bss.size);
+
+	const auto write_bytes = [&](const auto& bytes) {
+		ctx.out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+	};
+
+	write_bytes(headers);
+	write_bytes(e.code);
+	write_bytes(ctx.data);
+
+	return bool(ctx.out);
+}
+}
@@ -0,0 +1,10 @@
+#ifndef ELF_X86_64_HPP
+#define ELF_X86_64_HPP
+
+namespace bf::codegen
+{
+struct Context;
+bool elf_x86_64(Context ctx);
+}
+
+#endif
@@ -0,0 +1,339 @@
+#include "codegen.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace bf::codegen
+{
+namespace
+{
+//! `i8` immediate of an instruction argument.
+int immediate(VMArg value) { return std::int8_t(value); }
+
+//! Emits the body of `@bf_run`. Cells are `i8`, and the tape pointer lives in an alloca that `mem2reg` promotes.
+//! Pointers are typed, which LLVM versions with opaque pointers still accept.
+class LlvmEmitter
+{
+public:
+	explicit LlvmEmitter(const Context& ctx) : ctx{ctx} {}
+
+	bool emit()
+	{
+		std::vector<size_t> blocks;
+
+		for (size_t i = 0; i < ctx.program.size(); ++i)
+		{
+			const auto& op = ctx.program[i];
+
+			switch (op.opcode)
+			{
+			case Opcode::bfAdd:
+			case Opcode::bfAddOffset:
+			{
+				const auto cell = cell_pointer(op.opcode == Opcode::bfAddOffset ? op.args[1] : 0);
+				const auto value = load(cell);
+				store(cell, fmt::format("add i8 {}, {}", value, immediate(op.args[0])));
+				break;
+			}
+
+			case Opcode::bfSet:
+			case Opcode::bfSetOffset:
+			{
+				const auto cell = cell_pointer(op.opcode == Opcode::bfSetOffset ? op.args[1] : 0);
+				fmt::print(ctx.out, "\tstore i8 {}, i8* {}\n", immediate(op.args[0]), cell);
+				break;
+			}
+
+			case Opcode::bfShift:
+			{
+				fmt::print(ctx.out, "\tstore i8* {}, i8** %sp.addr\n", cell_pointer(op.args[0]));
+				break;
+			}
+
+			case Opcode::bfMAC:
+			{
+				const auto source = load(cell_pointer(op.args[1]));
+				const auto product = value(fmt::format("mul i8 {}, {}", source, immediate(op.args[0])));
+				const auto cell = cell_pointer(0);
+				const auto current = load(cell);
+				store(cell, fmt::format("add i8 {}, {}", current, product));
+				break;
+			}
+
+			case Opcode::bfCharOut:
+			{
+				const auto character = value(fmt::format("zext i8 {} to i32", load(cell_pointer(0))));
+
+				for (VMArg n = 0; n < op.args[0]; ++n)
+				{
+					value(fmt::format("call i32 @putchar(i32 {})", character));
+				}
+
+				break;
+			}
+
+			case Opcode::bfCharIn:
+			{
+				// getchar returns -1 at the end of input, which truncates to 255 as with the interpreter.
+				const auto character = value("call i32 @getchar()");
+				store(cell_pointer(0), fmt::format("trunc i32 {} to i8", character));
+				break;
+			}
+
+			case Opcode::bfWriteConst:
+			{
+				const auto stream = value("load i8*, i8** @stdout");
+				value(fmt::format(
+					"call i64 @fwrite(i8* {}, i64 1, i64 {}, i8* {})",
+					data_pointer(op.args[0]),
+					op.args[1],
+					stream
+				));
+				break;
+			}
+
+			case Opcode::bfSetBlock:
+			{
+				const auto block = get_block(ctx.data, op.args[0]);
+				const auto cell = cell_pointer(op.args[1]);
+
+				if (std::all_of(block.begin(), block.end(), [&](auto byte) { return byte == block.front(); }))
+				{
+					value(fmt::format("call i8* @memset(i8* {}, i32 {}, i64 {})", cell, block.front(), block.size()));
+				}
+				else
+				{
+					value(fmt::format(
+						"call i8* @memcpy(i8* {}, i8* {}, i64 {})",
+						cell,
+						data_pointer(op.args[0] + 2),
+						block.size()
+					));
+				}
+
+				break;
+			}
+
+			case Opcode::bfAddBlock:
+			{
+				// As a single vector operation, which LLVM splits into whatever the target supports.
+				const auto block = get_block(ctx.data, op.args[0]);
+				const auto type = fmt::format("<{} x i8>", block.size());
+
+				const auto cell = value(fmt::format("bitcast i8* {} to {}*", cell_pointer(op.args[1]), type));
+				const auto addend = value(fmt::format("bitcast i8* {} to {}*", data_pointer(op.args[0] + 2), type));
+				const auto sum = value(fmt::format(
+					"add {} {}, {}",
+					type,
+					value(fmt::format("load {0}, {0}* {1}, align 1", type, cell)),
+					value(fmt::format("load {0}, {0}* {1}, align 1", type, addend))
+				));
+
+				fmt::print(ctx.out, "\tstore {0} {1}, {0}* {2}, align 1\n", type, sum, cell);
+				break;
+			}
+
+			case Opcode::bfLoopBegin:
+			case Opcode::bfIfBegin:
+			{
+				const bool is_loop = op.opcode == Opcode::bfLoopBegin;
+				blocks.push_back(i);
+
+				if (is_loop)
+				{
+					fmt::print(ctx.out, "\tbr label %loop{0}\n\nloop{0}:\n", i);
+				}
+
+				fmt::print(
+					ctx.out,
+					"\tbr i1 {0}, label %body{1}, label %end{1}{2}\n\nbody{1}:\n",
+					is_nonzero(),
+					i,
+					branch_weights(op.args[0], is_loop)
+				);
+				break;
+			}
+
+			case Opcode::bfLoopEnd:
+			case Opcode::bfIfEnd:
+			{
+				if (blocks.empty())
+				{
+					fmt::print(errout(codegenllvminfo), "Unmatched end of block at instruction {}\n", i);
+					return false;
+				}
+
+				const size_t begin = blocks.back();
+				blocks.pop_back();
+
+				if (op.opcode == Opcode::bfLoopEnd)
+				{
+					fmt::print(ctx.out, "\tbr label %loop{0}\n\nend{0}:\n", begin);
+				}
+				else
+				{
+					fmt::print(ctx.out, "\tbr label %end{0}\n\nend{0}:\n", begin);
+				}
+
+				break;
+			}
+
+			case Opcode::bfShiftUntilZero:
+			{
+				fmt::print(ctx.out, "\tbr label %scan{0}\n\nscan{0}:\n", i);
+				fmt::print(ctx.out, "\tbr i1 {0}, label %step{1}, label %end{1}\n\nstep{1}:\n", is_nonzero(), i);
+				fmt::print(ctx.out, "\tstore i8* {}, i8** %sp.addr\n", cell_pointer(op.args[0]));
+				fmt::print(ctx.out, "\tbr label %scan{0}\n\nend{0}:\n", i);
+				break;
+			}
+
+			case Opcode::bfEnd:
+			{
+				fmt::print(ctx.out, "\tret void\n");
+				break;
+			}
+
+			default:
+				fmt::print(errout(codegenllvminfo), "Unhandled opcode: {}\n", op.opcode);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	//! Branch weight metadata, referenced by the branches and emitted after the function.
+	std::vector<std::string> weights;
+
+private:
+	//! Defines a new value as the result of `instruction`.
+	std::string value(std::string_view instruction)
+	{
+		auto name = fmt::format("%v{}", next_value++);
+		fmt::print(ctx.out, "\t{} = {}\n", name, instruction);
+		return name;
+	}
+
+	std::string load(std::string_view cell) { return value(fmt::format("load i8, i8* {}", cell)); }
+
+	void store(std::string_view cell, std::string_view instruction)
+	{
+		fmt::print(ctx.out, "\tstore i8 {}, i8* {}\n", value(instruction), cell);
+	}
+
+	//! Pointer to the cell at `offset` from the tape pointer.
+	std::string cell_pointer(VMArg offset)
+	{
+		const auto sp = value("load i8*, i8** %sp.addr");
+
+		if (offset == 0)
+		{
+			return sp;
+		}
+
+		return value(fmt::format("getelementptr inbounds i8, i8* {}, i64 {}", sp, offset));
+	}
+
+	std::string data_pointer(VMArg offset) const
+	{
+		return fmt::format(
+			"getelementptr inbounds ([{0} x i8], [{0} x i8]* @data, i64 0, i64 {1})",
+			ctx.data.size(),
+			offset
+		);
+	}
+
+	std::string is_nonzero() { return value(fmt::format("icmp ne i8 {}, 0", load(cell_pointer(0)))); }
+
+	//! Weights of the branch into the body of a loop or if and out of it, from the profile.
+	std::string branch_weights(VMArg loop_id, bool is_loop)
+	{
+		const LoopProfile* loop = (ctx.profile != nullptr) ? ctx.profile->find(loop_id) : nullptr;
+
+		if (loop == nullptr || loop->reached == 0)
+		{
+			return "";
+		}
+
+		// Weights are 32-bit, keep their ratio.
+		std::uint64_t taken = is_loop ? loop->iterations : loop->entered;
+		std::uint64_t not_taken = is_loop ? loop->reached : loop->reached - loop->entered;
+
+		while (taken > UINT32_MAX || not_taken > UINT32_MAX)
+		{
+			taken /= 2;
+			not_taken /= 2;
+		}
+
+		weights.push_back(fmt::format("!{{!\"branch_weights\", i32 {}, i32 {}}}", taken, not_taken));
+		return fmt::format(", !prof !{}", weights.size() - 1);
+	}
+
+	const Context& ctx;
+	size_t next_value = 0;
+};
+}
+
+bool llvm(Context ctx)
+{
+	fmt::print(ctx.out,
+		"; Build with e.g. `clang -O3 program.ll -o program`\n"
+		"\n"
+		"@stdout = external global i8*\n"
+		"@tape = internal global [{} x i8] zeroinitializer, align 64\n",
+		ctx.memory_size);
+
+	if (!ctx.data.empty())
+	{
+		fmt::print(ctx.out, "@data = internal constant [{} x i8] c\"", ctx.data.size());
+
+		for (const auto byte : ctx.data)
+		{
+			fmt::print(ctx.out, "\\{:02X}", byte);
+		}
+
+		fmt::print(ctx.out, "\"\n");
+	}
+
+	fmt::print(ctx.out,
+		"\n"
+		"declare i32 @putchar(i32) nounwind\n"
+		"declare i32 @getchar() nounwind\n"
+		"declare i64 @fwrite(i8* nocapture, i64, i64, i8* nocapture) nounwind\n"
+		"declare i8* @memcpy(i8*, i8* nocapture, i64) nounwind\n"
+		"declare i8* @memset(i8*, i32, i64) nounwind\n"
+		"\n"
+		"define internal void @bf_run(i8* noalias nocapture %tape) nounwind {{\n"
+		"entry:\n"
+		"\t%sp.addr = alloca i8*\n"
+		"\tstore i8* %tape, i8** %sp.addr\n");
+
+	LlvmEmitter emitter{ctx};
+	if (!emitter.emit())
+	{
+		return false;
+	}
+
+	fmt::print(ctx.out,
+		"}}\n"
+		"\n"
+		"define i32 @main() nounwind {{\n"
+		"\tcall void @bf_run(i8* getelementptr inbounds ([{0} x i8], [{0} x i8]* @tape, i64 0, i64 0))\n"
+		"\tret i32 0\n"
+		"}}\n",
+		ctx.memory_size);
+
+	if (!emitter.weights.empty())
+	{
+		fmt::print(ctx.out, "\n");
+
+		for (size_t i = 0; i < emitter.weights.size(); ++i)
+		{
+			fmt::print(ctx.out, "!{} = {}\n", i, emitter.weights[i]);
+		}
+	}
+
+	return true;
+}
+}
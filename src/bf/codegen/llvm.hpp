@@ -0,0 +1,10 @@
+#ifndef LLVM_HPP
+#define LLVM_HPP
+
+namespace bf::codegen
+{
+struct Context;
+bool llvm(Context ctx);
+}
+
+#endif
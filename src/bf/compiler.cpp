@@ -2,6 +2,7 @@
 
 #include "bf.hpp"
 #include "il.hpp"
+#include "profile.hpp"
 
 #include <algorithm>
 #include <fstream>
@@ -14,11 +15,20 @@ bool Brainfuck::compile(std::string_view source)
 {
 	program.clear();
 	program.reserve(source.size());
+	data.clear();
+
+	// Loops are identified by the order of their `[` for profiling.
+	std::int32_t loop_count = 0;
 
 	for (const char& c : source)
 	{
         const BFOp op = ops[c];
-		if (op.base_opcode != bfNop)
+		if (op.base_opcode == bfLoopBegin)
+		{
+			program.emplace_back(bfLoopBegin, (loop_count <= max_loop_id) ? loop_count : -1);
+			++loop_count;
+		}
+		else if (op.base_opcode != bfNop)
 		{
 			program.emplace_back(static_cast<uint8_t>(ops[c].base_opcode), ops[c].default_arg);
 		}
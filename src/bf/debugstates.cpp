@@ -0,0 +1,266 @@
+#include "debugstates.hpp"
+
+#include "disasm.hpp"
+#include "logger.hpp"
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <fmt/core.h>
+#include <sstream>
+
+namespace bf
+{
+namespace
+{
+//! VMOp::operator== only compares opcodes.
+bool same_op(const VMOp& a, const VMOp& b)
+{
+	return a.opcode == b.opcode && a.args == b.args;
+}
+
+void erase_nops(Program& program)
+{
+	std::erase_if(program, [](const auto& op) { return op.is_nop_like(); });
+}
+
+const char* describe(const DebugRunResult& result)
+{
+	if (!result.linked)
+	{
+		return "fails to link";
+	}
+
+	switch (result.status)
+	{
+	case VmStatus::step_limit_reached: return "exceeds the step limit";
+	case VmStatus::out_of_bounds: return "accesses memory out of the tape";
+	case VmStatus::output_failed: return "fails to write its output";
+	default: return "produces a different output";
+	}
+}
+}
+
+void DebugStates::reset(const Program& program)
+{
+	initial = program;
+	diffs.clear();
+	baseline = program;
+	baseline_offset = 0;
+}
+
+void DebugStates::begin_window(const Program& window, size_t offset)
+{
+	baseline = window;
+	baseline_offset = offset;
+}
+
+void DebugStates::record(const Program& window, size_t begin, size_t end)
+{
+	// Everything past `end` is unchanged, but may have moved if the window was resized.
+	const long growth = long(window.size()) - long(baseline.size());
+	size_t old_end = size_t(long(end) - growth);
+
+	while (begin < end && begin < old_end && same_op(window[begin], baseline[begin]))
+	{
+		++begin;
+	}
+
+	while (end > begin && old_end > begin && same_op(window[end - 1], baseline[old_end - 1]))
+	{
+		--end;
+		--old_end;
+	}
+
+	if (begin == end && begin == old_end)
+	{
+		return;
+	}
+
+	diffs.push_back({baseline_offset + begin, old_end - begin, Program(window.begin() + begin, window.begin() + end)});
+
+	if (growth == 0)
+	{
+		std::copy(window.begin() + begin, window.begin() + end, baseline.begin() + begin);
+	}
+	else
+	{
+		baseline = window;
+	}
+}
+
+Program DebugStates::reconstruct(size_t state) const
+{
+	Program left, right(initial.rbegin(), initial.rend());
+	left.reserve(initial.size());
+
+	for (size_t i = 0; i < state; ++i)
+	{
+		const auto& diff = diffs[i];
+
+		while (left.size() > diff.offset)
+		{
+			right.push_back(left.back());
+			left.pop_back();
+		}
+
+		while (left.size() < diff.offset)
+		{
+			left.push_back(right.back());
+			right.pop_back();
+		}
+
+		right.resize(right.size() - diff.erased);
+		left.insert(left.end(), diff.inserted.begin(), diff.inserted.end());
+	}
+
+	left.insert(left.end(), right.rbegin(), right.rend());
+	return left;
+}
+
+DebugRunResult DebugStates::run(size_t state, const DebugRunParams& params) const
+{
+	DebugRunResult result;
+
+	Brainfuck bf;
+	bf.program = reconstruct(state);
+	erase_nops(bf.program); // The interpreter can't handle bfNop.
+
+	if (!bf.link())
+	{
+		result.linked = false;
+		return result;
+	}
+
+	std::istringstream in{params.input};
+	std::ostringstream out;
+
+	result.status = bf::interpret(
+		{
+			.memory_size = params.memory_size,
+			.in_stream = &in,
+			.out_stream = &out,
+			.data = params.data,
+			.step_limit = params.step_limit,
+			.check_bounds = true
+		},
+		Bytecode{bf.program}
+	);
+
+	result.output = std::move(out).str();
+	return result;
+}
+
+bool DebugStates::analyze(const DebugRunParams& params, size_t thread_count, bool verbose) const
+{
+	if (diffs.empty())
+	{
+		fmt::print(infoout(optimizeinfo), "No optimization was performed, nothing to check.\n");
+		return true;
+	}
+
+	fmt::print(infoout(optimizeinfo), "Checking {} optimizations for regressions...\n", diffs.size());
+
+	const auto reference = run(0, params);
+
+	if (!reference.linked)
+	{
+		fmt::print(warnout(optimizeinfo), "The initial program fails to link, cannot check for regressions.\n");
+		return true;
+	}
+
+	if (reference.status != VmStatus::ok)
+	{
+		fmt::print(
+			warnout(optimizeinfo),
+			"The initial program {}. Only the output produced until then is compared.\n",
+			describe(reference)
+		);
+	}
+
+	const auto is_good = [&](const DebugRunResult& result) {
+		if (!result.linked)
+		{
+			return false;
+		}
+
+		if (reference.status == VmStatus::ok)
+		{
+			return result.status == VmStatus::ok && result.output == reference.output;
+		}
+
+		// The initial program was stopped, so an optimized program may have got further or been stopped elsewhere.
+		if (result.status == VmStatus::out_of_bounds && reference.status != VmStatus::out_of_bounds)
+		{
+			return false;
+		}
+
+		const size_t common = std::min(result.output.size(), reference.output.size());
+		return result.output.compare(0, common, reference.output, 0, common) == 0;
+	};
+
+	const auto last = run(size() - 1, params);
+	if (is_good(last))
+	{
+		fmt::print(infoout(optimizeinfo), "No regression found.\n");
+		return true;
+	}
+
+	fmt::print(infoout(optimizeinfo), "Regression found. Beginning bisect.\n");
+
+	// State `good` behaves correctly, state `bad` does not. Every round tests states evenly spread between both at once.
+	ThreadPool pool{thread_count};
+	size_t good = 0, bad = size() - 1;
+	DebugRunResult bad_result = last;
+
+	while (bad - good > 1)
+	{
+		const size_t count = std::min(pool.size(), bad - good - 1);
+
+		std::vector<size_t> candidates(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			candidates[i] = good + (bad - good) * (i + 1) / (count + 1);
+		}
+
+		std::vector<DebugRunResult> results(count);
+		pool.parallel_for(count, [&](size_t i) { results[i] = run(candidates[i], params); });
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const bool candidate_good = is_good(results[i]);
+
+			if (verbose)
+			{
+				fmt::print(infoout(optimizeinfo), "State #{} is {}.\n", candidates[i], candidate_good ? "good" : "bad");
+			}
+
+			if (!candidate_good)
+			{
+				bad = candidates[i];
+				bad_result = std::move(results[i]);
+				break;
+			}
+
+			good = candidates[i];
+		}
+	}
+
+	fmt::print(warnout(optimizeinfo), "Optimization #{} is bad: the program {}.\n", bad, describe(bad_result));
+
+	const auto& diff = diffs[bad - 1];
+
+	const Program last_good = reconstruct(good);
+	Program replaced(last_good.begin() + diff.offset, last_good.begin() + diff.offset + diff.erased);
+	Program inserted = diff.inserted;
+	erase_nops(replaced);
+	erase_nops(inserted);
+
+	fmt::print(warnout(optimizeinfo), "Last correct assembly:\n");
+	disasm.print_range(replaced);
+
+	fmt::print(warnout(optimizeinfo), "First bad assembly:\n");
+	disasm.print_range(inserted);
+
+	return false;
+}
+}
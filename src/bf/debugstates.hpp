@@ -0,0 +1,81 @@
+#ifndef DEBUGSTATES_HPP
+#define DEBUGSTATES_HPP
+
+#include "bf.hpp"
+#include "vm.hpp"
+
+#include <span>
+#include <string>
+#include <vector>
+
+namespace bf
+{
+//! How program states get run to compare their behavior.
+struct DebugRunParams
+{
+	size_t memory_size = 30000;
+
+	//! Runs are stopped after that many instructions, so that a rewrite introducing a hang can be caught. 0 for none.
+	size_t step_limit = 0;
+
+	//! Input fed to every run, so that programs using `,` can be compared as well.
+	std::string input;
+
+	//! Data segment of the final program. Earlier states refer to a part of it at most.
+	std::span<const std::uint8_t> data;
+};
+
+struct DebugRunResult
+{
+	std::string output;
+	bool linked = true;
+	VmStatus status = VmStatus::ok;
+};
+
+//! History of the program through every rewrite the optimizer performs, used by `-optimize-debug` to find the first
+//! rewrite that changed the behavior of the program.
+//!
+//! Rather than a copy of the program per state, only the initial program and the instructions every rewrite replaced are
+//! kept. A state is rebuilt by replaying rewrites over a gap buffer, which costs about the size of the program as
+//! consecutive rewrites are close to each other.
+//!
+//! Positions are those of the whole program, holes of bfNop left by tasks included. Those are removed before running.
+class DebugStates
+{
+public:
+	//! Starts a new history from `program`.
+	void reset(const Program& program);
+
+	//! Announces that the following rewrites occur within `window`, which starts at instruction `offset` of the program.
+	void begin_window(const Program& window, size_t offset);
+
+	//! Records the changes made to the window since the last record, all of which lie within [`begin`, `end`) of `window`.
+	void record(const Program& window, size_t begin, size_t end);
+
+	size_t size() const { return diffs.size() + 1; }
+
+	Program reconstruct(size_t state) const;
+	DebugRunResult run(size_t state, const DebugRunParams& params) const;
+
+	//! Bisects the states for the first one behaving differently from the initial program, running up to `thread_count`
+	//! states at once. Returns false when a regression was found.
+	bool analyze(const DebugRunParams& params, size_t thread_count, bool verbose) const;
+
+private:
+	struct Diff
+	{
+		size_t offset;
+		size_t erased;
+		Program inserted;
+	};
+
+	Program initial;
+	std::vector<Diff> diffs;
+
+	//! Contents of the current window as of the last record, and its position in the whole program.
+	Program baseline;
+	size_t baseline_offset = 0;
+};
+}
+
+#endif // DEBUGSTATES_HPP
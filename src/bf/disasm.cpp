@@ -36,21 +36,47 @@ void Disassembler::print_range(Program& program)
 {
 	fmt::print(infoout(compileinfo), "Compiled program size is {} insns ({} bytes)\n", program.size(), program.size() * sizeof(VMOp));
 
-	size_t i = 0, depth = 0;
-	for (auto& it : program)
+	// Linked ifs are a `jz` with no matching `jnz`, so remember where they end instead.
+	std::vector<size_t> if_ends;
+	size_t depth = 0;
+
+	for (size_t i = 0; i < program.size(); ++i)
 	{
-		if (it.opcode == bfJmpNotZero) --depth;
+		const auto& op = program[i];
+
+		if (op.opcode == bfJmpNotZero || op.opcode == bfLoopEnd || op.opcode == bfIfEnd) --depth;
+
+		for (; !if_ends.empty() && if_ends.back() == i; if_ends.pop_back())
+		{
+			--depth;
+		}
 
 		if (print_line_numbers)
 		{
-			fmt::print("{:<5} | {: >{}} {}\n", i++, "", 2 * depth, (*this)(it));
+			fmt::print("{:<5} | {: >{}} {}\n", i, "", 2 * depth, (*this)(op));
 		}
 		else
 		{
-			fmt::print("{}\n", (*this)(it));
+			fmt::print("{}\n", (*this)(op));
 		}
 
-		if (it.opcode == bfJmpZero) ++depth;
+		if (op.opcode == bfLoopBegin || op.opcode == bfIfBegin) ++depth;
+
+		if (op.opcode == bfJmpZero)
+		{
+			++depth;
+
+			const auto target = size_t(op.args[0]);
+			const bool is_loop = target != 0
+				&& target <= program.size()
+				&& program[target - 1].opcode == bfJmpNotZero
+				&& size_t(program[target - 1].args[0]) == i + 1;
+
+			if (!is_loop)
+			{
+				if_ends.push_back(target);
+			}
+		}
 	}
 }
 }
@@ -0,0 +1,190 @@
+#include "extent.hpp"
+
+#include <cstdlib>
+
+namespace bf
+{
+namespace
+{
+struct Segment
+{
+	size_t position;
+	CellRange range;
+};
+
+//! State of the analysis within the program or a block of it.
+struct Frame
+{
+	explicit Frame(size_t position) : current{position, {}} {}
+
+	std::vector<Segment> closed;
+	Segment current;
+
+	//! Tape pointer relative to where the current segment starts.
+	long pos = 0;
+
+	//! Whether the tape pointer was never lost within the frame.
+	bool bounded = true;
+
+	void access(long offset) { current.range.include(pos + offset); }
+
+	//! Ends the current segment, as the tape pointer is unknown from `position` onward.
+	void lose_pointer(size_t position)
+	{
+		closed.push_back(current);
+		current = {position, {}};
+		pos = 0;
+		bounded = false;
+	}
+};
+}
+
+ExtentAnalysis analyze_extent(const Program& program, const DataSegment& data)
+{
+	ExtentAnalysis analysis;
+
+	const auto emit = [&](const std::vector<Segment>& segments) {
+		for (const auto& segment : segments)
+		{
+			if (!segment.range.empty())
+			{
+				analysis.checks.push_back({segment.position, segment.range});
+			}
+		}
+	};
+
+	std::vector<Frame> frames(1, Frame{0});
+
+	for (size_t i = 0; i < program.size(); ++i)
+	{
+		const auto& op = program[i];
+		Frame& frame = frames.back();
+
+		switch (op.opcode)
+		{
+		case bfAdd:
+		case bfSet:
+		case bfCharOut:
+		case bfCharIn: frame.access(0); break;
+
+		case bfAddOffset:
+		case bfSetOffset: frame.access(op.args[1]); break;
+
+		case bfMAC:
+		{
+			frame.access(0);
+			frame.access(op.args[1]);
+			break;
+		}
+
+		case bfSetBlock:
+		case bfAddBlock:
+		{
+			frame.access(op.args[1]);
+			frame.access(op.args[1] + long(get_block(data, op.args[0]).size()) - 1);
+			break;
+		}
+
+		case bfShift: frame.pos += op.args[0]; break;
+
+		case bfShiftUntilZero:
+		{
+			frame.access(0);
+			analysis.max_scan_step = std::max(analysis.max_scan_step, std::abs(op.args[0]));
+			frame.lose_pointer(i + 1);
+			break;
+		}
+
+		case bfLoopBegin:
+		case bfIfBegin:
+		{
+			frame.access(0);
+			frames.emplace_back(i + 1);
+			break;
+		}
+
+		case bfLoopEnd:
+		case bfIfEnd:
+		{
+			if (frames.size() == 1)
+			{
+				// Unmatched, which the linker reports.
+				analysis.bounded = false;
+				return analysis;
+			}
+
+			// The loop condition is checked again where the body ends.
+			if (op.opcode == bfLoopEnd)
+			{
+				frame.access(0);
+			}
+
+			Frame block = std::move(frames.back());
+			frames.pop_back();
+			Frame& outer = frames.back();
+
+			if (block.bounded && block.pos == 0)
+			{
+				// The block accesses the same cells relative to the outer segment whenever it runs.
+				outer.current.range.include(block.current.range, outer.pos);
+			}
+			else
+			{
+				block.closed.push_back(block.current);
+				emit(block.closed);
+				outer.lose_pointer(i + 1);
+			}
+
+			break;
+		}
+
+		default: break;
+		}
+	}
+
+	if (frames.size() != 1)
+	{
+		analysis.bounded = false;
+		return analysis;
+	}
+
+	Frame& top = frames.front();
+	top.closed.push_back(top.current);
+
+	analysis.initial = top.closed.front().range;
+	analysis.bounded = top.bounded;
+	emit(top.closed);
+
+	return analysis;
+}
+
+void insert_bounds_checks(Program& program, const ExtentAnalysis& analysis, size_t memory_size)
+{
+	auto checks = analysis.checks;
+	std::stable_sort(checks.begin(), checks.end(), [](const auto& a, const auto& b) { return a.position < b.position; });
+
+	Program checked;
+	checked.reserve(program.size() + checks.size());
+
+	auto check = checks.begin();
+
+	for (size_t i = 0; i < program.size(); ++i)
+	{
+		for (; check != checks.end() && check->position == i; ++check)
+		{
+			const auto& range = check->range;
+
+			if (i == 0 && range.min >= 0 && size_t(range.max) < memory_size)
+			{
+				continue;
+			}
+
+			checked.emplace_back(bfCheckRange, VMArg(range.min), VMArg(range.max));
+		}
+
+		checked.push_back(program[i]);
+	}
+
+	program = std::move(checked);
+}
+}
@@ -0,0 +1,83 @@
+#ifndef EXTENT_HPP
+#define EXTENT_HPP
+
+#include "bf.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace bf
+{
+//! Range of cells, relative to the tape pointer at some point of the program.
+struct CellRange
+{
+	long min = std::numeric_limits<long>::max();
+	long max = std::numeric_limits<long>::min();
+
+	bool empty() const { return min > max; }
+
+	void include(long cell)
+	{
+		min = std::min(min, cell);
+		max = std::max(max, cell);
+	}
+
+	void include(const CellRange& other, long shift)
+	{
+		if (!other.empty())
+		{
+			include(other.min + shift);
+			include(other.max + shift);
+		}
+	}
+};
+
+//! A check that the cells of `range` are within the tape, to perform before the instruction at `position`.
+struct BoundsCheck
+{
+	size_t position;
+	CellRange range;
+};
+
+//! Cells a program may access, as far as it can be told at compile time.
+//!
+//! Balanced loops and ifs, which always bring the tape pointer back to where they started, and straight-line code have
+//! exact extents. The tape pointer is lost after a `suz` and after an unbalanced loop or if, and at the beginning of every
+//! iteration of an unbalanced loop. Each of those points starts a new segment of the program, within which accesses are
+//! known relative to where the segment starts.
+struct ExtentAnalysis
+{
+	//! Cells accessed by the segment starting the program, relative to the first cell of the tape.
+	CellRange initial;
+
+	//! Whether the whole program stays within `initial`.
+	bool bounded = true;
+
+	//! One check per segment of the program that accesses any cell, covering all accesses of the segment.
+	std::vector<BoundsCheck> checks;
+
+	//! Largest distance a `suz` moves the tape pointer by at once.
+	VMArg max_scan_step = 0;
+
+	//! Cells needed to run the program, or 0 when that cannot be told.
+	size_t required_memory_size() const
+	{
+		if (!bounded || (!initial.empty() && initial.min < 0))
+		{
+			return 0;
+		}
+
+		return initial.empty() ? 1 : size_t(initial.max + 1);
+	}
+};
+
+//! Analyzes `program`, which must not be linked yet.
+ExtentAnalysis analyze_extent(const Program& program, const DataSegment& data);
+
+//! Inserts the checks of `analysis` as `checkrange` instructions. The check of the initial segment is left out when it
+//! holds for a tape of `memory_size` cells.
+void insert_bounds_checks(Program& program, const ExtentAnalysis& analysis, size_t memory_size);
+}
+
+#endif // EXTENT_HPP
@@ -0,0 +1,49 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include "bf.hpp"
+
+#include <cstdint>
+#include <span>
+
+namespace bf
+{
+constexpr std::uint64_t fnv_offset_basis = 0xcbf29ce484222325, fnv_prime = 0x100000001b3;
+
+//! FNV-1a hash of `bytes`, continuing from `hash` so that several spans can be hashed as one.
+inline std::uint64_t hash_bytes(std::span<const std::uint8_t> bytes, std::uint64_t hash = fnv_offset_basis)
+{
+	for (const auto byte : bytes)
+	{
+		hash ^= byte;
+		hash *= fnv_prime;
+	}
+
+	return hash;
+}
+
+//! FNV-1a hash of the opcodes and arguments of `program`.
+inline std::uint64_t hash_program(std::span<const VMOp> program)
+{
+	std::uint64_t hash = fnv_offset_basis;
+
+	const auto feed = [&](std::uint32_t value) {
+		for (int i = 0; i < 4; ++i)
+		{
+			hash ^= (value >> (i * 8)) & 0xFF;
+			hash *= fnv_prime;
+		}
+	};
+
+	for (const auto& op : program)
+	{
+		feed(op.opcode);
+		feed(std::uint32_t(op.args[0]));
+		feed(std::uint32_t(op.args[1]));
+	}
+
+	return hash;
+}
+}
+
+#endif // HASH_HPP
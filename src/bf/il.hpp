@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <array>
+#include <initializer_list>
 
 namespace bf
 {
@@ -24,17 +25,62 @@ enum Opcode : uint8_t
 	bfCharOut,
 	bfCharIn,
 
+	//! Writes `args[1]` bytes of the data segment starting at `args[0]`.
+	bfWriteConst,
+
+	//! Copies the block of the data segment at `args[0]` to the cells starting at offset `args[1]`.
+	bfSetBlock,
+
+	//! Adds the block of the data segment at `args[0]` to the cells starting at offset `args[1]`.
+	bfAddBlock,
+
+	//! Checks that the cells from offset `args[0]` to offset `args[1]` are within the tape, so that the instructions it
+	//! guards do not need to.
+	bfCheckRange,
+
 	bfEnd,
 
 	// begin compiler ops
 	bfLoopBegin,
 	bfLoopEnd,
 
+	//! Like loops, but never run more than once: the linker only emits the forward jump.
+	bfIfBegin,
+	bfIfEnd,
+
 	bfTOTAL,
 
-	bfNop
+	bfNop,
+
+	// begin specialized VM ops, which `Bytecode` substitutes for common instructions (see `VMOpInfo::specializes`)
+	bfIncrement,
+	bfDecrement,
+	bfShiftRight,
+	bfShiftLeft,
+	bfClear,
+	bfMACAdd,
+	bfMACSubtract,
+
+	//! Escape of the bytecode of instructions with large arguments, never part of a program (see `Bytecode`). Follows the
+	//! other opcodes so that the interpreter dispatches over a single dense jump table.
+	bfWideEscape
 };
 
+//! Set of opcodes, e.g. used to describe which instructions an optimization task can match.
+using OpcodeMask = std::uint64_t;
+
+static_assert(bfWideEscape <= 64, "OpcodeMask is too small to hold every opcode");
+
+constexpr OpcodeMask opcode_mask(std::initializer_list<Opcode> opcodes)
+{
+	OpcodeMask mask = 0;
+	for (const Opcode opcode : opcodes)
+	{
+		mask |= OpcodeMask(1) << opcode;
+	}
+	return mask;
+}
+
 struct VMOpInfo
 {
 	const char* name;
@@ -44,9 +90,14 @@ struct VMOpInfo
 	//! Defines whether the optimizer should combine successive instructions by adding their first argument together in a single
 	//! instruction.
 	bool stackable;
+
+	//! For specialized opcodes, the instruction they stand for when its first argument is `fixed_arg`. The interpreter
+	//! builds that argument into their handler instead of decoding it.
+	Opcode specializes = bfNop;
+	std::int32_t fixed_arg = 0;
 };
 
-static constexpr std::array<VMOpInfo, Opcode::bfTOTAL + 2> instructions
+static constexpr std::array<VMOpInfo, Opcode::bfWideEscape> instructions
 {{
 
 	{"add", bfAdd, 1, true},
@@ -58,17 +109,59 @@ static constexpr std::array<VMOpInfo, Opcode::bfTOTAL + 2> instructions
 	{"suz", bfShiftUntilZero, 1, false},
 	{"jz", bfJmpZero, 1, false},
 	{"jnz", bfJmpNotZero, 1, false},
-	{"cout", bfCharOut, 1, false},
+	{"cout", bfCharOut, 1, true},
 	{"cin", bfCharIn, 1, false},
+	{"writeconst", bfWriteConst, 2, false},
+	{"setblock", bfSetBlock, 2, false},
+	{"addblock", bfAddBlock, 2, false},
+	{"checkrange", bfCheckRange, 2, false},
 	{"end", bfEnd, 0, false},
 
 	{"(tmp)loopbegin", bfLoopBegin, 0, false},
 	{"(tmp)loopend", bfLoopEnd, 0, false},
+	{"(tmp)ifbegin", bfIfBegin, 0, false},
+	{"(tmp)ifend", bfIfEnd, 0, false},
 
 	{"(bad)", bfTOTAL, 0, false},
 
-	{"(tmp)nop", bfNop, 0, false}
+	{"(tmp)nop", bfNop, 0, false},
+
+	{"inc", bfIncrement, 1, false, bfAdd, 1},
+	{"dec", bfDecrement, 1, false, bfAdd, -1},
+	{"shr", bfShiftRight, 1, false, bfShift, 1},
+	{"shl", bfShiftLeft, 1, false, bfShift, -1},
+	{"clear", bfClear, 1, false, bfSet, 0},
+	{"macadd", bfMACAdd, 2, false, bfMAC, 1},
+	{"macsub", bfMACSubtract, 2, false, bfMAC, -1}
 }};
+
+static_assert(
+	[] {
+		for (size_t i = 0; i < instructions.size(); ++i)
+		{
+			if (instructions[i].opcode != i)
+			{
+				return false;
+			}
+		}
+		return true;
+	}(),
+	"instructions must be indexed by opcode"
+);
+
+//! Specialized opcode standing for `opcode` with `arg` as its first argument, or `opcode` itself when there is none.
+constexpr Opcode specialize(Opcode opcode, std::int32_t arg)
+{
+	for (const VMOpInfo& info : instructions)
+	{
+		if (info.specializes != bfNop && info.specializes == opcode && info.fixed_arg == arg)
+		{
+			return info.opcode;
+		}
+	}
+
+	return opcode;
+}
 }
 
 #endif // IL_HPP
@@ -6,33 +6,62 @@ namespace bf
 {
 bool Brainfuck::link()
 {
+	// Ends of ifs are not emitted, so instructions get compacted as we go: `out` is the index of the linked instruction.
 	std::stack<int> jumps;
+	size_t out = 0;
+
 	for (size_t i = 0; i < program.size(); ++i)
 	{
 		switch (program[i].opcode)
 		{
 		case bfLoopBegin:
-			program[i].opcode = bfJmpZero;
-			jumps.push(static_cast<int>(i));
+		case bfIfBegin:
+			jumps.push(static_cast<int>(out));
 			break;
 
 		case bfLoopEnd:
-			if (jumps.empty())
+		case bfIfEnd:
+		{
+			const Opcode begin_opcode = (program[i].opcode == bfLoopEnd) ? bfLoopBegin : bfIfBegin;
+
+			if (jumps.empty() || program[jumps.top()].opcode != begin_opcode)
 			{
 				fmt::print(errout(compileinfo), "Unexpected ']': missing '['\n");
 				return false;
 			}
-			program[i].opcode = bfJmpNotZero;
 
-			program[jumps.top()].args[0] = i + 1;
-			program[i].args[0] = jumps.top() + 1;
+			// Keep the loop ID of the jumps around for profiling
+			auto& begin = program[jumps.top()];
+			begin.opcode = bfJmpZero;
+			begin.args[1] = begin.args[0];
+
+			if (program[i].opcode == bfLoopEnd)
+			{
+				program[i].opcode = bfJmpNotZero;
+				program[i].args[1] = begin.args[1];
+				program[jumps.top()].args[0] = out + 1;
+				program[i].args[0] = jumps.top() + 1;
+			}
+			else
+			{
+				// Skip the body of the if, there is no way back.
+				program[jumps.top()].args[0] = out;
+				jumps.pop();
+				continue;
+			}
+
 			jumps.pop();
 			break;
+		}
 
 		default: break;
 		}
+
+		program[out++] = program[i];
 	}
 
+	program.resize(out);
+
 	if (!jumps.empty())
 	{
 		fmt::print(errout(compileinfo), "Unexpected '[': missing ']'\n");
@@ -31,6 +31,8 @@ constexpr std::string_view
 	compileinfo = "Compiler",
 	optimizeinfo = "Optimizer",
 	codegenx8664info = "CodeGen (x86-64 asm)",
+	codegenelfinfo = "CodeGen (x86-64 ELF)",
+	codegenllvminfo = "CodeGen (LLVM IR)",
 	codegencinfo = "CodeGen (C source)";
 
 extern const LogLevel warnout, errout, verbout, infoout;
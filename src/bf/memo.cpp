@@ -0,0 +1,226 @@
+#include "memo.hpp"
+
+#include "hash.hpp"
+
+#include <algorithm>
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+#include <fstream>
+#include <system_error>
+
+#include <unistd.h>
+
+namespace bf
+{
+namespace
+{
+constexpr std::string_view memo_magic = "ashbf-memo", memo_version = "2";
+
+//! Cells are 8-bit and wrap around, and `,` stores 255 at the end of input. Changing either changes what a run outputs,
+//! so this has to change along with them for memoized runs not to get reused.
+constexpr std::string_view cell_semantics = "u8-wrap,eof-255";
+
+std::filesystem::path entry_path(const std::filesystem::path& directory, std::uint64_t key)
+{
+	return directory / fmt::format("{:016x}.memo", key);
+}
+
+std::span<const std::uint8_t> as_bytes(std::string_view str)
+{
+	return {reinterpret_cast<const std::uint8_t*>(str.data()), str.size()};
+}
+
+std::span<const std::uint8_t> program_bytes(const RunInputs& inputs)
+{
+	return {reinterpret_cast<const std::uint8_t*>(inputs.program.words.data()), inputs.program.words.size() * 4};
+}
+
+//! Reads `expected.size()` bytes of `file`, returning whether they are those of `expected`.
+bool read_matches(std::istream& file, std::span<const std::uint8_t> expected)
+{
+	std::string bytes(expected.size(), '\0');
+
+	return file.read(bytes.data(), std::streamsize(bytes.size()))
+		&& std::equal(expected.begin(), expected.end(), as_bytes(bytes).begin());
+}
+}
+
+bool reads_input(std::span<const VMOp> program)
+{
+	return std::any_of(program.begin(), program.end(), [](const VMOp& op) { return op.opcode == bfCharIn; });
+}
+
+std::uint64_t hash_run(const RunInputs& inputs)
+{
+	const std::uint64_t sizes[] = {inputs.program.words.size(), inputs.data.size(), inputs.memory_size, inputs.tape_padding};
+
+	std::uint64_t hash = hash_bytes(as_bytes(cell_semantics));
+	hash = hash_bytes({reinterpret_cast<const std::uint8_t*>(sizes), sizeof(sizes)}, hash);
+	hash = hash_bytes(program_bytes(inputs), hash);
+	return hash_bytes(inputs.data, hash);
+}
+
+bool MemoizedRun::save(const std::filesystem::path& directory, const RunInputs& inputs) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+
+	const auto path = entry_path(directory, hash_run(inputs));
+	auto temporary_path = path;
+	temporary_path += fmt::format(".{}.tmp", getpid());
+
+	{
+		std::ofstream file{temporary_path, std::ios::binary};
+		if (!file)
+		{
+			return false;
+		}
+
+		fmt::print(
+			file,
+			"{} {}\nsemantics {}\nmemory {}\npadding {}\nprogram {}\ndata {}\nstatus {}\noutput {}\n",
+			memo_magic,
+			memo_version,
+			cell_semantics,
+			inputs.memory_size,
+			inputs.tape_padding,
+			inputs.program.words.size(),
+			inputs.data.size(),
+			int(status),
+			output.size()
+		);
+
+		const auto program = program_bytes(inputs);
+		file.write(reinterpret_cast<const char*>(program.data()), std::streamsize(program.size()));
+		file.write(reinterpret_cast<const char*>(inputs.data.data()), std::streamsize(inputs.data.size()));
+		file.write(output.data(), std::streamsize(output.size()));
+
+		if (!file.flush())
+		{
+			std::filesystem::remove(temporary_path, error);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(temporary_path, path, error);
+	if (error)
+	{
+		std::filesystem::remove(temporary_path, error);
+		return false;
+	}
+
+	return true;
+}
+
+std::optional<MemoizedRun> MemoizedRun::load(const std::filesystem::path& directory, const RunInputs& inputs)
+{
+	const auto path = entry_path(directory, hash_run(inputs));
+	std::ifstream file{path, std::ios::binary};
+
+	std::string magic, version, semantics_key, semantics;
+	std::string memory_key, padding_key, program_key, data_key, status_key, output_key;
+	std::size_t memory_size = 0, tape_padding = 0, program_size = 0, data_size = 0, output_size = 0;
+	int status = 0;
+
+	if (!(file >> magic >> version >> semantics_key >> semantics >> memory_key >> memory_size >> padding_key >> tape_padding
+			  >> program_key >> program_size >> data_key >> data_size >> status_key >> status >> output_key >> output_size)
+		|| magic != memo_magic
+		|| version != memo_version
+		|| semantics_key != "semantics"
+		|| memory_key != "memory"
+		|| padding_key != "padding"
+		|| program_key != "program"
+		|| data_key != "data"
+		|| status_key != "status"
+		|| output_key != "output"
+		|| semantics != cell_semantics
+		|| memory_size != inputs.memory_size
+		|| tape_padding != inputs.tape_padding
+		|| program_size != inputs.program.words.size()
+		|| data_size != inputs.data.size()
+		|| status < int(VmStatus::ok)
+		|| status > int(VmStatus::out_of_bounds)
+		|| file.get() != '\n')
+	{
+		return std::nullopt;
+	}
+
+	// A truncated entry, e.g. left by a full disk, is a miss rather than a wrong output, and a corrupted size must not
+	// have the output allocated before it can be told.
+	std::error_code error;
+	const auto file_size = std::filesystem::file_size(path, error);
+	const auto inputs_end = std::uint64_t(file.tellg()) + program_size * 4 + data_size;
+
+	if (error || file_size < inputs_end || file_size - inputs_end != output_size)
+	{
+		return std::nullopt;
+	}
+
+	// Entries are found by a 64-bit hash, so they only count as the run of `inputs` when they hold the same ones.
+	if (!read_matches(file, program_bytes(inputs)) || !read_matches(file, inputs.data))
+	{
+		return std::nullopt;
+	}
+
+	MemoizedRun run;
+	run.status = VmStatus(status);
+	run.output.resize(output_size);
+
+	if (!file.read(run.output.data(), std::streamsize(output_size)))
+	{
+		return std::nullopt;
+	}
+
+	return run;
+}
+
+OutputRecorder::OutputRecorder(std::streambuf& out, std::size_t max_size) : out(out), max_size(max_size)
+{
+	setp(buffer, buffer + buffer_size);
+}
+
+std::optional<std::string> OutputRecorder::take_recorded()
+{
+	write_out();
+	return std::move(recorded);
+}
+
+bool OutputRecorder::write_out()
+{
+	const auto size = std::size_t(pptr() - pbase());
+
+	if (recorded && recorded->size() + size > max_size)
+	{
+		recorded.reset();
+	}
+
+	if (recorded)
+	{
+		recorded->append(pbase(), size);
+	}
+
+	setp(buffer, buffer + buffer_size);
+	return out.sputn(buffer, std::streamsize(size)) == std::streamsize(size);
+}
+
+OutputRecorder::int_type OutputRecorder::overflow(int_type c)
+{
+	if (!write_out())
+	{
+		return traits_type::eof();
+	}
+
+	if (!traits_type::eq_int_type(c, traits_type::eof()))
+	{
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(c);
+}
+
+int OutputRecorder::sync()
+{
+	return (write_out() && out.pubsync() == 0) ? 0 : -1;
+}
+}
@@ -0,0 +1,79 @@
+#ifndef MEMO_HPP
+#define MEMO_HPP
+
+#include "bf.hpp"
+#include "vm.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <streambuf>
+#include <string>
+
+namespace bf
+{
+//! Whether any instruction of `program` reads input. Programs that do not are deterministic: their output and status
+//! only depend on their bytecode and on how they are run.
+bool reads_input(std::span<const VMOp> program);
+
+//! What a run of an input-free program depends on, besides the cell semantics of the interpreter.
+struct RunInputs
+{
+	const Bytecode& program;
+	std::span<const std::uint8_t> data;
+	std::size_t memory_size;
+	std::size_t tape_padding;
+};
+
+//! Hash of `inputs` and of the cell semantics of the interpreter, naming the entry of their run.
+std::uint64_t hash_run(const RunInputs& inputs);
+
+//! Output and status of a run, as kept by `-memoize` in a file of its directory named after the hash of its inputs.
+//! Entries hold the inputs themselves, as the hash alone may collide.
+struct MemoizedRun
+{
+	VmStatus status = VmStatus::ok;
+	std::string output;
+
+	//! Writes the run of `inputs` to a temporary file renamed over its entry, so that concurrent runs never see a partial
+	//! entry.
+	bool save(const std::filesystem::path& directory, const RunInputs& inputs) const;
+
+	//! Returns the run of `inputs` memoized in `directory`, if its entry holds the very same inputs.
+	static std::optional<MemoizedRun> load(const std::filesystem::path& directory, const RunInputs& inputs);
+};
+
+//! Writes the output of a run through to `out` as it gets flushed, keeping a copy of it to be memoized. The copy is
+//! dropped once it would exceed `max_size` bytes, as programs may write without end.
+class OutputRecorder : public std::streambuf
+{
+public:
+	static constexpr std::size_t default_max_size = 1 << 24;
+
+	explicit OutputRecorder(std::streambuf& out, std::size_t max_size = default_max_size);
+
+	OutputRecorder(const OutputRecorder&) = delete;
+	OutputRecorder& operator=(const OutputRecorder&) = delete;
+
+	//! Output flushed so far, unless it exceeded `max_size`.
+	std::optional<std::string> take_recorded();
+
+protected:
+	int_type overflow(int_type c) override;
+	int sync() override;
+
+private:
+	static constexpr std::size_t buffer_size = 1 << 12;
+
+	//! Writes the buffered bytes out and records them, returning whether `out` took them all.
+	bool write_out();
+
+	std::streambuf& out;
+	std::size_t max_size;
+	std::optional<std::string> recorded{std::string{}};
+	char buffer[buffer_size];
+};
+}
+
+#endif // MEMO_HPP
@@ -1,134 +1,162 @@
 #include "optimizer.hpp"
 
-#include "disasm.hpp"
+#include "extent.hpp"
 #include "il.hpp"
 #include "logger.hpp"
+#include "passmanager.hpp"
+#include "threadpool.hpp"
 #include "vecutils.hpp"
 #include "vm.hpp"
 
 #include <algorithm>
 #include <array>
+#include <limits>
 #include <fmt/core.h>
 #include <functional>
 #include <map>
-#include <sstream>
+#include <optional>
 #include <span>
+#include <unordered_map>
 #include <vector>
 
 namespace bf
 {
-
-const std::string& ProgramState::get_output() const
+namespace
+{
+template<class Range>
+void mark_dirty(Range&& ops)
 {
-	if (cached_output)
+	for (auto& op : ops)
 	{
-		return cached_output.value();
+		op.dirty = true;
 	}
-
-	std::stringstream ss;
-
-	Brainfuck bf;
-	bf.program = program;
-	bf.link();
-	bf::interpret(
-        {30000, &ss, &ss},
-        std::vector<bf::VMCompactOp>(bf.program.begin(), bf.program.end())
-    );
-
-	return (cached_output = {ss.str()}).value();
+}
 }
 
-void Optimizer::update_state_debug(Program &program)
+void Optimizer::update_state_debug(Program &program, ProgramIt begin, ProgramIt end)
 {
 	if (debug)
 	{
-		erase_nop(program, program.begin(), program.end()); // We do this because the interpreter can't handle bfNop.
-		debug_states.emplace_back(program, debug_states.size());
+		debug_states.record(program, size_t(begin - program.begin()), size_t(end - program.begin()));
 	}
 }
 
 bool Optimizer::analyze_debug_states()
 {
-	if (debug_states.size() < 2)
-	{
-        fmt::print(warnout(optimizeinfo), "No debug state collected, cannot analyze debug states. This may be a bug.\n");
-	}
+	return debug_states.analyze(debug_run_params, thread_count, verbose);
+}
 
-	auto &initial_state = debug_states.front();
-	auto &final_state = debug_states.back();
+void Optimizer::report_hot_loops(const Program& program) const
+{
+	constexpr size_t reported_loops = 10;
+
+	struct HotLoop
+	{
+		std::int32_t id;
+		bool is_if;
+		const LoopProfile* loop;
+	};
 
-	fmt::print(infoout(optimizeinfo), "Checking for regressions...\n");
+	std::vector<HotLoop> loops;
+	size_t cold_count = 0;
 
-	if (initial_state.get_output() == final_state.get_output())
+	for (const auto& op : program)
 	{
-		fmt::print(infoout(optimizeinfo), "No regression found.\n");
-		return true;
+		if (op.opcode != bfLoopBegin && op.opcode != bfIfBegin)
+		{
+			continue;
+		}
+
+		if (const LoopProfile* loop = profile->find(op.args[0]))
+		{
+			loops.push_back({op.args[0], op.opcode == bfIfBegin, loop});
+			cold_count += loop->is_cold();
+		}
 	}
 
-	fmt::print(infoout(optimizeinfo), "Regression found. Beginning bisect.\n");
+	std::sort(loops.begin(), loops.end(), [](const auto& a, const auto& b) {
+		return a.loop->iterations > b.loop->iterations;
+	});
 
-	auto culprit_it = std::lower_bound(
-		debug_states.begin() + 1,
-		debug_states.end(),
-		initial_state,
-		[](auto& current_state, auto& initial_state) {
-			fmt::print(infoout(optimizeinfo), "Testing state #{}... ", current_state.id);
+	fmt::print(
+		infoout(optimizeinfo),
+		"{} loops and ifs remain, of which {} are cold. Hottest ones:\n",
+		loops.size(),
+		cold_count
+	);
 
-			bool good = current_state.get_output() == initial_state.get_output();
+	for (size_t i = 0; i < std::min(loops.size(), reported_loops) && loops[i].loop->iterations != 0; ++i)
+	{
+		const auto& [id, is_if, loop] = loops[i];
 
-			if (good)
-			{
-				fmt::print(infoout.buffer, "good.\n");
-			}
-			else
+		std::string shift;
+
+		if (!is_if && loop->min_shift <= loop->max_shift)
+		{
+			shift = (loop->min_shift == loop->max_shift)
+				? fmt::format(", net shift {}", loop->min_shift)
+				: fmt::format(", net shift {} to {}", loop->min_shift, loop->max_shift);
+
+			if (loop->min_shift != 0 || loop->max_shift != 0)
 			{
-				fmt::print(infoout.buffer, "bad.\n");
+				shift += " (unbalanced)";
 			}
-
-			return good;
 		}
-	);
 
-	auto &last_good = *(culprit_it - 1);
-	auto &culprit = *(culprit_it);
+		fmt::print(
+			infoout(optimizeinfo),
+			"{} #{}: {} iterations, entered {} of {} times{}\n",
+			is_if ? "If" : "Loop",
+			id,
+			loop->iterations,
+			loop->entered,
+			loop->reached,
+			shift
+		);
+	}
+}
 
-	fmt::print(warnout(optimizeinfo), "Optimization #{} is bad.\n", culprit.id);
+bool Optimizer::erase_nop(Program &program, ProgramIt begin, ProgramIt end)
+{
+	auto out = begin;
+	bool dirty_next = false;
 
-	auto [good_mismatch_begin, bad_mismatch_begin] = std::mismatch(
-		last_good.program.begin(),
-		last_good.program.end(),
-		culprit.program.begin(),
-		culprit.program.end()
-	);
+	for (auto it = begin; it != end; ++it)
+	{
+		if (it->is_nop_like())
+		{
+			// Erasing an instruction brings its neighbours together, which may let a pattern match them.
+			if (out != begin)
+			{
+				(out - 1)->dirty = true;
+			}
 
-	auto [good_mismatch_end, bad_mismatch_end] = std::mismatch(
-		last_good.program.rbegin(),
-		last_good.program.rend(),
-		culprit.program.rbegin(),
-		culprit.program.rend()
-	);
+			dirty_next = true;
+			continue;
+		}
 
-	fmt::print(warnout(optimizeinfo), "Last correct assembly:\n");
-	disasm.print_range({good_mismatch_begin, good_mismatch_end.base()});
+		*out = *it;
+		out->dirty |= dirty_next;
+		dirty_next = false;
+		++out;
+	}
 
-	fmt::print(warnout(optimizeinfo), "First bad assembly:\n");
-	disasm.print_range({bad_mismatch_begin, bad_mismatch_end.base()});
+	const bool erased = out != end;
+	program.erase(out, end);
 
-	return false;
-}
+	if (erased)
+	{
+		update_state_debug(program, begin, out);
+	}
 
-bool Optimizer::erase_nop(Program &program, ProgramIt begin, ProgramIt end)
-{
-	size_t old_size = program.size();
-	program.erase(std::remove_if(begin, end, [](auto op) { return op.is_nop_like(); }), end);
-	return program.size() != old_size;
+	return erased;
 }
 
 bool Optimizer::peephole_optimize_for(
 	Program& program,
 	ProgramIt begin,
 	ProgramIt end,
-	const std::vector<OptimizationSequence>& optimizers
+	std::span<const OptimizationSequence> optimizers
 )
 {
 	bool effective = false;
@@ -147,8 +175,15 @@ bool Optimizer::peephole_optimize_for(
 				optimizer.optimize(candidate)
 			);
 
+			mark_dirty(candidate);
 			effective = true;
-			update_state_debug(program);
+
+			if (stats != nullptr)
+			{
+				stats->count_rewrite(optimizer.name);
+			}
+
+			update_state_debug(program, pos, pos + optimizer.seq.size());
 
 			++pos;
 		}
@@ -156,8 +191,8 @@ bool Optimizer::peephole_optimize_for(
 
 	// We do this as an optimization: rather than moving the range every time we cause a shrink somewhere in the program, we leave
 	// a hole of bfNop, avoiding unnecessary moves.
-	// However this can reduce peephole optimization potential, but this is acceptable: It only results in supplementary passes,
-	// which is not very expensive since move_range() was the worst offender by far.
+	// However this can reduce peephole optimization potential, but this is acceptable: It only results in the region being
+	// revisited, which is not very expensive since move_range() was the worst offender by far.
 	erase_nop(program, begin, end);
 
 	return effective;
@@ -179,11 +214,17 @@ bool Optimizer::merge_stackable(
 		for (auto j = i + 1; (j != end) && (j->opcode == i->opcode); ++j)
 		{
 			i->args[0] += j->args[0];
+			i->dirty = true;
 			j->opcode = bfNop; // Mark for deletion
+
+			if (stats != nullptr)
+			{
+				stats->count_rewrite("merge stackable instructions");
+			}
 		}
 	}
 
-	update_state_debug(program);
+	update_state_debug(program, begin, end);
 
 	return erase_nop(program, begin, end);
 }
@@ -194,42 +235,36 @@ bool Optimizer::stage1_peephole_optimize(
 	ProgramIt end
 )
 {
-	const std::vector<OptimizationSequence> peephole_optimizers
+	static const std::vector<OptimizationSequence> peephole_optimizers
 	{{
-		// [+] to bfSet 0
-		{{bfLoopBegin, bfAdd, bfLoopEnd}, [](auto /*unused*/) -> Program {
+		{"[+] to set 0", {bfLoopBegin, bfAdd, bfLoopEnd}, [](auto /*unused*/) -> Program {
 			return {{bfSet, 0}};
 		}},
 
 		// Merge bfSet then bfAdd to a single set.
-		{{bfSet, bfAdd}, [](auto v) -> Program {
+		{"set, add to set", {bfSet, bfAdd}, [](auto v) -> Program {
 			return {{bfSet, v[0].args[0] + v[1].args[0]}};
 		}},
 
 		// Optimize adding then setting, because adding will not be effective.
-		{{bfAdd, bfSet}, [](auto v) -> Program {
+		{"add, set to set", {bfAdd, bfSet}, [](auto v) -> Program {
 			return {{bfSet, v[1].args[0]}};
 		}},
 
 		// Optimize 2 sets in a row.
-		{{bfSet, bfSet}, [](auto v) -> Program {
+		{"set, set to set", {bfSet, bfSet}, [](auto v) -> Program {
 			return {{bfSet, v[1].args[0]}};
 		}},
 
-		// [>]
-		{{bfLoopBegin, bfShift, bfLoopEnd}, [this](auto v) -> Program {
-			if (allow_suz)
-			{
-				return {{bfShiftUntilZero, v[1].args[0]}};
-			}
-			
-							// TODO: just dont have this in the optimizers list when !allow_suz
-				return {v[0], v[1], v[2]};
-		
+		{"[>] to suz", {bfLoopBegin, bfShift, bfLoopEnd}, [](auto v) -> Program {
+			return {{bfShiftUntilZero, v[1].args[0]}};
 		}}
 	}};
 
-	return peephole_optimize_for(program, begin, end, peephole_optimizers);
+	// The last sequence is only allowed with suz enabled. Returning the loop as-is instead would never reach a fixed point.
+	const size_t sequence_count = peephole_optimizers.size() - (allow_suz ? 0 : 1);
+
+	return peephole_optimize_for(program, begin, end, {peephole_optimizers.begin(), sequence_count});
 }
 
 bool Optimizer::balanced_loop_unrolling(
@@ -256,11 +291,14 @@ bool Optimizer::balanced_loop_unrolling(
 			operations.clear();
 		}
 
-		auto& op_before_loop = *(loop_begin - 1);
+		// When the loop starts the range, there is no instruction we know anything about before it.
+		const VMOp op_before_loop = (loop_begin != begin) ? *(loop_begin - 1) : VMOp{};
 
 		if (i->opcode == bfShiftUntilZero ||
 			i->opcode == bfCharIn ||
-			i->opcode == bfCharOut) // TODO could be expanded
+			i->opcode == bfCharOut ||
+			i->opcode == bfIfBegin ||
+			i->opcode == bfIfEnd) // TODO could be expanded
 		{
 			expandable = false;
 		}
@@ -289,8 +327,11 @@ bool Optimizer::balanced_loop_unrolling(
 			}
 
 			// Not great.. maybe instruction metadata could be nice at some point
+			// Only adds and sets can be summarized per cell: e.g. a `mac` left by unrolling an inner loop reads another cell,
+			// and an add following a set on the same cell does not merge into it.
 			shift_count = 0;
-			for (auto j = loop_begin + 1; j != i; ++j)
+			bool summarizable = true;
+			for (auto j = loop_begin + 1; j != i && summarizable; ++j)
 			{
 				if (j->opcode == bfShift)
 				{
@@ -298,10 +339,15 @@ bool Optimizer::balanced_loop_unrolling(
 				}
 				else
 				{
-					operations[shift_count].try_merge_with(*j);
+					summarizable = (j->opcode == bfAdd || j->opcode == bfSet) && operations[shift_count].try_merge_with(*j);
 				}
 			}
 
+			if (!summarizable)
+			{
+				continue;
+			}
+
 			for (auto &p : operations)
 			{
 				p.second.simplify();
@@ -310,7 +356,10 @@ bool Optimizer::balanced_loop_unrolling(
 			auto loopit = operations.find(0);
 			if (loopit == operations.end() || loopit->second.is_nop_like())
 			{
-				fmt::print(warnout(optimizeinfo), "Infinite loop: Iterator is never modified\n");
+				if (warnings)
+				{
+					fmt::print(warnout(optimizeinfo), "Infinite loop: Iterator is never modified\n");
+				}
 				continue;
 			}
 
@@ -321,7 +370,10 @@ bool Optimizer::balanced_loop_unrolling(
 
 			if (loopit_op.opcode == bfSet && loopit_op.args[0] != 0)
 			{
-				fmt::print(warnout(optimizeinfo), "Infinite loop: Iterator is always `{}`\n", loopit_op.args[0]);
+				if (warnings)
+				{
+					fmt::print(warnout(optimizeinfo), "Infinite loop: Iterator is always `{}`\n", loopit_op.args[0]);
+				}
 				continue;
 			}
 
@@ -336,23 +388,27 @@ bool Optimizer::balanced_loop_unrolling(
 				// We know how many times the loop runs.
 				if (op_before_loop.args[0] == 0)
 				{
-					fmt::print(warnout(optimizeinfo), "Loop never runs, iterator is initialized to 0\n");
+					if (warnings)
+					{
+						fmt::print(warnout(optimizeinfo), "Loop never runs, iterator is initialized to 0\n");
+					}
 					// TODO erase
 					continue;
 				}
 
 				if (op_before_loop.args[0] == 1)
 				{
-					fmt::print(warnout(optimizeinfo), "Loop runs exactly once\n");
+					if (warnings)
+					{
+						fmt::print(warnout(optimizeinfo), "Loop runs exactly once\n");
+					}
 				}
 
 				shift_count = 0;
 				for (auto &p : operations)
 				{
-					if (!p.second.repeat(op_before_loop.args[0]))
-					{
-						unrolled.push_back(p.second);
-					}
+					// Sets are not repeatable, but running them once is the same as running them any number of times
+					p.second.repeat(op_before_loop.args[0]);
 					unrolled.emplace_back(bfShift, p.first - shift_count);
 					unrolled.push_back(p.second);
 					shift_count = p.first;
@@ -362,9 +418,15 @@ bool Optimizer::balanced_loop_unrolling(
 				unrolled.emplace_back(bfShift, -shift_count);
 				unrolled.emplace_back(bfSet, 0);
 
+				mark_dirty(unrolled);
 				move_range_no_shrink(program, loop_begin - 1, i + 1, unrolled);
 
-				update_state_debug(program);
+				if (stats != nullptr)
+				{
+					stats->count_rewrite("unroll loop with a known iteration count");
+				}
+
+				update_state_debug(program, loop_begin - 1, i + 1);
 			}
 			else
 			{
@@ -392,6 +454,9 @@ bool Optimizer::balanced_loop_unrolling(
 							legal_when_zero = false;
 							break;
 						}
+
+						// The loop is known to run at least once
+						unrolled.push_back(p.second);
 					}
 					else
 					{
@@ -401,7 +466,6 @@ bool Optimizer::balanced_loop_unrolling(
 
 				if (!legal_when_zero)
 				{
-					update_state_debug(program);
 					continue;
 				}
 
@@ -409,9 +473,34 @@ bool Optimizer::balanced_loop_unrolling(
 				unrolled.emplace_back(bfShift, -shift_count);
 				unrolled.emplace_back(bfSet, 0);
 
+				// The multiply-accumulates access their cells even when the loop would not have run. Under bounds checks,
+				// that must not fault a program whose loop never runs, so they stay behind the loop condition.
+				// Otherwise, the condition costs a jump when the loop runs but skips the whole body when it does not, which
+				// pays off when the profile shows that the loop is mostly skipped. Profiled runs keep it to find that out.
+				const LoopProfile* loop_profile = (profile != nullptr) ? profile->find(loop_begin->args[0]) : nullptr;
+				const bool mostly_skipped = loop_profile != nullptr
+					&& (loop_profile->reached - loop_profile->entered) * unrolled.size() > loop_profile->entered;
+
+				if (bounds_checked || profiling || mostly_skipped)
+				{
+					unrolled.insert(unrolled.begin(), VMOp{bfIfBegin, loop_begin->args[0], loop_begin->args[1]});
+					unrolled.push_back(VMOp{bfIfEnd, i->args[0], i->args[1]});
+				}
+
+				mark_dirty(unrolled);
 				move_range_no_shrink(program, loop_begin, i + 1, unrolled);
 
-				update_state_debug(program);
+				if (stats != nullptr)
+				{
+					stats->count_rewrite("unroll loop to multiply-accumulate");
+
+					if (mostly_skipped)
+					{
+						stats->count_rewrite("guard multiply-accumulate of a mostly skipped loop");
+					}
+				}
+
+				update_state_debug(program, loop_begin, i + 1);
 			}
 
 			effective = true;
@@ -423,19 +512,106 @@ bool Optimizer::balanced_loop_unrolling(
 	return effective;
 }
 
+bool Optimizer::if_conversion(
+	Program& program,
+	ProgramIt begin,
+	ProgramIt end
+)
+{
+	// True if the current cell is zero after `op` runs.
+	const auto leaves_cell_zero = [](const VMOp& op) {
+		return (op.opcode == bfSet && op.args[0] == 0)
+			|| op.opcode == bfShiftUntilZero
+			|| op.opcode == bfLoopEnd
+			|| op.opcode == bfIfEnd;
+	};
+
+	bool effective = false;
+	std::vector<ProgramIt> open_blocks;
+
+	for (auto i = begin; i != end; ++i)
+	{
+		if (i->opcode == bfLoopBegin || i->opcode == bfIfBegin)
+		{
+			open_blocks.push_back(i);
+			continue;
+		}
+
+		if ((i->opcode != bfLoopEnd && i->opcode != bfIfEnd) || open_blocks.empty())
+		{
+			continue;
+		}
+
+		const auto block_begin = open_blocks.back();
+		open_blocks.pop_back();
+
+		const VMOp op_before_block = (block_begin != begin) ? *(block_begin - 1) : VMOp{};
+
+		if (block_begin != begin && leaves_cell_zero(op_before_block))
+		{
+			// Blocks nested within were already handled, and go along with it.
+			std::fill(block_begin, i + 1, VMOp{});
+			update_state_debug(program, block_begin, i + 1);
+
+			if (stats != nullptr)
+			{
+				stats->count_rewrite("remove block that never runs");
+			}
+		}
+		else if (i->opcode == bfIfEnd && op_before_block.opcode == bfSet)
+		{
+			// The condition is a known non-zero value, the body joins the surrounding code.
+			*block_begin = VMOp{};
+			update_state_debug(program, block_begin, block_begin + 1);
+			*i = VMOp{};
+			update_state_debug(program, i, i + 1);
+
+			if (stats != nullptr)
+			{
+				stats->count_rewrite("unwrap if that always runs");
+			}
+		}
+		else if (i->opcode == bfLoopEnd && i - 1 != block_begin && leaves_cell_zero(*(i - 1)))
+		{
+			// The loop condition is checked again right after the current cell was cleared.
+			block_begin->opcode = bfIfBegin;
+			block_begin->dirty = true;
+			update_state_debug(program, block_begin, block_begin + 1);
+			i->opcode = bfIfEnd;
+			i->dirty = true;
+			update_state_debug(program, i, i + 1);
+
+			if (stats != nullptr)
+			{
+				stats->count_rewrite("convert loop running at most once to if");
+			}
+		}
+		else
+		{
+			continue;
+		}
+
+		effective = true;
+	}
+
+	erase_nop(program, begin, end);
+
+	return effective;
+}
+
 bool Optimizer::stage2_peephole_optimize(Program& program, ProgramIt begin, ProgramIt end)
 {
-	const std::vector<OptimizationSequence> peephole_optimizers
+	static const std::vector<OptimizationSequence> peephole_optimizers
 	{{
 		// Shifted adds
-		{{bfShift, bfAdd}, [](auto v) -> Program {
+		{"shift, add to addoff", {bfShift, bfAdd}, [](auto v) -> Program {
 			return {
 				{bfAddOffset, v[1].args[0], v[0].args[0]},
 				v[0]
 			};
 		}},
 
-		{{bfShift, bfAddOffset}, [](auto v) -> Program {
+		{"shift, addoff to addoff", {bfShift, bfAddOffset}, [](auto v) -> Program {
 			return {
 				{bfAddOffset, v[1].args[0], v[1].args[1] + v[0].args[0]},
 				v[0]
@@ -443,14 +619,14 @@ bool Optimizer::stage2_peephole_optimize(Program& program, ProgramIt begin, Prog
 		}},
 
 		// Shifted sets
-		{{bfShift, bfSet}, [](auto v) -> Program {
+		{"shift, set to setoff", {bfShift, bfSet}, [](auto v) -> Program {
 			return {
 				{bfSetOffset, v[1].args[0], v[0].args[0]},
 				v[0]
 			};
 		}},
 
-		{{bfShift, bfSetOffset}, [](auto v) -> Program {
+		{"shift, setoff to setoff", {bfShift, bfSetOffset}, [](auto v) -> Program {
 			return {
 				{bfSetOffset, v[1].args[0], v[1].args[1] + v[0].args[0]},
 				v[0]
@@ -461,77 +637,569 @@ bool Optimizer::stage2_peephole_optimize(Program& program, ProgramIt begin, Prog
 	return peephole_optimize_for(program, begin, end, peephole_optimizers);
 }
 
-void Optimizer::optimize(Program& program)
+void Optimizer::fold_constant_output(Program& program, DataSegment& data)
 {
-	update_state_debug(program);
+	// Known cell values, by position relative to the tape pointer as it was when the state of the tape was last lost.
+	// Cells missing from the map are zero as long as `others_zero` holds, which is the case at the start of the program.
+	std::unordered_map<long, std::optional<std::uint8_t>> known;
+	bool others_zero = true;
+	long pos = 0;
 
-	const std::array<std::vector<OptimizerTask>, stage_count> tasks
-	{{
+	const auto value_of = [&](long cell) -> std::optional<std::uint8_t> {
+		const auto it = known.find(cell);
+
+		if (it != known.end())
 		{
-			{&Optimizer::merge_stackable, "Merge stackable instructions"},
-			{&Optimizer::stage1_peephole_optimize, "Peephole"},
-			{&Optimizer::balanced_loop_unrolling,  "Balanced loop unrolling"}
-		},
+			return it->second;
+		}
 
+		return others_zero ? std::optional<std::uint8_t>{0} : std::nullopt;
+	};
+
+	// Cells accessed since the state of the tape was last lost are within the tape, as is any cell between them. Under
+	// bounds checks, only accesses out of that range may stop the program.
+	CellRange reached;
+	reached.include(0);
+
+	const auto forget = [&] {
+		known.clear();
+		others_zero = false;
+		pos = 0;
+		reached = {};
+		reached.include(0);
+	};
+
+	// Bytes left to write are the end of `data`. They are written as late as possible so that text printed by successive
+	// instructions makes a single write, but never past an instruction that may read input, hang or fail.
+	size_t pending_begin = data.size();
+	Program folded;
+	folded.reserve(program.size());
+
+	const auto flush = [&] {
+		// The length of a write is bound by the second argument of an instruction.
+		constexpr size_t max_write_size = std::numeric_limits<VMArg>::max();
+
+		for (size_t begin = pending_begin; begin < data.size(); begin += max_write_size)
 		{
-			{&Optimizer::merge_stackable,          "Merge stackable instructions"},
-			{&Optimizer::stage2_peephole_optimize, "Optimize offset memory sets through specialized instructions"},
-			{&Optimizer::stage1_peephole_optimize, "Peephole"}
+			const size_t size = std::min(max_write_size, data.size() - begin);
+			folded.emplace_back(bfWriteConst, VMArg(begin), VMArg(size));
 		}
-	}};
 
-	for (size_t stage = 0; stage < stage_count; ++stage)
+		pending_begin = data.size();
+	};
+
+	// Returns whether the access may stop the program, in which case it has to stay.
+	const auto access = [&](long cell) {
+		const bool may_fail = bounds_checked && (cell < reached.min || cell > reached.max);
+
+		if (may_fail)
+		{
+			flush();
+		}
+
+		reached.include(cell);
+		return may_fail;
+	};
+
+	for (const auto& op : program)
+	{
+		switch (op.opcode)
+		{
+		case bfAdd:
+		case bfAddOffset:
+		{
+			const long cell = pos + (op.opcode == bfAddOffset ? op.args[1] : 0);
+			access(cell);
+
+			if (const auto value = value_of(cell))
+			{
+				known[cell] = std::uint8_t(*value + op.args[0]);
+			}
+
+			break;
+		}
+
+		case bfSet:
+		{
+			access(pos);
+			known[pos] = std::uint8_t(op.args[0]);
+			break;
+		}
+
+		case bfSetOffset:
+		{
+			access(pos + op.args[1]);
+			known[pos + op.args[1]] = std::uint8_t(op.args[0]);
+			break;
+		}
+
+		case bfShift: pos += op.args[0]; break;
+
+		case bfMAC:
+		{
+			access(pos);
+			access(pos + op.args[1]);
+
+			const auto value = value_of(pos), factor = value_of(pos + op.args[1]);
+
+			if (value && factor)
+			{
+				known[pos] = std::uint8_t(*value + op.args[0] * *factor);
+			}
+			else
+			{
+				known[pos] = std::nullopt;
+			}
+
+			break;
+		}
+
+		case bfCharOut:
+		{
+			const bool may_fail = access(pos);
+
+			if (const auto value = value_of(pos); value && !may_fail)
+			{
+				data.insert(data.end(), size_t(op.args[0]), *value);
+
+				if (stats != nullptr)
+				{
+					stats->count_rewrite("fold constant output");
+				}
+
+				continue;
+			}
+
+			flush();
+			break;
+		}
+
+		case bfCharIn:
+		{
+			flush();
+			known[pos] = std::nullopt;
+			break;
+		}
+
+		// Whatever happened within a block or during a shift of unknown length, only the current cell is known afterwards.
+		case bfShiftUntilZero:
+		case bfLoopEnd:
+		case bfIfEnd:
+		{
+			flush();
+			forget();
+			known[pos] = 0;
+			break;
+		}
+
+		// The body of a block may run with any tape state.
+		case bfLoopBegin:
+		case bfIfBegin:
+		{
+			flush();
+			forget();
+			break;
+		}
+
+		default:
+		{
+			flush();
+			break;
+		}
+		}
+
+		folded.push_back(op);
+	}
+
+	flush();
+	program = std::move(folded);
+}
+
+void Optimizer::group_block_ops(Program& program, DataSegment& data)
+{
+	// Runs shorter than that are left alone, as are blocks covering fewer cells.
+	constexpr size_t min_block_cells = 4;
+
+	// Cells in between those an add block covers get 0 added, as long as the gap is at most that large.
+	constexpr long max_add_gap = 3;
+
+	struct CellEffect
 	{
-		for (size_t pass = 0;; ++pass)
+		bool set;
+		std::uint8_t value;
+	};
+
+	const auto is_cell_op = [](const VMOp& op) {
+		return op.opcode == bfSet || op.opcode == bfSetOffset || op.opcode == bfAdd || op.opcode == bfAddOffset;
+	};
+
+	Program grouped;
+	grouped.reserve(program.size());
+
+	for (auto i = program.begin(); i != program.end();)
+	{
+		if (!is_cell_op(*i))
+		{
+			grouped.push_back(*i);
+			++i;
+			continue;
+		}
+
+		const auto run_end = std::find_if_not(i, program.end(), is_cell_op);
+
+		if (size_t(run_end - i) < min_block_cells)
+		{
+			grouped.insert(grouped.end(), i, run_end);
+			i = run_end;
+			continue;
+		}
+
+		// None of those instructions read any cell but the one they write, so only their final effect on every cell matters.
+		std::map<long, CellEffect> cells;
+
+		for (auto op = i; op != run_end; ++op)
 		{
-			if (pass >= pass_count)
+			const bool set = op->opcode == bfSet || op->opcode == bfSetOffset;
+			const long offset = (op->opcode == bfSetOffset || op->opcode == bfAddOffset) ? op->args[1] : 0;
+			const auto value = std::uint8_t(op->args[0]);
+
+			auto [effect, inserted] = cells.try_emplace(offset, CellEffect{set, value});
+
+			if (!inserted)
 			{
-				fmt::print(warnout(optimizeinfo), "Maximal optimization pass reached for stage {}. Consider increasing -optimizepasses.\n", stage);
-				break;
+				effect->second = set ? CellEffect{true, value} : CellEffect{effect->second.set, std::uint8_t(effect->second.value + value)};
 			}
+		}
 
-			bool pass_effective = false;
+		Program replacement;
+		const size_t data_size = data.size();
 
-			if (verbose)
+		const auto emit_single = [&](long offset, CellEffect effect) {
+			if (offset == 0)
+			{
+				replacement.emplace_back(effect.set ? bfSet : bfAdd, effect.value);
+			}
+			else
 			{
-				fmt::print(infoout(optimizeinfo), "Performing pass #{}\n", pass + 1);
+				replacement.emplace_back(effect.set ? bfSetOffset : bfAddOffset, effect.value, VMArg(offset));
 			}
+		};
+
+		// Sets are grouped over consecutive cells, adds over cells separated by small gaps. Either kind of block is split
+		// where it reaches the maximum size.
+		for (const bool set : {true, false})
+		{
+			std::vector<std::pair<long, std::uint8_t>> block;
+			size_t block_cells = 0;
+
+			const auto flush_block = [&] {
+				if (block_cells >= min_block_cells)
+				{
+					std::vector<std::uint8_t> bytes(size_t(block.back().first - block.front().first + 1), 0);
+
+					for (const auto& [offset, value] : block)
+					{
+						bytes[size_t(offset - block.front().first)] = value;
+					}
 
-			for (auto& task : tasks[stage])
+					replacement.emplace_back(set ? bfSetBlock : bfAddBlock, append_block(data, bytes), VMArg(block.front().first));
+				}
+				else
+				{
+					for (const auto& [offset, value] : block)
+					{
+						emit_single(offset, {set, value});
+					}
+				}
+
+				block.clear();
+				block_cells = 0;
+			};
+
+			for (const auto& [offset, effect] : cells)
 			{
-				bool effective = (this->*(task.callback))(program, program.begin(), program.end());
+				if (effect.set != set || (!set && effect.value == 0))
+				{
+					continue;
+				}
+
+				const long max_gap = set ? 1 : max_add_gap + 1;
 
-				if (verbose)
+				if (!block.empty()
+					&& (offset - block.back().first > max_gap
+						|| size_t(offset - block.front().first) >= max_block_size))
 				{
-					fmt::print(infoout(optimizeinfo), "Performed optimization task '{}', effectiveness={}\n", task.name, effective);
+					flush_block();
 				}
 
-				if (effective)
+				block.emplace_back(offset, effect.value);
+				++block_cells;
+			}
+
+			flush_block();
+		}
+
+		if (replacement.size() < size_t(run_end - i))
+		{
+			grouped.insert(grouped.end(), replacement.begin(), replacement.end());
+
+			if (stats != nullptr)
+			{
+				stats->count_rewrite("group sets and adds into blocks");
+			}
+		}
+		else
+		{
+			grouped.insert(grouped.end(), i, run_end);
+			data.resize(data_size);
+		}
+
+		i = run_end;
+	}
+
+	program = std::move(grouped);
+}
+
+std::vector<Program> Optimizer::split_regions(const Program& program, size_t batch_target_size) const
+{
+	std::vector<Program> batches;
+
+	// The only task matching a sequence involving I/O instructions merges stackable `cout`, which optimize() redoes where
+	// regions meet, and the only rewrite looking behind a loop (unrolling) treats an I/O instruction the same as having
+	// nothing before it. A top-level I/O instruction is thus a boundary no other rewrite can cross, whereas cutting between
+	// arbitrary top-level loops would lose e.g. `set`-`add` merges and loop unrolling.
+	auto batch_begin = program.begin();
+	size_t depth = 0;
+
+	for (auto it = program.begin(); it != program.end(); ++it)
+	{
+		switch (it->opcode)
+		{
+		case bfLoopBegin:
+		case bfIfBegin: ++depth; break;
+		case bfLoopEnd:
+		case bfIfEnd: --depth; break;
+
+		case bfCharIn:
+		case bfCharOut:
+		{
+			if (depth == 0 && size_t(std::distance(batch_begin, it)) >= batch_target_size)
+			{
+				batches.emplace_back(batch_begin, it + 1);
+				batch_begin = it + 1;
+			}
+
+			break;
+		}
+
+		default: break;
+		}
+	}
+
+	if (batch_begin != program.end() || batches.empty())
+	{
+		batches.emplace_back(batch_begin, program.end());
+	}
+
+	return batches;
+}
+
+void Optimizer::optimize(Program& program, DataSegment& data)
+{
+	if (debug)
+	{
+		debug_states.reset(program);
+	}
+
+	// Debug states record rewrites in order over the whole program and verbose logs are per-stage, so keep those serial.
+	if (debug || verbose)
+	{
+		optimize_stages(program);
+	}
+	else
+	{
+		// Batch boundaries do not depend on the thread count, so that the result is the same whatever it is: windows of
+		// the pass manager may then differ from those of a single batch, but each region is always optimized the same way.
+		// Batches are large enough for the bookkeeping to stay negligible.
+		constexpr size_t batch_target_size = 16384;
+		auto batches = split_regions(program, batch_target_size);
+
+		if (batches.size() == 1)
+		{
+			optimize_stages(program);
+		}
+		else
+		{
+			// Statistics are collected per batch and merged back, as if the batches were one region.
+			std::vector<PipelineStats> batch_stats(stats != nullptr ? batches.size() : 0);
+
+			const size_t threads = (thread_count != 0) ? thread_count : ThreadPool::default_thread_count();
+			ThreadPool pool{std::min(threads, batches.size())};
+			pool.parallel_for(batches.size(), [&](size_t i) {
+				Optimizer batch_optimizer = *this;
+				batch_optimizer.stats = (stats != nullptr) ? &batch_stats[i] : nullptr;
+				batch_optimizer.optimize_stages(batches[i]);
+			});
+
+			if (stats != nullptr)
+			{
+				for (size_t i = 1; i < batch_stats.size(); ++i)
 				{
-					pass_effective = true;
+					batch_stats.front().merge(batch_stats[i]);
 				}
 
-				update_state_debug(program);
+				stats->append(batch_stats.front());
 			}
 
-			if (!pass_effective)
+			// A region ends with the I/O instruction it was cut after. When both it and the next region are left with a
+			// `cout` there, as when what was in between got optimized out, those get merged as a single region would have.
+			program.clear();
+			for (auto& batch : batches)
 			{
-				if (verbose)
+				auto first = batch.begin();
+
+				if (!program.empty() && first != batch.end() && program.back().opcode == bfCharOut
+					&& first->opcode == bfCharOut)
 				{
-					fmt::print(infoout(optimizeinfo), "Pass was not effective, optimizations performed\n");
+					program.back().args[0] += first->args[0];
+					++first;
+
+					if (stats != nullptr)
+					{
+						stats->count_rewrite("merge stackable instructions");
+					}
 				}
 
-				break;
+				program.insert(program.end(), first, batch.end());
 			}
 		}
 	}
 
+	if (debug)
+	{
+		debug_states.begin_window(program, 0);
+	}
+
+	const auto fold = [&] {
+		fold_constant_output(program, data);
+		return true;
+	};
+
+	if (stats != nullptr)
+	{
+		stats->time_phase("Constant output folding", program, fold, 1);
+	}
+	else
+	{
+		fold();
+	}
+
+	if (debug)
+	{
+		debug_states.record(program, 0, program.size());
+	}
+
+	const auto group = [&] {
+		group_block_ops(program, data);
+		return true;
+	};
+
+	if (stats != nullptr)
+	{
+		stats->time_phase("Block memory operations", program, group, 1);
+	}
+	else
+	{
+		group();
+	}
+
+	if (debug)
+	{
+		debug_states.record(program, 0, program.size());
+	}
+
 	program.shrink_to_fit();
 
+	if (verbose && profile != nullptr)
+	{
+		report_hot_loops(program);
+	}
+
 	if (debug)
 	{
+		debug_run_params.data = data;
 		analyze_debug_states();
 	}
 }
 
+void Optimizer::optimize_stages(Program& program)
+{
+	// Triggers list the opcodes any of which must be present in a region for the task to possibly rewrite something there.
+	const std::array<std::vector<OptimizerTask>, stage_count> tasks
+	{{
+		{
+			{&Optimizer::merge_stackable,          "Merge stackable instructions", opcode_mask({bfAdd, bfShift, bfCharOut})},
+			{&Optimizer::stage1_peephole_optimize, "Peephole",                     opcode_mask({bfSet, bfLoopBegin})},
+			{&Optimizer::balanced_loop_unrolling,  "Balanced loop unrolling",      opcode_mask({bfLoopEnd})},
+			{&Optimizer::if_conversion,            "If-conversion",                opcode_mask({bfLoopEnd, bfIfEnd})}
+		},
+
+		{
+			{&Optimizer::merge_stackable,          "Merge stackable instructions", opcode_mask({bfAdd, bfShift, bfCharOut})},
+			{&Optimizer::stage2_peephole_optimize, "Optimize offset memory sets through specialized instructions", opcode_mask({bfShift})},
+			{&Optimizer::stage1_peephole_optimize, "Peephole",                     opcode_mask({bfSet, bfLoopBegin})}
+		}
+	}};
+
+	for (size_t stage = 0; stage < stage_count; ++stage)
+	{
+		PassManager manager{*this, tasks[stage]};
+
+		const auto run_stage = [&] {
+			manager.run(program);
+			return true;
+		};
+
+		if (stats != nullptr)
+		{
+			stats->time_phase(fmt::format("Stage {}", stage + 1), program, run_stage, 1);
+
+			for (size_t i = 0; i < tasks[stage].size(); ++i)
+			{
+				stats->phases.push_back({
+					.name = std::string{tasks[stage][i].name},
+					.depth = 2,
+					.time = manager.task_time[i],
+					.ops_before = manager.task_ops_before[i],
+					.ops_after = manager.task_ops_after[i],
+					.runs = manager.task_runs[i],
+					.effective_runs = manager.task_effective_runs[i]
+				});
+			}
+
+			stats->sample_ir_bytes(manager.peak_ir_bytes);
+		}
+		else
+		{
+			run_stage();
+		}
+
+		if (verbose)
+		{
+			fmt::print(infoout(optimizeinfo), "Stage {} reached a fixed point after visiting {} regions\n", stage + 1, manager.windows_visited);
+
+			for (size_t i = 0; i < tasks[stage].size(); ++i)
+			{
+				fmt::print(
+					infoout(optimizeinfo),
+					"Optimization task '{}' ran {} times, effective {} times\n",
+					tasks[stage][i].name,
+					manager.task_runs[i],
+					manager.task_effective_runs[i]
+				);
+			}
+		}
+	}
+}
+
 }
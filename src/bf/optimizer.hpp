@@ -1,53 +1,76 @@
 #ifndef OPTIMIZER_HPP
 #define OPTIMIZER_HPP
 
-#include <optional>
 #include <string>
 #include <functional>
 #include <span>
 #include "bf.hpp"
+#include "debugstates.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
 
 namespace bf
 {
 struct OptimizationSequence
 {
 	// TODO: more intelligent sequences. For example, support wildcards, multiple choices for one op in particular, etc.
+	const std::string_view name;
 	const std::vector<uint8_t> seq;
 	std::function<Program(std::span<VMOp>)> optimize;
 };
 
-class ProgramState
-{
-	mutable std::optional<std::string> cached_output;
-
-public:
-	Program program;
-	const size_t id;
-
-	ProgramState(const Program& p_program, const size_t p_id) :
-		program{p_program},
-		id{p_id}
-	{}
-
-	const std::string& get_output() const;
-};
-
 struct Optimizer
 {
 	static constexpr size_t stage_count = 2;
 
 	// Parameters
-	size_t pass_count = 5;
 	bool debug = false;
 	bool verbose = false;
 	bool legal_overflow = true;
 	bool allow_suz = true;
 
-	std::vector<ProgramState> debug_states;
-	void update_state_debug(Program &program);
+	//! Report loops found to never end, never run or run once, which are likely mistakes in the program.
+	bool warnings = true;
+
+	//! Whether bounds checks get inserted in the program, stopping it at its first access out of the tape, which output
+	//! must then not be moved past.
+	bool bounds_checked = false;
+
+	//! Worker threads used to optimize independent regions concurrently. 0 picks one per hardware thread, 1 disables it.
+	size_t thread_count = 0;
+
+	//! When set, timings and rewrite counts of the optimization tasks get recorded there.
+	PipelineStats* stats = nullptr;
+
+	//! Profile of a previous run of the program, if any. Loops it shows to be mostly skipped keep their unrolled body
+	//! behind their condition.
+	const Profile* profile = nullptr;
+
+	//! Whether the program gets profiled. Unrolled loops then keep their condition, for the profile to tell how often
+	//! they are skipped.
+	bool profiling = false;
+
+	//! How states are run to be compared in debug mode.
+	DebugRunParams debug_run_params;
+
+	DebugStates debug_states;
+
+	//! Records a rewrite in debug mode. Every instruction that changed since the last record lies within [begin, end).
+	void update_state_debug(Program &program, ProgramIt begin, ProgramIt end);
 	bool analyze_debug_states();
 
-	void optimize(Program &program);
+	//! Lists the hottest loops left in `program` according to `profile`, as those are where effort pays off.
+	void report_hot_loops(const Program &program) const;
+
+	//! Optimizes `program`. Constant data it refers to afterwards is appended to `data`.
+	void optimize(Program &program, DataSegment &data);
+
+	//! Runs every stage over the whole of `program`, which may be a standalone region of a larger program.
+	void optimize_stages(Program &program);
+
+	//! Splits `program` into batches of regions that no optimization task can rewrite across, so that batches can be
+	//! optimized separately then concatenated back.
+	std::vector<Program> split_regions(const Program &program, size_t batch_target_size) const;
 
 	bool erase_nop(
 		Program &program,
@@ -59,7 +82,7 @@ struct Optimizer
 		Program& program,
 		ProgramIt begin,
 		ProgramIt end,
-		const std::vector<OptimizationSequence>& optimizers
+		std::span<const OptimizationSequence> optimizers
 	);
 
 	// Stage 1
@@ -81,6 +104,13 @@ struct Optimizer
 		ProgramIt end
 	);
 
+	//! Turns loops that run at most once into ifs, unwraps ifs that always run and removes loops and ifs that never run.
+	bool if_conversion(
+		Program &program,
+		ProgramIt begin,
+		ProgramIt end
+	);
+
 	// Stage 2 - involves add-offset and set-offset. it is performed in a separate stage as to simplify stage 1 optimizations.
 	bool stage2_peephole_optimize(
 		Program &program,
@@ -88,6 +118,13 @@ struct Optimizer
 		ProgramIt end
 	);
 
+	// Late - runs once over the whole program, as the value of cells is only known from the start of the program onward.
+	//! Replaces output of cells whose value is known at compile time by bulk writes of constant data from `data`.
+	void fold_constant_output(Program &program, DataSegment &data);
+
+	//! Replaces runs of sets and adds to nearby cells by block instructions whose values are stored in `data`.
+	void group_block_ops(Program &program, DataSegment &data);
+
 	bool simplify_offset_ops(
 		Program& program,
 		ProgramIt begin,
@@ -99,6 +136,7 @@ struct OptimizerTask
 {
 	bool (Optimizer::*callback)(Program&, ProgramIt, ProgramIt);
 	const std::string_view name;
+	OpcodeMask triggers;
 };
 }
 
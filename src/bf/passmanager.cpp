@@ -0,0 +1,360 @@
+#include "passmanager.hpp"
+
+#include "optimizer.hpp"
+
+#include <algorithm>
+
+namespace bf
+{
+namespace
+{
+//! How far past a rewritten instruction a peephole sequence may extend. The longest sequences are 3 instructions long.
+constexpr size_t peephole_reach = 2;
+
+//! Windows up to this size are optimized until they reach a fixed point on their own, which is cheaper than gathering
+//! windows around each of their dirty instructions again. Only their edges may then need to be revisited.
+constexpr size_t local_fixed_point_size = 256;
+
+bool is_block_begin(const VMOp& op) { return op.opcode == bfLoopBegin || op.opcode == bfIfBegin; }
+bool is_block_end(const VMOp& op) { return op.opcode == bfLoopEnd || op.opcode == bfIfEnd; }
+bool is_block_boundary(const VMOp& op) { return is_block_begin(op) || is_block_end(op); }
+
+bool is_well_bracketed(const Program& program)
+{
+	long depth = 0;
+	for (const auto& op : program)
+	{
+		depth += is_block_begin(op) ? 1 : (is_block_end(op) ? -1 : 0);
+
+		if (depth < 0)
+		{
+			return false;
+		}
+	}
+
+	return depth == 0;
+}
+
+OpcodeMask present_opcodes(const Program& program)
+{
+	OpcodeMask mask = 0;
+	for (const auto& op : program)
+	{
+		mask |= OpcodeMask(1) << op.opcode;
+	}
+	return mask;
+}
+}
+
+PassManager::PassManager(Optimizer& optimizer, std::span<const OptimizerTask> tasks) :
+	task_runs(tasks.size()),
+	task_effective_runs(tasks.size()),
+	task_time(tasks.size()),
+	task_ops_before(tasks.size()),
+	task_ops_after(tasks.size()),
+	optimizer{optimizer},
+	tasks{tasks},
+	measure{optimizer.stats != nullptr}
+{}
+
+void PassManager::run(Program& program)
+{
+	// Mismatched loops are reported by the linker. Just make sure every task got to run over all of the program until
+	// nothing changes, as the windows below rely on loops being matched.
+	if (!is_well_bracketed(program))
+	{
+		window = std::move(program);
+
+		do
+		{
+			for (auto& op : window)
+			{
+				op.dirty = true;
+			}
+
+			sample_ir_bytes();
+			optimize_window();
+		} while (std::any_of(window.begin(), window.end(), [](const auto& op) { return op.dirty; }));
+
+		program = std::move(window);
+		return;
+	}
+
+	right.assign(program.rbegin(), program.rend());
+	for (auto& op : right)
+	{
+		op.dirty = true;
+	}
+
+	program.clear();
+	left = std::move(program);
+	left.reserve(right.size());
+
+	for (;;)
+	{
+		// Move the gap up to the next dirty instruction
+		while (!right.empty() && !right.back().dirty)
+		{
+			push_left(right.back());
+			right.pop_back();
+		}
+
+		if (right.empty())
+		{
+			break;
+		}
+
+		gather_window();
+		sample_ir_bytes();
+		optimize_window();
+
+		// The window gets revisited from its start if it was rewritten, otherwise it is done with
+		if (std::any_of(window.begin(), window.end(), [](const auto& op) { return op.dirty; }))
+		{
+			right.insert(right.end(), window.rbegin(), window.rend());
+		}
+		else
+		{
+			for (const auto& op : window)
+			{
+				push_left(op);
+			}
+		}
+
+		window.clear();
+	}
+
+	program = std::move(left);
+	left = {};
+	left_open_loops.clear();
+	left_closed_loops.clear();
+}
+
+void PassManager::push_left(const VMOp& op)
+{
+	if (is_block_begin(op))
+	{
+		left_open_loops.push_back(left.size());
+	}
+	else if (is_block_end(op))
+	{
+		left_closed_loops.push_back(left_open_loops.back());
+		left_open_loops.pop_back();
+	}
+
+	left.push_back(op);
+}
+
+void PassManager::take_left_from(size_t left_index)
+{
+	// Undo the bracket bookkeeping of the instructions being moved out, from last to first
+	for (size_t i = left.size(); i-- > left_index;)
+	{
+		if (is_block_begin(left[i]))
+		{
+			left_open_loops.pop_back();
+		}
+		else if (is_block_end(left[i]))
+		{
+			left_open_loops.push_back(left_closed_loops.back());
+			left_closed_loops.pop_back();
+		}
+	}
+
+	window.insert(window.begin(), left.begin() + left_index, left.end());
+	left.resize(left_index);
+}
+
+void PassManager::take_left_straight(size_t count)
+{
+	size_t from = left.size();
+	while (count != 0 && from != 0 && !is_block_boundary(left[from - 1]))
+	{
+		--from;
+		--count;
+	}
+
+	take_left_from(from);
+}
+
+void PassManager::take_right(size_t count)
+{
+	window.insert(window.end(), right.rbegin(), right.rbegin() + count);
+	right.resize(right.size() - count);
+}
+
+void PassManager::take_right_closing(size_t depth)
+{
+	auto it = right.rbegin();
+	for (; depth != 0 && it != right.rend(); ++it)
+	{
+		if (is_block_begin(*it))
+		{
+			++depth;
+		}
+		else if (is_block_end(*it))
+		{
+			--depth;
+		}
+	}
+
+	take_right(size_t(it - right.rbegin()));
+}
+
+void PassManager::gather_window()
+{
+	// Dirty instructions, and those close enough to one of them to be matched along with it
+	auto cluster_end = right.rbegin();
+	for (size_t since_dirty = 0;
+		 cluster_end != right.rend()
+		 && (cluster_end->dirty || (since_dirty < peephole_reach && !is_block_boundary(*cluster_end)));
+		 ++cluster_end)
+	{
+		since_dirty = cluster_end->dirty ? 0 : since_dirty + 1;
+	}
+
+	take_right(size_t(cluster_end - right.rbegin()));
+
+	take_left_straight(peephole_reach);
+
+	// Complete the loops the window partially covers
+	long depth = 0, min_depth = 0;
+	for (const auto& op : window)
+	{
+		if (is_block_begin(op))
+		{
+			++depth;
+		}
+		else if (is_block_end(op))
+		{
+			min_depth = std::min(min_depth, --depth);
+		}
+	}
+
+	if (min_depth < 0)
+	{
+		take_left_from(left_open_loops[left_open_loops.size() - size_t(-min_depth)]);
+	}
+
+	take_right_closing(size_t(depth - min_depth));
+
+	// Loops are only ever rewritten when their body is straight-line code, which the enclosing loop may just have become.
+	const bool window_straight = std::none_of(window.begin(), window.end(), is_block_boundary);
+
+	if (window_straight && !left_open_loops.empty())
+	{
+		const size_t enclosing_begin = left_open_loops.back();
+
+		size_t left_boundary = left.size() - 1;
+		while (!is_block_boundary(left[left_boundary]))
+		{
+			--left_boundary;
+		}
+
+		const auto right_boundary = std::find_if(right.rbegin(), right.rend(), is_block_boundary);
+
+		if (left_boundary == enclosing_begin && right_boundary != right.rend() && is_block_end(*right_boundary))
+		{
+			take_left_from(enclosing_begin);
+			take_right_closing(1);
+		}
+	}
+
+	// Similarly, the loop following the window can be unrolled if the instruction before it became a known `set`.
+	if (right.size() >= 2 && is_block_begin(right.back()))
+	{
+		const auto body_boundary = std::find_if(right.rbegin() + 1, right.rend(), is_block_boundary);
+
+		if (body_boundary != right.rend() && is_block_end(*body_boundary))
+		{
+			take_right(size_t(body_boundary - right.rbegin()) + 1);
+		}
+	}
+
+	// Loop unrolling also looks at the instruction preceding a loop
+	if (is_block_begin(window.front()))
+	{
+		take_left_straight(1);
+	}
+}
+
+void PassManager::sample_ir_bytes()
+{
+	if (measure)
+	{
+		peak_ir_bytes = std::max(peak_ir_bytes, (left.capacity() + window.capacity() + right.capacity()) * sizeof(VMOp));
+	}
+}
+
+void PassManager::optimize_window()
+{
+	++windows_visited;
+
+	for (auto& op : window)
+	{
+		op.dirty = false;
+	}
+
+	// Instructions before the window are all in `left`, which holds no bfNop in between tasks.
+	if (optimizer.debug)
+	{
+		optimizer.debug_states.begin_window(window, left.size());
+	}
+
+	OpcodeMask present = present_opcodes(window);
+	bool changed = false;
+
+	for (bool round_effective = true; round_effective;)
+	{
+		round_effective = false;
+
+		for (size_t i = 0; i < tasks.size(); ++i)
+		{
+			if ((tasks[i].triggers & present) == 0)
+			{
+				continue;
+			}
+
+			++task_runs[i];
+
+			const size_t ops_before = window.size();
+			const auto start = measure ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+			const bool effective = (optimizer.*(tasks[i].callback))(window, window.begin(), window.end());
+
+			if (measure)
+			{
+				task_time[i] += std::chrono::steady_clock::now() - start;
+				task_ops_before[i] += ops_before;
+				task_ops_after[i] += window.size();
+			}
+
+			if (effective)
+			{
+				++task_effective_runs[i];
+				present = present_opcodes(window);
+				round_effective = true;
+			}
+		}
+
+		changed |= round_effective;
+
+		if (window.size() > local_fixed_point_size)
+		{
+			break;
+		}
+	}
+
+	// A window at a fixed point may still allow rewrites involving what surrounds it
+	if (changed && !window.empty() && window.size() <= local_fixed_point_size)
+	{
+		for (auto& op : window)
+		{
+			op.dirty = false;
+		}
+
+		window.front().dirty = true;
+		window.back().dirty = true;
+	}
+}
+}
@@ -0,0 +1,75 @@
+#ifndef PASSMANAGER_HPP
+#define PASSMANAGER_HPP
+
+#include "bf.hpp"
+
+#include <chrono>
+#include <span>
+#include <vector>
+
+namespace bf
+{
+struct Optimizer;
+struct OptimizerTask;
+
+//! Runs a stage's optimization tasks until no task can rewrite anything, only revisiting regions that were rewritten.
+//!
+//! Tasks mark the instructions they rewrite as dirty. The manager sweeps the program for dirty instructions and runs the
+//! tasks over a window made of the dirty instructions and of what could be matched along with them: their neighbours,
+//! the loops they are part of, the enclosing loop when it may have become unrollable, and the instruction before it.
+//! Only the tasks whose triggers appear in the window are run.
+//!
+//! The program is held as a gap buffer around the window, so moving the window or resizing it only costs the distance
+//! involved rather than moving the rest of the program.
+class PassManager
+{
+public:
+	PassManager(Optimizer& optimizer, std::span<const OptimizerTask> tasks);
+
+	void run(Program& program);
+
+	size_t windows_visited = 0;
+	std::vector<size_t> task_runs, task_effective_runs;
+
+	//! Only measured when the optimizer collects statistics. Instruction counts are summed over every window a task ran on.
+	std::vector<std::chrono::nanoseconds> task_time;
+	std::vector<size_t> task_ops_before, task_ops_after;
+	size_t peak_ir_bytes = 0;
+
+private:
+	void push_left(const VMOp& op);
+
+	//! Moves the instructions after index `left_index` of the left side to the beginning of the window.
+	void take_left_from(size_t left_index);
+
+	//! Moves up to `count` instructions preceding the window into it, stopping at loop boundaries.
+	void take_left_straight(size_t count);
+
+	//! Moves the `count` instructions following the window into it.
+	void take_right(size_t count);
+
+	//! Takes instructions after the window until `depth` loops were closed.
+	void take_right_closing(size_t depth);
+
+	void gather_window();
+	void optimize_window();
+	void sample_ir_bytes();
+
+	Optimizer& optimizer;
+	std::span<const OptimizerTask> tasks;
+	bool measure;
+
+	//! Instructions before the window, in order.
+	Program left;
+
+	//! Indices within `left` of the loops left open, and of the loops closed within `left`, used to restore the former.
+	std::vector<size_t> left_open_loops, left_closed_loops;
+
+	Program window;
+
+	//! Instructions after the window, in reverse order.
+	Program right;
+};
+}
+
+#endif // PASSMANAGER_HPP
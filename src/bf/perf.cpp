@@ -0,0 +1,206 @@
+#include "perf.hpp"
+
+#include "stats.hpp"
+
+#include <fmt/core.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace bf
+{
+namespace
+{
+double to_ms(std::chrono::nanoseconds time)
+{
+	return std::chrono::duration<double, std::milli>(time).count();
+}
+
+constexpr std::uint64_t cache_read_misses(std::uint64_t cache)
+{
+	return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+std::string format_count(const std::optional<std::uint64_t>& count)
+{
+	return count ? fmt::format("{}", *count) : "-";
+}
+
+std::string format_per_op(const std::optional<std::uint64_t>& count, std::uint64_t ops)
+{
+	return (count && ops != 0) ? format_fixed(double(*count) / double(ops), 3) : "-";
+}
+
+std::string json_count(const std::optional<std::uint64_t>& count)
+{
+	return count ? fmt::format("{}", *count) : "null";
+}
+
+std::optional<double> ipc(const ExecutionStats& stats)
+{
+	if (!stats.cycles || !stats.instructions || *stats.cycles == 0)
+	{
+		return std::nullopt;
+	}
+
+	return double(*stats.instructions) / double(*stats.cycles);
+}
+}
+
+PerfCounter::PerfCounter(std::uint32_t type, std::uint64_t config)
+{
+	perf_event_attr attr{};
+	attr.type = type;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+PerfCounter::~PerfCounter()
+{
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+void PerfCounter::start()
+{
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+std::optional<std::uint64_t> PerfCounter::stop()
+{
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	struct
+	{
+		std::uint64_t count, time_enabled, time_running;
+	} values;
+
+	if (read(fd, &values, sizeof(values)) != sizeof(values) || values.time_running == 0)
+	{
+		return std::nullopt;
+	}
+
+	return std::uint64_t(double(values.count) * double(values.time_enabled) / double(values.time_running));
+}
+
+std::string_view ExecutionStats::bottleneck() const
+{
+	// Rough costs of a mispredicted branch and of a load served by memory, in cycles. When neither accounts for much of
+	// the run, the interpreter is assumed to be limited by dispatching instructions.
+	constexpr double branch_miss_cycles = 15.0, llc_miss_cycles = 100.0, bound_share = 0.3;
+
+	if (!cycles || !branch_misses || !llc_misses || *cycles == 0)
+	{
+		return {};
+	}
+
+	const double branch_share = double(*branch_misses) * branch_miss_cycles / double(*cycles);
+	const double memory_share = double(*llc_misses) * llc_miss_cycles / double(*cycles);
+
+	if (memory_share >= bound_share && memory_share >= branch_share)
+	{
+		return "memory";
+	}
+
+	if (branch_share >= bound_share)
+	{
+		return "branches";
+	}
+
+	return "dispatch";
+}
+
+void ExecutionStats::print_table(std::FILE* file) const
+{
+	const std::uint64_t ops = vm.dispatches;
+
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "Execution", "Count", "Per op");
+	fmt::print(file, "{:<24} {:>16}\n", "Time (ms)", format_fixed(to_ms(time), 3));
+	fmt::print(file, "{:<24} {:>16}\n", "Ops dispatched", ops);
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "Back-edges taken", vm.back_edges, format_per_op(vm.back_edges, ops));
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "Bytes output", vm.bytes_output, format_per_op(vm.bytes_output, ops));
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "Cycles", format_count(cycles), format_per_op(cycles, ops));
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "Instructions", format_count(instructions), format_per_op(instructions, ops));
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "Branch misses", format_count(branch_misses), format_per_op(branch_misses, ops));
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "L1D load misses", format_count(l1d_misses), format_per_op(l1d_misses, ops));
+	fmt::print(file, "{:<24} {:>16} {:>12}\n", "LLC load misses", format_count(llc_misses), format_per_op(llc_misses, ops));
+
+	const auto run_ipc = ipc(*this);
+	fmt::print(file, "{:<24} {:>16}\n", "IPC", run_ipc ? format_fixed(*run_ipc, 2) : "-");
+
+	const auto bound = bottleneck();
+	fmt::print(file, "{:<24} {:>16}\n", "Likely bound by", bound.empty() ? "-" : bound);
+}
+
+void ExecutionStats::print_json(std::FILE* file) const
+{
+	const auto run_ipc = ipc(*this);
+	const auto bound = bottleneck();
+
+	fmt::print(
+		file,
+		"{{\n\t\"time_ms\": {},\n\t\"dispatches\": {},\n\t\"back_edges\": {},\n\t\"bytes_output\": {},\n"
+		"\t\"cycles\": {},\n\t\"instructions\": {},\n\t\"branch_misses\": {},\n\t\"l1d_misses\": {},\n\t\"llc_misses\": {},\n"
+		"\t\"ipc\": {},\n\t\"bottleneck\": {}\n}}\n",
+		json_fixed(to_ms(time), 3),
+		vm.dispatches,
+		vm.back_edges,
+		vm.bytes_output,
+		json_count(cycles),
+		json_count(instructions),
+		json_count(branch_misses),
+		json_count(l1d_misses),
+		json_count(llc_misses),
+		run_ipc ? json_fixed(*run_ipc, 3) : "null",
+		bound.empty() ? "null" : fmt::format("\"{}\"", bound)
+	);
+}
+
+ExecutionCounters::ExecutionCounters() :
+	cycles{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	instructions{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	branch_misses{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	l1d_misses{PERF_TYPE_HW_CACHE, cache_read_misses(PERF_COUNT_HW_CACHE_L1D)},
+	llc_misses{PERF_TYPE_HW_CACHE, cache_read_misses(PERF_COUNT_HW_CACHE_LL)}
+{}
+
+bool ExecutionCounters::any_valid() const
+{
+	return cycles.valid() || instructions.valid() || branch_misses.valid() || l1d_misses.valid() || llc_misses.valid();
+}
+
+void ExecutionCounters::start()
+{
+	for (PerfCounter* counter : {&cycles, &instructions, &branch_misses, &l1d_misses, &llc_misses})
+	{
+		if (counter->valid())
+		{
+			counter->start();
+		}
+	}
+}
+
+void ExecutionCounters::stop(ExecutionStats& stats)
+{
+	const auto read = [](PerfCounter& counter) {
+		return counter.valid() ? counter.stop() : std::nullopt;
+	};
+
+	stats.cycles = read(cycles);
+	stats.instructions = read(instructions);
+	stats.branch_misses = read(branch_misses);
+	stats.l1d_misses = read(l1d_misses);
+	stats.llc_misses = read(llc_misses);
+}
+}
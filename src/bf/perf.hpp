@@ -0,0 +1,71 @@
+#ifndef PERF_HPP
+#define PERF_HPP
+
+#include "vm.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string_view>
+
+namespace bf
+{
+//! Hardware event counter of the calling thread, in user space only. Invalid when the kernel does not let us count, as
+//! is common within containers and virtual machines.
+class PerfCounter
+{
+public:
+	//! `type` and `config` are those of `perf_event_attr`.
+	PerfCounter(std::uint32_t type, std::uint64_t config);
+	~PerfCounter();
+
+	PerfCounter(const PerfCounter&) = delete;
+	PerfCounter& operator=(const PerfCounter&) = delete;
+
+	bool valid() const { return fd >= 0; }
+
+	void start();
+
+	//! Returns the count since `start`, extrapolated when the kernel had to share the hardware with other counters.
+	std::optional<std::uint64_t> stop();
+
+private:
+	int fd;
+};
+
+//! Hardware event counts and interpreter work of a run, as reported by `-perf-stats`. Events the kernel could not count
+//! are missing.
+struct ExecutionStats
+{
+	std::chrono::nanoseconds time{};
+
+	VmCounters vm;
+
+	std::optional<std::uint64_t> cycles, instructions, branch_misses, l1d_misses, llc_misses;
+
+	//! Rough guess of what limits the run: "memory", "branches" or "dispatch". Empty without the needed counters.
+	std::string_view bottleneck() const;
+
+	void print_table(std::FILE* file) const;
+	void print_json(std::FILE* file) const;
+};
+
+//! Counters of every hardware event of `ExecutionStats`.
+class ExecutionCounters
+{
+public:
+	ExecutionCounters();
+
+	//! True when at least one event can be counted.
+	bool any_valid() const;
+
+	void start();
+	void stop(ExecutionStats& stats);
+
+private:
+	PerfCounter cycles, instructions, branch_misses, l1d_misses, llc_misses;
+};
+}
+
+#endif // PERF_HPP
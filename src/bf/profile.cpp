@@ -0,0 +1,71 @@
+#include "profile.hpp"
+
+#include <fmt/core.h>
+#include <fmt/ostream.h>
+#include <fstream>
+#include <string>
+
+namespace bf
+{
+namespace
+{
+constexpr std::string_view profile_magic = "ashbf-profile", profile_version = "1";
+}
+
+bool Profile::save(std::string_view path) const
+{
+	std::ofstream file{std::string{path}};
+	if (!file)
+	{
+		return false;
+	}
+
+	fmt::print(file, "{} {}\nhash {:016x}\nloops {}\n", profile_magic, profile_version, program_hash, loops.size());
+
+	for (const auto& loop : loops)
+	{
+		const bool has_shift = loop.iterations != 0 && loop.min_shift <= loop.max_shift;
+
+		fmt::print(
+			file,
+			"{} {} {} {} {}\n",
+			loop.reached,
+			loop.entered,
+			loop.iterations,
+			has_shift ? loop.min_shift : 0,
+			has_shift ? loop.max_shift : 0
+		);
+	}
+
+	return bool(file);
+}
+
+bool Profile::load(std::string_view path)
+{
+	std::ifstream file{std::string{path}};
+
+	std::string magic, version, hash_key, loops_key;
+	size_t loop_count = 0;
+
+	if (!(file >> magic >> version >> hash_key >> std::hex >> program_hash >> std::dec >> loops_key >> loop_count)
+		|| magic != profile_magic
+		|| version != profile_version
+		|| hash_key != "hash"
+		|| loops_key != "loops")
+	{
+		return false;
+	}
+
+	loops.assign(loop_count, {});
+
+	for (auto& loop : loops)
+	{
+		if (!(file >> loop.reached >> loop.entered >> loop.iterations >> loop.min_shift >> loop.max_shift))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+}
@@ -0,0 +1,62 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace bf
+{
+//! Execution statistics of one loop of the source program. Ifs the loop was turned into only get their first two counts.
+struct LoopProfile
+{
+	//! Times the loop condition was checked upon reaching the loop.
+	std::uint64_t reached = 0;
+
+	//! Times the body ran at least once.
+	std::uint64_t entered = 0;
+
+	//! Times the body ran overall.
+	std::uint64_t iterations = 0;
+
+	//! Range of the net tape pointer shift of an iteration.
+	std::int64_t min_shift = std::numeric_limits<std::int64_t>::max();
+	std::int64_t max_shift = std::numeric_limits<std::int64_t>::min();
+
+	bool is_cold() const { return entered * 10 < reached || reached == 0; }
+
+	//! Probability of the body running again when the loop condition is checked, in a `while` loop form.
+	double loop_probability() const { return double(iterations) / double(reached + iterations); }
+
+	//! Probability of the body running at all when the loop is reached.
+	double entry_probability() const { return double(entered) / double(reached); }
+};
+
+//! Profile of a run, as written by `-profile-generate` and read by `-profile-use`.
+//!
+//! Loops are identified by the order of their `[` in the source program, which the compiler stores in the first
+//! argument of `bfLoopBegin` and the linker in the second argument of `bfJmpZero` and `bfJmpNotZero`. Loop IDs that do
+//! not fit an argument are negative and not profiled.
+struct Profile
+{
+	//! Hash of the unoptimized program, so that a profile does not get used for another program.
+	std::uint64_t program_hash = 0;
+
+	std::vector<LoopProfile> loops;
+
+	//! Returns the profile of a loop, or nullptr when the loop was not profiled.
+	const LoopProfile* find(std::int32_t loop_id) const
+	{
+		return (loop_id >= 0 && std::size_t(loop_id) < loops.size()) ? &loops[loop_id] : nullptr;
+	}
+
+	bool save(std::string_view path) const;
+	bool load(std::string_view path);
+};
+
+//! Loop IDs have to fit the signed second argument of an instruction.
+constexpr std::int32_t max_loop_id = std::numeric_limits<std::int32_t>::max();
+}
+
+#endif // PROFILE_HPP
@@ -0,0 +1,55 @@
+#include "run.hpp"
+
+#include "extent.hpp"
+#include "optimizer.hpp"
+#include "stats.hpp"
+
+namespace bf
+{
+std::optional<RunnableProgram> compile_for_run(Brainfuck& bfi, const CompileParams& params)
+{
+	const auto time_phase = [&](std::string_view name, const auto& f) {
+		return (params.stats != nullptr) ? params.stats->time_phase(name, bfi.program, f) : f();
+	};
+
+	if (params.optimizer != nullptr)
+	{
+		params.optimizer->bounds_checked = params.sanitize;
+
+		time_phase("Optimize", [&] {
+			params.optimizer->optimize(bfi.program, bfi.data);
+			return true;
+		});
+	}
+
+	const auto extent = analyze_extent(bfi.program, bfi.data);
+
+	RunnableProgram runnable;
+	runnable.required_memory_size = extent.required_memory_size();
+	runnable.memory_size = params.memory_size;
+
+	if (runnable.memory_size == 0)
+	{
+		runnable.memory_size = (runnable.required_memory_size != 0) ? runnable.required_memory_size : fallback_memory_size;
+	}
+
+	if (params.before_link)
+	{
+		params.before_link(runnable.memory_size);
+	}
+
+	if (params.sanitize)
+	{
+		insert_bounds_checks(bfi.program, extent, params.any_memory_size ? 0 : runnable.memory_size);
+		runnable.tape_padding = size_t(extent.max_scan_step);
+	}
+
+	if (!time_phase("Link", [&] { return bfi.link(); }))
+	{
+		return std::nullopt;
+	}
+
+	runnable.bytecode = Bytecode{bfi.program};
+	return runnable;
+}
+}
@@ -0,0 +1,60 @@
+#ifndef RUN_HPP
+#define RUN_HPP
+
+#include "bf.hpp"
+#include "vm.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+
+namespace bf
+{
+class Optimizer;
+struct PipelineStats;
+
+//! Tape size of programs whose needs cannot be told, the customary one of brainfuck.
+constexpr std::size_t fallback_memory_size = 30000;
+
+struct CompileParams
+{
+	//! Optimizes the program when set, its `bounds_checked` being set to `sanitize`.
+	Optimizer* optimizer = nullptr;
+
+	//! Cells of the tape, 0 for as many as the program needs, or `fallback_memory_size` when that cannot be told.
+	std::size_t memory_size = 0;
+
+	//! Whether accesses are checked against the tape, as with `-sanitize`.
+	bool sanitize = false;
+
+	//! Whether the program may also be run on tapes of other sizes than `memory_size`, so that no check can be left out.
+	bool any_memory_size = false;
+
+	//! Times optimization and linking as phases when set.
+	PipelineStats* stats = nullptr;
+
+	//! Called with the tape size once the program is optimized, before it gets checked and linked, e.g. for the code
+	//! generators that take the unlinked program.
+	std::function<void(std::size_t memory_size)> before_link = nullptr;
+};
+
+//! Bytecode of a program compiled for `interpret`, along with what running it needs.
+struct RunnableProgram
+{
+	Bytecode bytecode;
+
+	//! Cells the program needs, or 0 when that cannot be told.
+	std::size_t required_memory_size = 0;
+
+	//! Cells to run the program with, as picked from `CompileParams::memory_size`.
+	std::size_t memory_size = 0;
+
+	std::size_t tape_padding = 0;
+};
+
+//! Optimizes, bounds checks and links the parsed `bfi` in place, its data segment being the one to run it with.
+//! Returns nothing when it fails to link.
+std::optional<RunnableProgram> compile_for_run(Brainfuck& bfi, const CompileParams& params);
+}
+
+#endif // RUN_HPP
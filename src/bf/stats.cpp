@@ -0,0 +1,180 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fmt/core.h>
+
+namespace bf
+{
+namespace
+{
+double to_ms(std::chrono::nanoseconds time)
+{
+	return std::chrono::duration<double, std::milli>(time).count();
+}
+
+std::string json_escape(std::string_view str)
+{
+	std::string escaped;
+	for (const char c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+		}
+
+		escaped += c;
+	}
+	return escaped;
+}
+}
+
+void PipelineStats::count_rewrite(std::string_view pattern, size_t count)
+{
+	auto it = rewrites.find(pattern);
+	if (it == rewrites.end())
+	{
+		it = rewrites.emplace(std::string{pattern}, 0).first;
+	}
+
+	it->second += count;
+}
+
+void PipelineStats::sample_ir_bytes(size_t bytes)
+{
+	peak_ir_bytes = std::max(peak_ir_bytes, bytes);
+}
+
+void PipelineStats::merge(const PipelineStats& other)
+{
+	if (phases.empty())
+	{
+		phases = other.phases;
+	}
+	else
+	{
+		for (size_t i = 0; i < std::min(phases.size(), other.phases.size()); ++i)
+		{
+			phases[i].time += other.phases[i].time;
+			phases[i].ops_before += other.phases[i].ops_before;
+			phases[i].ops_after += other.phases[i].ops_after;
+			phases[i].runs += other.phases[i].runs;
+			phases[i].effective_runs += other.phases[i].effective_runs;
+		}
+	}
+
+	for (const auto& [pattern, count] : other.rewrites)
+	{
+		count_rewrite(pattern, count);
+	}
+
+	// Regions are held in memory at the same time.
+	peak_ir_bytes += other.peak_ir_bytes;
+}
+
+void PipelineStats::append(const PipelineStats& other)
+{
+	phases.insert(phases.end(), other.phases.begin(), other.phases.end());
+
+	for (const auto& [pattern, count] : other.rewrites)
+	{
+		count_rewrite(pattern, count);
+	}
+
+	sample_ir_bytes(other.peak_ir_bytes);
+}
+
+void PipelineStats::print_table(std::FILE* file) const
+{
+	fmt::print(file, "{:<64} {:>12} {:>10} {:>10} {:>12} {:>12}\n", "Phase", "Time (ms)", "Runs", "Effective", "Ops before", "Ops after");
+
+	for (const auto& phase : phases)
+	{
+		const std::string name = std::string(phase.depth * 2, ' ') + phase.name;
+
+		if (phase.runs != 0)
+		{
+			fmt::print(file, "{:<64} {:>12} {:>10} {:>10} {:>12} {:>12}\n", name, format_fixed(to_ms(phase.time), 3), phase.runs, phase.effective_runs, phase.ops_before, phase.ops_after);
+		}
+		else
+		{
+			fmt::print(file, "{:<64} {:>12} {:>10} {:>10} {:>12} {:>12}\n", name, format_fixed(to_ms(phase.time), 3), "", "", phase.ops_before, phase.ops_after);
+		}
+	}
+
+	if (!rewrites.empty())
+	{
+		fmt::print(file, "\n{:<64} {:>12}\n", "Pattern", "Rewrites");
+
+		for (const auto& [pattern, count] : rewrites)
+		{
+			fmt::print(file, "{:<64} {:>12}\n", pattern, count);
+		}
+	}
+
+	fmt::print(file, "\nPeak IR memory: {} bytes\n", peak_ir_bytes);
+}
+
+void PipelineStats::print_json(std::FILE* file) const
+{
+	fmt::print(file, "{{\n\t\"phases\": [");
+
+	for (size_t i = 0; i < phases.size(); ++i)
+	{
+		const auto& phase = phases[i];
+		fmt::print(
+			file,
+			"{}\n\t\t{{\"name\": \"{}\", \"depth\": {}, \"time_ms\": {}, \"runs\": {}, \"effective_runs\": {}, \"ops_before\": {}, \"ops_after\": {}}}",
+			i != 0 ? "," : "",
+			json_escape(phase.name),
+			phase.depth,
+			json_fixed(to_ms(phase.time), 3),
+			phase.runs,
+			phase.effective_runs,
+			phase.ops_before,
+			phase.ops_after
+		);
+	}
+
+	fmt::print(file, "\n\t],\n\t\"rewrites\": {{");
+
+	bool first = true;
+	for (const auto& [pattern, count] : rewrites)
+	{
+		fmt::print(file, "{}\n\t\t\"{}\": {}", first ? "" : ",", json_escape(pattern), count);
+		first = false;
+	}
+
+	fmt::print(file, "\n\t}},\n\t\"peak_ir_bytes\": {}\n}}\n", peak_ir_bytes);
+}
+
+std::string format_fixed(double value, int decimals)
+{
+	if (!std::isfinite(value))
+	{
+		return std::isnan(value) ? "nan" : (value < 0 ? "-inf" : "inf");
+	}
+
+	std::uint64_t scale = 1;
+	for (int i = 0; i < decimals; ++i)
+	{
+		scale *= 10;
+	}
+
+	const auto scaled = std::uint64_t(std::llround(std::abs(value) * double(scale)));
+	const std::string_view sign = (value < 0 && scaled != 0) ? "-" : "";
+
+	if (decimals == 0)
+	{
+		return fmt::format("{}{}", sign, scaled);
+	}
+
+	return fmt::format("{}{}.{:0{}}", sign, scaled / scale, scaled % scale, decimals);
+}
+
+std::string json_fixed(double value, int decimals)
+{
+	return std::isfinite(value) ? format_fixed(value, decimals) : "null";
+}
+}
@@ -0,0 +1,84 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "bf.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bf
+{
+struct PhaseStats
+{
+	std::string name;
+
+	//! Nesting level, e.g. optimization tasks are nested within their stage.
+	unsigned depth = 0;
+
+	std::chrono::nanoseconds time{};
+
+	//! Instruction count before and after the phase. For optimization tasks, these are summed over the regions they ran
+	//! over, so their difference is the count of instructions the task removed.
+	size_t ops_before = 0, ops_after = 0;
+
+	//! Only meaningful for optimization tasks.
+	size_t runs = 0, effective_runs = 0;
+};
+
+//! Timings and statistics of the compilation pipeline, as reported by `-time-passes`.
+struct PipelineStats
+{
+	std::vector<PhaseStats> phases;
+
+	//! Rewrites performed per optimization pattern.
+	std::map<std::string, size_t, std::less<>> rewrites;
+
+	//! Largest memory held by the IR at once, as sampled when phases end and whenever the optimizer moves to a new region.
+	size_t peak_ir_bytes = 0;
+
+	//! Runs `f`, which returns whether it succeeded, as a phase named `name` operating over `program`.
+	template<class F>
+	bool time_phase(std::string_view name, const Program& program, F&& f, unsigned depth = 0)
+	{
+		// Phases nested within `f` get recorded after this one, so refer to it by index.
+		const size_t index = phases.size();
+		phases.push_back({.name = std::string{name}, .depth = depth, .ops_before = program.size()});
+
+		const auto begin = std::chrono::steady_clock::now();
+		const bool result = f();
+
+		phases[index].time = std::chrono::steady_clock::now() - begin;
+		phases[index].ops_after = program.size();
+		sample_ir(program);
+
+		return result;
+	}
+
+	void count_rewrite(std::string_view pattern, size_t count = 1);
+
+	void sample_ir(const Program& program) { sample_ir_bytes(program.capacity() * sizeof(VMOp)); }
+	void sample_ir_bytes(size_t bytes);
+
+	//! Adds up statistics of a run over another region, which must have gone through the same phases.
+	void merge(const PipelineStats& other);
+
+	//! Adds the phases of `other` after those recorded so far.
+	void append(const PipelineStats& other);
+
+	void print_table(std::FILE* file) const;
+	void print_json(std::FILE* file) const;
+};
+
+//! Formats `value` with `decimals` digits after the point. The build disables floating-point support in fmt, which
+//! formats floating-point values as nothing.
+std::string format_fixed(double value, int decimals);
+
+//! `format_fixed` for JSON output, which has no representation for NaN and infinities: those are written as `null`.
+std::string json_fixed(double value, int decimals);
+}
+
+#endif // STATS_HPP
@@ -0,0 +1,145 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+
+namespace bf
+{
+std::size_t ThreadPool::default_thread_count()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+ThreadPool::ThreadPool(std::size_t thread_count)
+{
+	if (thread_count == 0)
+	{
+		thread_count = default_thread_count();
+	}
+
+	workers.reserve(thread_count);
+	for (std::size_t i = 0; i < thread_count; ++i)
+	{
+		workers.push_back(std::make_unique<Worker>());
+	}
+
+	// Only spawn once every deque exists, as workers steal from each other right away.
+	for (std::size_t i = 0; i < thread_count; ++i)
+	{
+		workers[i]->thread = std::thread{[this, i] { worker_main(i); }};
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	wait();
+
+	{
+		std::lock_guard lock{sleep_mutex};
+		stopping = true;
+	}
+	wake_workers.notify_all();
+
+	for (auto& worker : workers)
+	{
+		worker->thread.join();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	auto& worker = *workers[next_worker++ % workers.size()];
+
+	pending += 1;
+
+	// Count the task as queued before it becomes visible so that `queued` never underflows when it gets picked up early.
+	{
+		std::lock_guard lock{sleep_mutex};
+		queued += 1;
+	}
+
+	{
+		std::lock_guard lock{worker.mutex};
+		worker.tasks.push_back(std::move(task));
+	}
+
+	wake_workers.notify_one();
+}
+
+bool ThreadPool::try_run_one(std::size_t preferred_worker)
+{
+	std::function<void()> task;
+
+	for (std::size_t i = 0; i < workers.size() && !task; ++i)
+	{
+		const bool own = (i == 0);
+		auto& worker = *workers[(preferred_worker + i) % workers.size()];
+
+		std::lock_guard lock{worker.mutex};
+		if (worker.tasks.empty())
+		{
+			continue;
+		}
+
+		// Run our own newest task first for locality, steal the oldest task of others.
+		if (own)
+		{
+			task = std::move(worker.tasks.back());
+			worker.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(worker.tasks.front());
+			worker.tasks.pop_front();
+		}
+	}
+
+	if (!task)
+	{
+		return false;
+	}
+
+	queued -= 1;
+	task();
+
+	if (--pending == 0)
+	{
+		std::lock_guard lock{sleep_mutex};
+		wake_waiters.notify_all();
+	}
+
+	return true;
+}
+
+void ThreadPool::worker_main(std::size_t index)
+{
+	for (;;)
+	{
+		if (try_run_one(index))
+		{
+			continue;
+		}
+
+		std::unique_lock lock{sleep_mutex};
+		wake_workers.wait(lock, [&] { return stopping || queued != 0; });
+
+		if (stopping && queued == 0)
+		{
+			return;
+		}
+	}
+}
+
+void ThreadPool::wait()
+{
+	while (pending != 0)
+	{
+		if (try_run_one(next_worker % workers.size()))
+		{
+			continue;
+		}
+
+		std::unique_lock lock{sleep_mutex};
+		wake_waiters.wait(lock, [&] { return pending == 0 || queued != 0; });
+	}
+}
+}
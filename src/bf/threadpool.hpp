@@ -0,0 +1,72 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bf
+{
+//! Fixed-size work-stealing thread pool.
+//!
+//! Every worker owns a task deque. A worker pops its own tasks from the back and, when it runs dry, steals from the front
+//! of the other workers' deques. Threads calling wait() also help running pending tasks rather than blocking idly.
+class ThreadPool
+{
+public:
+	//! When `thread_count` is 0, one worker per hardware thread is spawned.
+	explicit ThreadPool(std::size_t thread_count = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void submit(std::function<void()> task);
+
+	//! Blocks until every submitted task has completed.
+	void wait();
+
+	std::size_t size() const { return workers.size(); }
+
+	//! Runs `f(i)` for every `i` in [0, n) and waits for completion.
+	template<class F>
+	void parallel_for(std::size_t n, F&& f)
+	{
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			submit([&f, i] { f(i); });
+		}
+
+		wait();
+	}
+
+	static std::size_t default_thread_count();
+
+private:
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+		std::thread thread;
+	};
+
+	bool try_run_one(std::size_t preferred_worker);
+	void worker_main(std::size_t index);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	std::mutex sleep_mutex;
+	std::condition_variable wake_workers, wake_waiters;
+
+	std::atomic<std::size_t> queued{0}, pending{0}, next_worker{0};
+	bool stopping = false;
+};
+}
+
+#endif // THREADPOOL_HPP
@@ -1,70 +1,266 @@
 #include "vm.hpp"
 
+#include "bf.hpp"
+#include "profile.hpp"
+
+#include <array>
+#include <cstring>
 #include <istream>
 #include <ostream>
 #include <memory>
+#include <optional>
 #include <span>
+#include <type_traits>
 
 namespace bf
 {
 
-//! This class allows for easier experimenting of instruction decoding.
-//! This mostly allows you to easily play around with when instructions are decoded.
-//!
-//! If you change the opcode/a/b methods to use `m_cached_opcode/a/b`, then these will
-//! all be determined during instruction fetching at the end of an handler.
+//! Instruction as read by the fast instantiations of the interpreter, which only handle the narrow form of bytecode.
 //!
-//! Don't worry about leaving `m_cached_*` unused, the compiler will optimize it away.
+//! Arguments are decoded by the handlers that need them, according to how many the instruction takes: `arg()` for a
+//! sole argument, `a()` and `b()` for a pair.
 //!
-//! This can simplify decoding, but means a/b are unconditionally decoded even when the
-//! incoming handler does not require them (which we cannot know in advance).
+//! `ashbf-microbench` measures the effect of decoding changes on every handler: decoding every argument as the
+//! instruction gets fetched, rather than in the handlers, makes most of them about twice as slow.
 class VMDecompressedOp
 {
     public:
     VMDecompressedOp() = default;
 
-    VMDecompressedOp(VMCompactOp compact_op):
-        m_op(compact_op),
-        m_cached_opcode(compact_op.opcode()),
-        m_cached_a(compact_op.a()),
-        m_cached_b(compact_op.b())
-    {}
-
     VMDecompressedOp(const VMDecompressedOp&) = default;
     VMDecompressedOp& operator=(const VMDecompressedOp&) = default;
 
-    auto opcode() const { return m_op.opcode(); }
-    auto a() const { return m_op.a(); }
-    auto b() const { return m_op.b(); }
+    static VMDecompressedOp fetch(const std::uint32_t*& ip)
+    {
+        VMDecompressedOp op;
+        op.m_word = *ip;
+        return op;
+    }
+
+    auto opcode() const { return Opcode(m_word & 0xFF); }
+    auto arg() const { return std::int32_t(m_word) >> 8; }
+    auto a() const { return std::int32_t(m_word << 12) >> 20; }
+    auto b() const { return std::int32_t(m_word) >> 20; }
+
+    bool is_wide() const { return false; }
 
     private:
-    VMCompactOp m_op;
+    std::uint32_t m_word;
+};
+
+//! Instruction as read by the checked instantiations of the interpreter, which also handle the wide form.
+class VMWideOp
+{
+    public:
+    VMWideOp() = default;
 
-    std::uint8_t m_cached_opcode;
-    std::int32_t m_cached_a;
-    std::int32_t m_cached_b;
+    VMWideOp(const VMWideOp&) = default;
+    VMWideOp& operator=(const VMWideOp&) = default;
+
+    //! Leaves `ip` on the last word of the instruction.
+    static VMWideOp fetch(const std::uint32_t*& ip)
+    {
+        VMWideOp op;
+        const auto narrow = VMDecompressedOp::fetch(ip);
+
+        if (narrow.opcode() == bfWideEscape)
+        {
+            op.m_opcode = Opcode(ip[0] >> 8);
+            op.m_a = std::int32_t(ip[1]);
+            op.m_b = std::int32_t(ip[2]);
+            op.m_wide = true;
+            ip += 2;
+        }
+        else if (instructions[narrow.opcode()].arguments_used < 2)
+        {
+            op.m_opcode = narrow.opcode();
+            op.m_a = narrow.arg();
+        }
+        else
+        {
+            op.m_opcode = narrow.opcode();
+            op.m_a = narrow.a();
+            op.m_b = narrow.b();
+        }
+
+        return op;
+    }
+
+    auto opcode() const { return m_opcode; }
+    auto arg() const { return m_a; }
+    auto a() const { return m_a; }
+    auto b() const { return m_b; }
+
+    bool is_wide() const { return m_wide; }
+
+    private:
+    Opcode m_opcode = bfEnd;
+    std::int32_t m_a = 0;
+    std::int32_t m_b = 0;
+    bool m_wide = false;
 };
 
-void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
+namespace
+{
+bool is_jump(const VMOp& op) { return op.opcode == bfJmpZero || op.opcode == bfJmpNotZero; }
+
+//! First argument of a specialized opcode, as a constant for its handler to be compiled with.
+template<Opcode Variant>
+	requires(instructions[Variant].specializes != bfNop)
+constexpr std::integral_constant<std::int32_t, instructions[Variant].fixed_arg> fixed_arg{};
+
+//! Adds `block` to `cells` a vector at a time. Vector extensions lower to SIMD instructions on targets that have some.
+void add_block(std::uint8_t* cells, std::span<const std::uint8_t> block)
 {
-	const auto tape = std::make_unique<std::uint8_t[]>(params.memory_size);
+	using Vector = std::uint8_t __attribute__((vector_size(16)));
 
-	// We use pointers as opposed to indices here because it optimizes marginally better.
-	std::uint8_t* sp = tape.get();
-    const VMCompactOp* ip = compact_program.data();
+	size_t i = 0;
 
-    VMDecompressedOp op;
+	for (; i + sizeof(Vector) <= block.size(); i += sizeof(Vector))
+	{
+		Vector sum, addend;
+		std::memcpy(&sum, cells + i, sizeof(Vector));
+		std::memcpy(&addend, block.data() + i, sizeof(Vector));
+		sum += addend;
+		std::memcpy(cells + i, &sum, sizeof(Vector));
+	}
+
+	for (; i < block.size(); ++i)
+	{
+		cells[i] += block[i];
+	}
+}
+
+//! Execution state, carried over when switching between instantiations of the interpreter.
+struct VmState
+{
+	explicit VmState(const VmParams& params, const Bytecode& program) :
+		memory(std::make_unique<std::uint8_t[]>(params.memory_size + 2 * params.tape_padding)),
+		tape(memory.get() + params.tape_padding),
+		sp(tape),
+		ip(program.words.data()),
+		loop_tops(params.profile != nullptr ? params.profile->loops.size() : 0)
+	{}
+
+	std::unique_ptr<std::uint8_t[]> memory;
+	std::uint8_t* tape;
+	std::uint8_t* sp;
+	const std::uint32_t* ip;
+
+	size_t steps = 0;
+
+	//! Tape pointer as of the beginning of the current iteration of every loop, to measure its net shift.
+	std::vector<std::uint8_t*> loop_tops;
+
+	//! Set when a `checkrange` failed, until one holds again.
+	bool checking_every_access = false;
+};
+
+//! With `Checked`, every dispatched instruction counts towards `params.step_limit` and every memory access gets bounds
+//! checked when `params.check_bounds` is set or a `checkrange` failed. With `Profiled`, loop statistics are gathered into
+//! `params.profile`. With `Counted`, work is counted into `params.counters`. Otherwise, none of it is compiled in.
+//!
+//! Returns nothing when execution is to carry on with another instantiation, according to `state.checking_every_access`.
+//!
+//! Kept out of line: when GCC inlines an instantiation into `interpret`, the tape and instruction pointers end up on the
+//! stack, which makes most handlers about half as fast.
+template<bool Checked, bool Profiled, bool Counted>
+[[gnu::noinline]] std::optional<VmStatus> interpret_impl(const VmParams& params, const Bytecode& program, VmState& state)
+{
+	// Working on locals rather than on `state` lets them live in registers, as cell writes may alias anything.
+	std::uint8_t* const tape = state.tape;
+	std::uint8_t* sp = state.sp;
+	const std::uint32_t* ip = state.ip;
+
+	std::conditional_t<Checked, VMWideOp, VMDecompressedOp> op;
+
+	size_t steps = state.steps;
+	auto& loop_tops = state.loop_tops;
+
+	VmCounters counters;
+
+	const bool check_bounds = params.check_bounds || state.checking_every_access;
+
+	const auto leave = [&](std::optional<VmStatus> status) {
+		state.sp = sp;
+		state.ip = ip;
+		state.steps = steps;
+
+		if constexpr (Counted)
+		{
+			params.counters->dispatches += counters.dispatches;
+			params.counters->back_edges += counters.back_edges;
+			params.counters->bytes_output += counters.bytes_output;
+		}
+
+		return status;
+	};
+
+	// Loop ID of the jump being run. Only profiling needs it, which spares the other instantiations the lookup.
+	const auto jump_loop_id = [&]() -> std::int32_t {
+		if constexpr (Profiled)
+		{
+			return program.loop_ids[size_t(ip - program.words.data())];
+		}
+
+		return -1;
+	};
+
+	const auto profiled_loop = [&](std::int32_t loop_id) -> LoopProfile* {
+		if constexpr (Profiled)
+		{
+			if (loop_id >= 0 && size_t(loop_id) < loop_tops.size())
+			{
+				return &params.profile->loops[loop_id];
+			}
+		}
+
+		return nullptr;
+	};
+
+	const auto end_iteration = [&](LoopProfile& loop, std::int32_t loop_id) {
+		const std::int64_t shift = sp - loop_tops[loop_id];
+		loop.min_shift = std::min(loop.min_shift, shift);
+		loop.max_shift = std::max(loop.max_shift, shift);
+		loop_tops[loop_id] = sp;
+	};
 
 	const auto tape_get = [&](int offset = 0) {
 		return &sp[offset];
 	};
 
+	// Pointer arithmetic past the tape is technically UB, but so is the access we are preventing.
+	const auto outside_tape = [&](int offset) {
+		return sp + offset < tape || sp + offset >= tape + params.memory_size;
+	};
+
+	const auto out_of_bounds = [&](int offset = 0) {
+		return Checked && check_bounds && outside_tape(offset);
+	};
+
+	const auto out_of_steps = [&] {
+		return Checked && params.step_limit != 0 && ++steps > params.step_limit;
+	};
+
 	const auto tape_shift = [&](int offset) {
 		sp += offset;
 	};
 
+	// Handlers shared with specialized opcodes, which pass their first argument as a `fixed_arg` constant.
+	const auto add = [&](auto value) {
+		*tape_get() += value;
+	};
+
+	const auto set = [&](auto value) {
+		*tape_get() = value;
+	};
+
+	const auto mac = [&](auto factor, int offset) {
+		*tape_get() += factor * *tape_get(offset);
+	};
+
 	const auto fetch = [&] {
-		op = *ip;
+		op = decltype(op)::fetch(ip);
 	};
 
 	const auto inc_fetch = [&] {
@@ -85,24 +281,87 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 		//
 		// This is essentially the same as precomputed gotos, but we're actually relying on
 		// the compiler not to be an idiot, which only clang manages.
+		if constexpr (Checked)
+		{
+			// Entered for a wide instruction alone, go back to the fast instantiation once done with it.
+			if (!check_bounds && params.step_limit == 0 && !op.is_wide())
+			{
+				return leave(std::nullopt);
+			}
+		}
+
+		if constexpr (Counted)
+		{
+			++counters.dispatches;
+		}
+
+		if constexpr (Checked)
+		{
+			if (out_of_steps())
+			{
+				return leave(VmStatus::step_limit_reached);
+			}
+
+			// Every instruction but shifts, `writeconst`, blocks and `end` accesses the current cell. Blocks check their range.
+			const bool accesses_cell = op.opcode() != Opcode::bfShift
+				&& op.opcode() != Opcode::bfShiftRight
+				&& op.opcode() != Opcode::bfShiftLeft
+				&& op.opcode() != Opcode::bfWriteConst
+				&& op.opcode() != Opcode::bfSetBlock
+				&& op.opcode() != Opcode::bfAddBlock
+				&& op.opcode() != Opcode::bfCheckRange
+				&& op.opcode() != Opcode::bfEnd;
+
+			if (accesses_cell && out_of_bounds())
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+		}
+
 		switch (op.opcode())
 		{
 		case Opcode::bfAdd:
 		{
-			*tape_get() += op.a();
+			add(op.arg());
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfIncrement:
+		{
+			add(fixed_arg<bfIncrement>);
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfDecrement:
+		{
+			add(fixed_arg<bfDecrement>);
 			inc_fetch();
 			break;
 		}
 
 		case Opcode::bfSet:
 		{
-			*tape_get() = op.a();
+			set(op.arg());
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfClear:
+		{
+			set(fixed_arg<bfClear>);
 			inc_fetch();
 			break;
 		}
 
 		case Opcode::bfAddOffset:
 		{
+			if (out_of_bounds(op.b()))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
 			*tape_get(op.b()) += op.a();
 			inc_fetch();
 			break;
@@ -110,6 +369,11 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 
 		case Opcode::bfSetOffset:
 		{
+			if (out_of_bounds(op.b()))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
 			*tape_get(op.b()) = op.a();
 			inc_fetch();
 			break;
@@ -117,14 +381,57 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 
 		case Opcode::bfShift:
 		{
-			tape_shift(op.a());
+			tape_shift(op.arg());
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfShiftRight:
+		{
+			tape_shift(fixed_arg<bfShiftRight>);
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfShiftLeft:
+		{
+			tape_shift(fixed_arg<bfShiftLeft>);
 			inc_fetch();
 			break;
 		}
 
 		case Opcode::bfMAC:
 		{
-			*tape_get() += op.a() * *tape_get(op.b());
+			if (out_of_bounds(op.b()))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
+			mac(op.a(), op.b());
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfMACAdd:
+		{
+			if (out_of_bounds(op.b()))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
+			mac(fixed_arg<bfMACAdd>, op.b());
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfMACSubtract:
+		{
+			if (out_of_bounds(op.b()))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
+			mac(fixed_arg<bfMACSubtract>, op.b());
 			inc_fetch();
 			break;
 		}
@@ -133,7 +440,17 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 		{
 			while (*tape_get() != 0)
 			{
-				sp += op.a();
+				sp += op.arg();
+
+				if (out_of_steps())
+				{
+					return leave(VmStatus::step_limit_reached);
+				}
+
+				if (out_of_bounds())
+				{
+					return leave(VmStatus::out_of_bounds);
+				}
 			}
 			inc_fetch();
 			break;
@@ -141,9 +458,23 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 
 		case Opcode::bfJmpZero:
 		{
+			const std::int32_t loop_id = jump_loop_id();
+
+			if (LoopProfile* loop = profiled_loop(loop_id))
+			{
+				++loop->reached;
+
+				if (*tape_get() != 0)
+				{
+					++loop->entered;
+					++loop->iterations;
+					loop_tops[loop_id] = sp;
+				}
+			}
+
 			if (*tape_get() == 0)
 			{
-				ip = compact_program.data() + op.a();
+				ip += op.arg();
 				fetch();
 			}
 			else
@@ -155,9 +486,22 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 
 		case Opcode::bfJmpNotZero:
 		{
+			const std::int32_t loop_id = jump_loop_id();
+
+			if (LoopProfile* loop = profiled_loop(loop_id))
+			{
+				end_iteration(*loop, loop_id);
+				loop->iterations += (*tape_get() != 0);
+			}
+
 			if (*tape_get() != 0) [[likely]]
 			{
-				ip = compact_program.data() + op.a();
+				if constexpr (Counted)
+				{
+					++counters.back_edges;
+				}
+
+				ip += op.arg();
 				fetch();
 			}
 			else
@@ -170,7 +514,21 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
         [[unlikely]]
 		case Opcode::bfCharOut:
 		{
-			params.out_stream->put(*tape_get());
+			for (std::int32_t i = 0; i < op.arg(); ++i)
+			{
+				params.out_stream->put(*tape_get());
+			}
+
+			if constexpr (Counted)
+			{
+				counters.bytes_output += op.arg();
+			}
+
+			if (params.out_stream->bad())
+			{
+				return leave(VmStatus::output_failed);
+			}
+
 			inc_fetch();
 			break;
 		}
@@ -183,10 +541,90 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 			break;
 		}
 
+        [[unlikely]]
+		case Opcode::bfWriteConst:
+		{
+			params.out_stream->write(reinterpret_cast<const char*>(params.data.data() + op.a()), op.b());
+
+			if constexpr (Counted)
+			{
+				counters.bytes_output += op.b();
+			}
+
+			if (params.out_stream->bad())
+			{
+				return leave(VmStatus::output_failed);
+			}
+
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfSetBlock:
+		{
+			const auto block = get_block(params.data, op.a());
+
+			if (out_of_bounds(op.b()) || out_of_bounds(op.b() + int(block.size()) - 1))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
+			std::memcpy(tape_get(op.b()), block.data(), block.size());
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfAddBlock:
+		{
+			const auto block = get_block(params.data, op.a());
+
+			if (out_of_bounds(op.b()) || out_of_bounds(op.b() + int(block.size()) - 1))
+			{
+				return leave(VmStatus::out_of_bounds);
+			}
+
+			add_block(tape_get(op.b()), block);
+			inc_fetch();
+			break;
+		}
+
+		case Opcode::bfCheckRange:
+		{
+			const bool in_bounds = !outside_tape(op.a()) && !outside_tape(op.b());
+
+			if (!in_bounds && !check_bounds)
+			{
+				state.checking_every_access = true;
+				return leave(std::nullopt);
+			}
+
+			inc_fetch();
+
+			if (in_bounds && state.checking_every_access)
+			{
+				state.checking_every_access = false;
+				return leave(std::nullopt);
+			}
+
+			break;
+		}
+
         [[unlikely]]
 		case Opcode::bfEnd:
 		{
-			return;
+			return leave(VmStatus::ok);
+		}
+
+        [[unlikely]]
+		case bfWideEscape:
+		{
+			// Only reached by the fast instantiations, which hand over to a checked one for the wide instruction.
+			if constexpr (Counted)
+			{
+				--counters.dispatches;
+			}
+
+			return leave(std::nullopt);
 		}
 
 		default:
@@ -198,4 +636,120 @@ void interpret(VmParams params, std::span<const VMCompactOp> compact_program)
 		}
 	}
 }
-}
\ No newline at end of file
+
+template<bool Checked, bool Profiled>
+std::optional<VmStatus> interpret_counted(const VmParams& params, const Bytecode& program, VmState& state)
+{
+	return params.counters != nullptr
+		? interpret_impl<Checked, Profiled, true>(params, program, state)
+		: interpret_impl<Checked, Profiled, false>(params, program, state);
+}
+}
+
+Bytecode::Bytecode(std::span<const VMOp> program)
+{
+	const auto is_pair = [](const VMOp& op) { return instructions[op.opcode].arguments_used >= 2; };
+
+	const auto fits = [&](const VMOp& op, const std::array<VMArg, 2>& args) {
+		return is_pair(op)
+			? (args[0] >= pair_min && args[0] <= pair_max && args[1] >= pair_min && args[1] <= pair_max)
+			: (args[0] >= sole_min && args[0] <= sole_max);
+	};
+
+	// Jump offsets depend on which instructions are wide, which depends on jump offsets. Every instruction starts narrow
+	// and those that do not fit get widened until all do, which ends as widening instructions only lengthens offsets.
+	std::vector<bool> wide(program.size(), false);
+	std::vector<size_t> begins(program.size() + 1, 0);
+
+	const auto last_word = [&](size_t i) { return begins[i] + (wide[i] ? 2 : 0); };
+
+	const auto arguments = [&](size_t i) -> std::array<VMArg, 2> {
+		const VMOp& op = program[i];
+		return is_jump(op) ? std::array{VMArg(begins[op.args[0]]) - VMArg(last_word(i)), VMArg(0)} : op.args;
+	};
+
+	for (bool widened = true; widened;)
+	{
+		widened = false;
+
+		for (size_t i = 0; i < program.size(); ++i)
+		{
+			begins[i + 1] = begins[i] + (wide[i] ? 3 : 1);
+		}
+
+		for (size_t i = 0; i < program.size(); ++i)
+		{
+			if (!wide[i] && !fits(program[i], arguments(i)))
+			{
+				wide[i] = true;
+				widened = true;
+			}
+		}
+	}
+
+	words.reserve(begins.back());
+	loop_ids.assign(begins.back(), -1);
+
+	for (size_t i = 0; i < program.size(); ++i)
+	{
+		const auto args = arguments(i);
+		const auto opcode = std::uint32_t(specialize(program[i].opcode, args[0]));
+
+		if (wide[i])
+		{
+			words.push_back(bfWideEscape | (opcode << 8));
+			words.push_back(std::uint32_t(args[0]));
+			words.push_back(std::uint32_t(args[1]));
+		}
+		else if (is_pair(program[i]))
+		{
+			words.push_back(opcode | ((std::uint32_t(args[0]) & 0xFFF) << 8) | (std::uint32_t(args[1]) << 20));
+		}
+		else
+		{
+			words.push_back(opcode | (std::uint32_t(args[0]) << 8));
+		}
+
+		if (is_jump(program[i]))
+		{
+			loop_ids[last_word(i)] = program[i].args[1];
+		}
+	}
+}
+
+VmStatus interpret(VmParams params, const Bytecode& program)
+{
+	VmState state{params, program};
+
+	for (;;)
+	{
+		// Wide instructions are only handled by the checked instantiations.
+		const bool checked = params.step_limit != 0 || params.check_bounds || state.checking_every_access
+			|| Opcode(*state.ip & 0xFF) == bfWideEscape;
+		std::optional<VmStatus> status;
+
+		if (params.profile != nullptr)
+		{
+			status = checked
+				? interpret_counted<true, true>(params, program, state)
+				: interpret_counted<false, true>(params, program, state);
+		}
+		else
+		{
+			status = checked
+				? interpret_counted<true, false>(params, program, state)
+				: interpret_counted<false, false>(params, program, state);
+		}
+
+		if (status)
+		{
+			if (params.final_tape != nullptr)
+			{
+				params.final_tape->assign(state.tape, state.tape + params.memory_size);
+			}
+
+			return *status;
+		}
+	}
+}
+}
@@ -6,9 +6,12 @@
 #include <istream>
 #include <ostream>
 #include <span>
+#include <vector>
 
 namespace bf
 {
+struct Profile;
+
 using VMArg = std::int32_t;
 
 struct VMOp
@@ -21,6 +24,9 @@ struct VMOp
 
 	Opcode opcode = bfNop;
 
+	//! Set by optimization tasks on the instructions they rewrote, so that only changed regions get revisited.
+	bool dirty = false;
+
 	std::array<VMArg, 2> args{};
 
 	VMOp() = default;
@@ -68,30 +74,37 @@ struct VMOp
 	}
 };
 
-struct VMCompactOp
+//! Program encoded for the interpreter, in 32-bit words.
+//!
+//! Most instructions take a single word, with the opcode in the low byte. The other 24 bits hold the argument of
+//! instructions that take one, or both 12-bit arguments of those that take two. Instructions with an argument out of
+//! that range are escaped into three words: `bfWideEscape` with the opcode in the second byte, then both arguments
+//! whole. Jumps hold the offset of their target from their last word rather than its index.
+struct Bytecode
 {
-	VMCompactOp() = default;
+	static constexpr VMArg sole_min = -0x800000, sole_max = 0x7FFFFF;
+	static constexpr VMArg pair_min = -0x800, pair_max = 0x7FF;
 
-	VMCompactOp(const VMCompactOp&) = default;
-	VMCompactOp& operator=(const VMCompactOp&) = default;
+	Bytecode() = default;
 
-	VMCompactOp(VMOp op) :
-		_op(
-			(std::uint64_t(op.opcode))
-			| (((std::uint64_t(op.args[1]) & 0xFFFFFF) << 40))
-			| ((std::uint64_t(op.args[0]) & 0xFFFFFFFF) << 8)
-		)
-	{
-		// if (opcode() != op.opcode) { printf("op: %d vs %d\n", int(opcode()), int(op.opcode)); }
-		// if (a() != op.args[0]) { printf("a: %d vs %d\n", int(a()), int(op.args[0])); }
-		// if (b() != op.args[1]) { printf("b: %d vs %d\n", int(b()), int(op.args[1])); }
-	}
+	//! Encodes a linked program.
+	explicit Bytecode(std::span<const VMOp> program);
+
+	std::vector<std::uint32_t> words;
 
-	std::uint64_t _op;
+	//! Loop ID of the jump ending at every word, only used for profiling. -1 for other words.
+	std::vector<std::int32_t> loop_ids;
+};
+
+//! Work done by the interpreter, as gathered when `VmParams::counters` is set.
+struct VmCounters
+{
+	std::uint64_t dispatches = 0;
 
-	Opcode opcode() const { return Opcode(_op & 0xFF); }
-	std::int32_t a() const { return std::int32_t(_op >> 8); }
-	std::int32_t b() const { return std::int64_t(_op) >> 40; }
+	//! Taken `jnz`, i.e. loop iterations past the first.
+	std::uint64_t back_edges = 0;
+
+	std::uint64_t bytes_output = 0;
 };
 
 struct VmParams
@@ -99,9 +112,46 @@ struct VmParams
 	size_t memory_size;
 	std::istream* in_stream;
 	std::ostream* out_stream;
+
+	//! Data segment of the program.
+	std::span<const std::uint8_t> data = {};
+
+	//! When nonzero, execution stops after that many instructions were dispatched.
+	size_t step_limit = 0;
+
+	//! Stop execution rather than access memory outside of the tape.
+	bool check_bounds = false;
+
+	//! Zeroed cells allocated on both sides of the tape. With bounds checked by `checkrange`, a `suz` moving by at most
+	//! that much stops there rather than scanning past the allocation, and the following check catches it.
+	size_t tape_padding = 0;
+
+	//! When set, loop statistics get accumulated there. Its loops must be sized for every loop ID of the program.
+	Profile* profile = nullptr;
+
+	//! When set, receives the cells of the tape as execution left them.
+	std::vector<std::uint8_t>* final_tape = nullptr;
+
+	//! When set, the work of the run gets added there, at the cost of an increment per dispatched instruction.
+	VmCounters* counters = nullptr;
+};
+
+enum class VmStatus
+{
+	ok,
+	step_limit_reached,
+	out_of_bounds,
+
+	//! Writing the output failed, e.g. as nothing reads it anymore, so the program was stopped.
+	output_failed
 };
 
-void interpret(VmParams params, std::span<const VMCompactOp> program);
+//! Runs `program`. Step limits, bounds checking, profiling and counting are handled by separate, slower instantiations of the
+//! interpreter, so they cost nothing when disabled.
+//!
+//! `checkrange` instructions are checked by the fast instantiation. When one fails, execution carries on with every
+//! access checked until a later `checkrange` holds again, so that only an access that really occurs gets reported.
+VmStatus interpret(VmParams params, const Bytecode& program);
 
 } // namespace bf
 
@@ -22,15 +22,9 @@ CommandlineFlag::operator const std::string&()
 	return value;
 }
 
-bool Flags::parse_commandline(const std::vector<std::string_view>& args)
+bool parse_flags(std::span<CommandlineFlag> flags, const std::vector<std::string_view>& args, size_t first)
 {
-	if (args.size() < 2)
-	{
-		fmt::print(errout(cmdinfo), "Syntax : ./ashbf <file.bf> (flags)\n");
-		return false;
-	}
-
-	for (size_t i = 2; i < args.size(); ++i)
+	for (size_t i = first; i < args.size(); ++i)
 	{
 		const std::string_view arg{args[i]};
 
@@ -70,3 +64,32 @@ bool Flags::parse_commandline(const std::vector<std::string_view>& args)
 
 	return true;
 }
+
+bool Flags::parse_commandline(const std::vector<std::string_view>& args)
+{
+	size_t first_flag = 1;
+
+	while (first_flag < args.size() && !args[first_flag].starts_with('-'))
+	{
+		program_paths.push_back(args[first_flag]);
+		++first_flag;
+	}
+
+	if (!parse_flags(flags, args, first_flag))
+	{
+		return false;
+	}
+
+	if (program_paths.empty() && (*this)[Flag::serve].value.empty())
+	{
+		fmt::print(
+			errout(cmdinfo),
+			"Syntax : ./ashbf <file.bf> (flags)\n"
+			"         ./ashbf <first.bf> <second.bf>... (flags)\n"
+			"         ./ashbf -serve=<socket> (flags)\n"
+		);
+		return false;
+	}
+
+	return true;
+}
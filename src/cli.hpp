@@ -2,6 +2,7 @@
 #define COMMANDLINE_HPP
 
 #include <array>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -22,39 +23,75 @@ struct CommandlineFlag
 
 enum class Flag
 {
-	optimize_passes = 0,
-	optimize,
+	optimize = 0,
 	optimize_debug,
+	optimize_debug_steps,
+	optimize_debug_input,
 	optimize_verbose,
 	optimize_allow_suz,
+	optimize_threads,
 	legalize_overflow,
 	memory_size,
-	// sanitize,
+	profile_generate,
+	profile_use,
+	sanitize,
 	// warnings,
+	time_passes,
+	perf_stats,
+	memoize,
 	print_il,
 	print_il_line_numbers,
 	execute,
 	codegen_asm_x86_64_file,
-	codegen_c_file
+	codegen_asm_x86_64_march,
+	codegen_elf_x86_64_file,
+	codegen_c_file,
+	codegen_llvm_file,
+	serve,
+	serve_max_memory,
+	serve_max_steps,
+	serve_max_output,
+	serve_cache_size
 };
 
+//! Parses the `-name=value` flags among `args`, starting at `first`, into the matching entries of `flags`.
+bool parse_flags(std::span<CommandlineFlag> flags, const std::vector<std::string_view>& args, size_t first);
+
 struct Flags
 {
-	std::array<CommandlineFlag, 12> flags = {
-		{{"optimize-passes", '\0', "10"},           // Optimization pass count
-		 {"optimize", 'O', "1", {"0", "1"}},        // Optimization level (any or 1)
+	std::array<CommandlineFlag, 28> flags = {
+		{{"optimize", 'O', "1", {"0", "1"}},        // Optimization level (any or 1)
 		 {"optimize-debug", '\0', "0", {"0", "1"}}, // Optimization regression verification
+		 {"optimize-debug-steps", '\0', "100000000"}, // Instructions a debug run may execute (0: unlimited)
+		 {"optimize-debug-input", '\0', ""},           // File fed as input to debug runs
 		 {"optimize-verbose", 'v', "0", {"0", "1"}},
 		 {"optimize-suz", '\0', "1", {"0", "1"}}, // Allow to the shift-until-zero instruction
+		 {"optimize-threads", 'j', "0"},           // Optimizer and codegen worker threads (0: one per hardware thread)
 		 {"legalize-overflow", '\0', "0", {"0", "1"}},
-		 {"memory-size", 'm', "30000"}, // Cells available to the program
-		 //{ "sanitize", "0", {"0", "1"} }, // Enable brainfuck sanitizers to the brainfuck program (enforce proper
-		 // memory access) { "warnings", 'W', "1", {"0", "1"} }, // Controls compiler warnings
+		 {"memory-size", 'm', "auto"}, // Cells available to the program (auto: as many as it needs if that is known)
+		 {"profile-generate", '\0', ""}, // File to write the loop profile of the execution to
+		 {"profile-use", '\0', ""},      // Profile of a previous execution guiding optimization and codegen
+		 {"sanitize", '\0', "0", {"0", "1"}}, // Stop the program when it accesses memory out of the tape
+		 // { "warnings", 'W', "1", {"0", "1"} }, // Controls compiler warnings
+		 {"time-passes", '\0', "0", {"0", "1", "json"}},  // Report compilation timings and statistics
+		 {"perf-stats", '\0', "0", {"0", "1", "json"}},   // Report hardware counters and interpreter work of the execution
+		 {"memoize", '\0', ""},                           // Directory keeping the output of programs that read no input
 		 {"print-il", 'a', "0", {"0", "1"}},               // Print VM IL
 		 {"print-il-line-numbers", '\0', "1", {"0", "1"}}, // Print VM IL line numbers
 		 {"execute", 'x', "1", {"0", "1"}},                // Do execute the compiled program or not,
 		 {"asm-x86-64-output", '\0', ""},
-		 {"asm-c-output", '\0', ""}}};
+		 {"asm-x86-64-march", '\0', "x86-64", {"x86-64", "x86-64-v3"}}, // Instruction set of the x86-64 assembly
+		 {"elf-x86-64-output", '\0', ""}, // Standalone x86-64 Linux executable, written without an assembler
+		 {"asm-c-output", '\0', ""},
+		 {"llvm-output", '\0', ""},
+		 {"serve", '\0', ""},                      // Unix socket to serve requests to run programs on, instead of running one
+		 {"serve-max-memory", '\0', "16777216"},   // Most cells a request may ask for
+		 {"serve-max-steps", '\0', "100000000"},   // Most instructions a request may execute (0: unlimited)
+		 {"serve-max-output", '\0', "16777216"},   // Most bytes of output a request may write
+		 {"serve-cache-size", '\0', "1024"}}};     // Compiled programs kept for requests referring to them by hash
+
+	//! Programs to run, several making a pipeline. Only left out when serving.
+	std::vector<std::string_view> program_paths;
 
 	inline CommandlineFlag& operator[](const Flag flag) { return flags[static_cast<size_t>(flag)]; }
 
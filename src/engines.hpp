@@ -0,0 +1,105 @@
+#ifndef ENGINES_HPP
+#define ENGINES_HPP
+
+#include "bf/logger.hpp"
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fmt/ostream.h>
+
+//! Ways the benchmark and the fuzzer run a program: the interpreter, or the output of a code generator.
+enum class Engine
+{
+	interpreter,
+	c,
+	llvm,
+	asm_x86_64,
+	asm_x86_64_v3,
+	elf_x86_64
+};
+
+//! The first name of an engine is the one it gets reported by.
+constexpr std::array<std::pair<std::string_view, Engine>, 7> engine_names = {{
+	{"interpreter", Engine::interpreter},
+	{"vm", Engine::interpreter},
+	{"c", Engine::c},
+	{"llvm", Engine::llvm},
+	{"asm", Engine::asm_x86_64},
+	{"asm-v3", Engine::asm_x86_64_v3},
+	{"elf", Engine::elf_x86_64},
+}};
+
+inline std::string_view engine_name(Engine engine)
+{
+	return std::find_if(engine_names.begin(), engine_names.end(), [&](const auto& e) { return e.second == engine; })->first;
+}
+
+//! Appends the engines of the comma separated `list` to `engines`.
+inline bool parse_engines(std::string_view list, std::vector<Engine>& engines)
+{
+	while (!list.empty())
+	{
+		const size_t comma = std::min(list.find(','), list.size());
+		const auto name = list.substr(0, comma);
+		list.remove_prefix(std::min(comma + 1, list.size()));
+
+		const auto it = std::find_if(engine_names.begin(), engine_names.end(), [&](const auto& e) { return e.first == name; });
+
+		if (it == engine_names.end())
+		{
+			fmt::print(errout(cmdinfo), "Unknown engine '{}'\n", name);
+			return false;
+		}
+
+		engines.push_back(it->second);
+	}
+
+	return true;
+}
+
+inline std::optional<std::string> read_file(const std::filesystem::path& path)
+{
+	std::ifstream file{path, std::ios::binary};
+
+	if (!file)
+	{
+		return std::nullopt;
+	}
+
+	return std::string{std::istreambuf_iterator<char>{file}, {}};
+}
+
+//! Appends the paths of the programs of the corpus `directory`, its `.b` files, to `paths` in a fixed order. Directory
+//! order is unspecified, which would make runs differ from a machine to another.
+inline bool list_corpus(const std::filesystem::path& directory, std::vector<std::filesystem::path>& paths)
+{
+	std::error_code error;
+	const size_t first = paths.size();
+
+	for (const auto& entry : std::filesystem::directory_iterator{directory, error})
+	{
+		if (entry.path().extension() == ".b")
+		{
+			paths.push_back(entry.path());
+		}
+	}
+
+	if (error)
+	{
+		return false;
+	}
+
+	std::sort(paths.begin() + std::ptrdiff_t(first), paths.end());
+	return true;
+}
+
+#endif // ENGINES_HPP
@@ -1,11 +1,25 @@
 #include "bf/bf.hpp"
 #include "bf/codegen/codegen.hpp"
 #include "bf/disasm.hpp"
+#include "bf/hash.hpp"
 #include "bf/logger.hpp"
+#include "bf/memo.hpp"
 #include "bf/vm.hpp"
 #include "bf/optimizer.hpp"
+#include "bf/perf.hpp"
+#include "bf/profile.hpp"
+#include "bf/run.hpp"
+#include "bf/stats.hpp"
+#include "bf/threadpool.hpp"
 #include "cli.hpp"
+#include "pipeline.hpp"
+#include "server.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
+#include <optional>
+#include <sstream>
 
 int main(int argc, char** argv)
 {
@@ -19,50 +33,216 @@ int main(int argc, char** argv)
 
 	bool optimize = flags[Flag::optimize];
 
+	// `auto` picks the cells the program needs once it is known, `bf::fallback_memory_size` until then or when it cannot be told.
+	const std::string& memory_size_flag = flags[Flag::memory_size];
+	const bool auto_memory_size = memory_size_flag == "auto";
+	size_t memory_size = auto_memory_size ? bf::fallback_memory_size : std::stoul(memory_size_flag);
+
+	if (const std::string& socket_path = flags[Flag::serve]; !socket_path.empty())
+	{
+		return serve({
+			.socket_path = socket_path,
+			.thread_count = std::stoul(flags[Flag::optimize_threads]),
+			.optimize = optimize,
+			.legal_overflow = flags[Flag::legalize_overflow],
+			.allow_suz = flags[Flag::optimize_allow_suz],
+			.default_memory_size = auto_memory_size ? 0 : memory_size,
+			.max_memory_size = std::stoul(flags[Flag::serve_max_memory]),
+			.max_steps = std::stoul(flags[Flag::serve_max_steps]),
+			.max_output_size = std::stoul(flags[Flag::serve_max_output]),
+			.cache_size = std::stoul(flags[Flag::serve_cache_size])
+		}) ? 0 : 1;
+	}
+
+	if (flags.program_paths.size() > 1)
+	{
+		// Pipelines only run their programs, the flags inspecting or compiling one to a file have nothing to act on.
+		Flags defaults;
+
+		for (const Flag flag :
+			 {Flag::optimize_debug,
+			  Flag::profile_generate,
+			  Flag::profile_use,
+			  Flag::time_passes,
+			  Flag::perf_stats,
+			  Flag::memoize,
+			  Flag::print_il,
+			  Flag::execute,
+			  Flag::codegen_asm_x86_64_file,
+			  Flag::codegen_elf_x86_64_file,
+			  Flag::codegen_c_file,
+			  Flag::codegen_llvm_file})
+		{
+			if (flags[flag].value != defaults[flag].value)
+			{
+				fmt::print(errout(cmdinfo), "Flag '-{}' is not supported when running several programs\n", flags[flag].name);
+				return 1;
+			}
+		}
+
+		return run_pipeline({
+			.program_paths = flags.program_paths,
+			.thread_count = std::stoul(flags[Flag::optimize_threads]),
+			.optimize = optimize,
+			.legal_overflow = flags[Flag::legalize_overflow],
+			.allow_suz = flags[Flag::optimize_allow_suz],
+			.sanitize = flags[Flag::sanitize],
+			.memory_size = auto_memory_size ? 0 : memory_size
+		}) ? 0 : 1;
+	}
+
+	// Phases are cheap enough to always time. Optimization tasks are only timed when the report is requested.
+	const std::string& time_passes = flags[Flag::time_passes];
+	bf::PipelineStats stats;
+
 	bf::Brainfuck bfi;
 
-	if (!bfi.compile_file(argv[1]))
+	if (!stats.time_phase("Compile", bfi.program, [&] { return bfi.compile_file(flags.program_paths.front()); }))
 	{
-		fmt::print(errout(compileinfo), "Failed to load program from '{}'\n", argv[1]);
+		fmt::print(errout(compileinfo), "Failed to load program from '{}'\n", flags.program_paths.front());
 		return 1;
 	}
 
-	if (optimize)
+	// Profiles are keyed on the unoptimized program, which does not depend on the flags.
+	const std::uint64_t program_hash = bf::hash_program(bfi.program);
+
+	bf::Profile used_profile;
+	bool has_profile = false;
+
+	if (const std::string& profile_path = flags[Flag::profile_use]; !profile_path.empty())
 	{
-		bf::Optimizer opt;
-		opt.pass_count     = std::stoul(flags[Flag::optimize_passes]);
-		opt.debug          = flags[Flag::optimize_debug];
-		opt.verbose        = flags[Flag::optimize_verbose];
-		opt.legal_overflow = flags[Flag::legalize_overflow];
-		opt.allow_suz      = flags[Flag::optimize_allow_suz];
-		opt.optimize(bfi.program);
+		if (!used_profile.load(profile_path))
+		{
+			fmt::print(errout(cmdinfo), "Failed to load profile from '{}'\n", profile_path);
+			return 1;
+		}
+
+		has_profile = used_profile.program_hash == program_hash;
+
+		if (!has_profile)
+		{
+			fmt::print(warnout(cmdinfo), "Profile '{}' was generated for another program, ignoring it\n", profile_path);
+		}
 	}
 
-	auto codegen_to_file = [&](const std::string& str, const std::function<bool(bf::codegen::Context)>& codegen) {
+	bf::Profile generated_profile;
+	generated_profile.program_hash = program_hash;
+
+	if (const std::string& profile_path = flags[Flag::profile_generate]; !profile_path.empty())
+	{
+		const auto loop_count = std::count_if(bfi.program.begin(), bfi.program.end(), [](const auto& op) {
+			return op.opcode == bf::bfLoopBegin;
+		});
+
+		generated_profile.loops.resize(std::min<size_t>(loop_count, size_t(bf::max_loop_id) + 1));
+
+		if (!flags[Flag::execute])
+		{
+			fmt::print(warnout(cmdinfo), "No profile is generated as the program does not get executed\n");
+		}
+	}
+
+	const std::string& generated_profile_path = flags[Flag::profile_generate];
+
+	bf::Optimizer opt;
+	opt.debug          = flags[Flag::optimize_debug];
+	opt.verbose        = flags[Flag::optimize_verbose];
+	opt.legal_overflow = flags[Flag::legalize_overflow];
+	opt.allow_suz      = flags[Flag::optimize_allow_suz];
+	opt.thread_count   = std::stoul(flags[Flag::optimize_threads]);
+	opt.stats          = (time_passes != "0") ? &stats : nullptr;
+	opt.profile        = has_profile ? &used_profile : nullptr;
+	opt.profiling      = !generated_profile_path.empty();
+
+	if (optimize && opt.debug)
+	{
+		opt.debug_run_params.memory_size = memory_size;
+		opt.debug_run_params.step_limit  = std::stoul(flags[Flag::optimize_debug_steps]);
+
+		if (const std::string& input_path = flags[Flag::optimize_debug_input]; !input_path.empty())
+		{
+			std::ifstream input{input_path, std::ios::binary};
+			if (!input)
+			{
+				fmt::print(errout(optimizeinfo), "Failed to open debug input file '{}'\n", input_path);
+				return 1;
+			}
+
+			opt.debug_run_params.input.assign(std::istreambuf_iterator<char>{input}, {});
+		}
+	}
+
+	// Code generation of large programs shares the thread budget of the optimizer.
+	const size_t thread_flag = std::stoul(flags[Flag::optimize_threads]);
+	const size_t codegen_threads = (thread_flag == 0) ? bf::ThreadPool::default_thread_count() : thread_flag;
+
+	auto codegen_to_file = [&](std::string_view name, const std::string& str, const std::function<bool(bf::codegen::Context)>& codegen) {
 		if (!str.empty())
 		{
-			std::ofstream of{str};
+			std::ofstream of{str, std::ios::binary};
 			if (!of)
 			{
 				return false;
 			}
 
-			return codegen({bfi.program, of});
+			return stats.time_phase(name, bfi.program, [&] {
+				return codegen({bfi.program, bfi.data, of, memory_size, has_profile ? &used_profile : nullptr, codegen_threads});
+			});
 		}
 
 		return false;
 	};
 
-	// LLVM and C codegen occurs before linking
-	codegen_to_file(flags[Flag::codegen_c_file].value, bf::codegen::c);
+	const auto runnable = bf::compile_for_run(bfi, {
+		.optimizer = optimize ? &opt : nullptr,
+		.memory_size = auto_memory_size ? 0 : memory_size,
+		.sanitize = flags[Flag::sanitize],
+		.stats = &stats,
+		.before_link = [&](size_t run_memory_size) {
+			memory_size = run_memory_size;
 
-	if (!bfi.link())
+			// LLVM and C codegen occurs before linking
+			codegen_to_file("LLVM IR codegen", flags[Flag::codegen_llvm_file].value, bf::codegen::llvm);
+			codegen_to_file("C codegen", flags[Flag::codegen_c_file].value, bf::codegen::c);
+		}
+	});
+
+	if (!runnable)
 	{
 		fmt::print(errout(compileinfo), "Failed to link brainfuck program\n");
+		return 1;
 	}
 
 	// Assembly codegen occurs after linking
-	codegen_to_file(flags[Flag::codegen_asm_x86_64_file].value, bf::codegen::asm_x86_64);
+	const auto x86_target = (flags[Flag::codegen_asm_x86_64_march].value == "x86-64-v3")
+		? bf::codegen::X86Target::x86_64_v3
+		: bf::codegen::X86Target::x86_64;
+
+	codegen_to_file("x86-64 assembly codegen", flags[Flag::codegen_asm_x86_64_file].value, [&](bf::codegen::Context ctx) {
+		return bf::codegen::asm_x86_64(ctx, x86_target);
+	});
+
+	const std::string& elf_path = flags[Flag::codegen_elf_x86_64_file];
+
+	if (codegen_to_file("x86-64 ELF codegen", elf_path, bf::codegen::elf_x86_64))
+	{
+		std::error_code error;
+		std::filesystem::permissions(
+			elf_path,
+			std::filesystem::perms::owner_exec | std::filesystem::perms::group_exec | std::filesystem::perms::others_exec,
+			std::filesystem::perm_options::add,
+			error
+		);
+	}
+
+	if (time_passes == "json")
+	{
+		stats.print_json(stderr);
+	}
+	else if (time_passes != "0")
+	{
+		stats.print_table(stderr);
+	}
 
 	bf::disasm.print_line_numbers = flags[Flag::print_il_line_numbers];
 
@@ -73,13 +253,116 @@ int main(int argc, char** argv)
 
 	if (flags[Flag::execute])
 	{
-		bf::interpret(
-			bf::VmParams{
-				.memory_size = std::stoul(flags[Flag::memory_size]),
-				.in_stream = &std::cin,
-				.out_stream = &std::cout
-			},
-			std::vector<bf::VMCompactOp>(bfi.program.begin(), bfi.program.end())
-		);
+		const std::string& profile_path = flags[Flag::profile_generate];
+
+		const std::string& perf_stats = flags[Flag::perf_stats];
+
+		const bf::Bytecode& bytecode = runnable->bytecode;
+		const size_t tape_padding = runnable->tape_padding;
+
+		// Programs reading no input always do the same, unless the run is profiled or counted, which it then has to be.
+		const std::string& memo_path = flags[Flag::memoize];
+		const bool memoize = !memo_path.empty() && profile_path.empty() && perf_stats == "0" && !bf::reads_input(bfi.program);
+
+		const bf::RunInputs run_inputs{bytecode, bfi.data, memory_size, tape_padding};
+		std::optional<bf::MemoizedRun> memoized;
+
+		if (memoize)
+		{
+			memoized = bf::MemoizedRun::load(memo_path, run_inputs);
+		}
+
+		// Counters are only opened when requested, as the interpreter is slightly slower when it counts its work.
+		bf::ExecutionStats execution_stats;
+		std::optional<bf::ExecutionCounters> execution_counters;
+
+		if (perf_stats != "0")
+		{
+			execution_counters.emplace();
+
+			if (!execution_counters->any_valid())
+			{
+				fmt::print(warnout(cmdinfo), "Hardware counters are unavailable, see /proc/sys/kernel/perf_event_paranoid\n");
+			}
+
+			execution_counters->start();
+		}
+
+		const auto begin = std::chrono::steady_clock::now();
+
+		bf::VmStatus status;
+
+		if (memoized)
+		{
+			std::cout.write(memoized->output.data(), std::streamsize(memoized->output.size()));
+			status = memoized->status;
+		}
+		else
+		{
+			// Output of memoized runs is written out as usual, and recorded along the way to be saved.
+			bf::OutputRecorder recorder{*std::cout.rdbuf()};
+			std::ostream memo_output{&recorder};
+
+			status = bf::interpret(
+				bf::VmParams{
+					.memory_size = memory_size,
+					.in_stream = &std::cin,
+					.out_stream = memoize ? &memo_output : &std::cout,
+					.data = bfi.data,
+					.tape_padding = tape_padding,
+					.profile = profile_path.empty() ? nullptr : &generated_profile,
+					.counters = execution_counters ? &execution_stats.vm : nullptr
+				},
+				bytecode
+			);
+
+			auto output = memoize ? recorder.take_recorded() : std::nullopt;
+
+			// Runs whose output is too large to keep, or could not be written, are not memoized.
+			if (output && status != bf::VmStatus::output_failed)
+			{
+				const bf::MemoizedRun run{.status = status, .output = std::move(*output)};
+
+				if (!run.save(memo_path, run_inputs))
+				{
+					fmt::print(warnout(cmdinfo), "Failed to memoize the output of the program in '{}'\n", memo_path);
+				}
+			}
+		}
+
+		if (execution_counters)
+		{
+			execution_counters->stop(execution_stats);
+			execution_stats.time = std::chrono::steady_clock::now() - begin;
+			std::cout.flush();
+
+			if (perf_stats == "json")
+			{
+				execution_stats.print_json(stderr);
+			}
+			else
+			{
+				execution_stats.print_table(stderr);
+			}
+		}
+
+		if (status == bf::VmStatus::out_of_bounds)
+		{
+			std::cout.flush();
+			fmt::print(errout(cmdinfo), "The program accessed a cell out of the tape of {} cells\n", memory_size);
+			return 1;
+		}
+
+		if (status == bf::VmStatus::output_failed)
+		{
+			fmt::print(errout(cmdinfo), "Failed to write the output of the program\n");
+			return 1;
+		}
+
+		if (!profile_path.empty() && !generated_profile.save(profile_path))
+		{
+			fmt::print(errout(cmdinfo), "Failed to write profile to '{}'\n", profile_path);
+			return 1;
+		}
 	}
 }
@@ -0,0 +1,170 @@
+#include "pipeline.hpp"
+
+#include "bf/bf.hpp"
+#include "bf/channel.hpp"
+#include "bf/logger.hpp"
+#include "bf/optimizer.hpp"
+#include "bf/run.hpp"
+#include "bf/vm.hpp"
+
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include <unistd.h>
+
+namespace
+{
+constexpr std::string_view pipelineinfo = "Pipeline";
+
+struct Stage
+{
+	std::string_view path;
+	bf::Brainfuck bfi;
+	bf::Bytecode bytecode;
+	std::size_t memory_size = 0;
+	std::size_t tape_padding = 0;
+	bf::VmStatus status = bf::VmStatus::ok;
+};
+
+bool compile(const PipelineParams& params, Stage& stage)
+{
+	auto& bfi = stage.bfi;
+
+	if (!bfi.compile_file(stage.path))
+	{
+		fmt::print(errout(pipelineinfo), "Failed to load program from '{}'\n", stage.path);
+		return false;
+	}
+
+	bf::Optimizer opt;
+	opt.legal_overflow = params.legal_overflow;
+	opt.allow_suz = params.allow_suz;
+	opt.thread_count = params.thread_count;
+
+	auto runnable = bf::compile_for_run(bfi, {
+		.optimizer = params.optimize ? &opt : nullptr,
+		.memory_size = params.memory_size,
+		.sanitize = params.sanitize
+	});
+
+	if (!runnable)
+	{
+		fmt::print(errout(pipelineinfo), "Failed to link program '{}'\n", stage.path);
+		return false;
+	}
+
+	stage.bytecode = std::move(runnable->bytecode);
+	stage.memory_size = runnable->memory_size;
+	stage.tape_padding = runnable->tape_padding;
+	return true;
+}
+}
+
+bool run_pipeline(const PipelineParams& params)
+{
+	const std::size_t stage_count = params.program_paths.size();
+	std::vector<Stage> stages(stage_count);
+
+	for (std::size_t i = 0; i < stage_count; ++i)
+	{
+		stages[i].path = params.program_paths[i];
+
+		if (!compile(params, stages[i]))
+		{
+			return false;
+		}
+	}
+
+	// Channel i carries the output of stage i to stage i + 1.
+	std::vector<std::unique_ptr<bf::ByteChannel>> channels;
+
+	for (std::size_t i = 0; i + 1 < stage_count; ++i)
+	{
+		channels.push_back(std::make_unique<bf::ByteChannel>());
+	}
+
+	const auto run_stage = [&](std::size_t i) {
+		auto& stage = stages[i];
+
+		std::istream in{(i == 0) ? std::cin.rdbuf() : &channels[i - 1]->reader()};
+		std::ostream out{(i + 1 == stage_count) ? std::cout.rdbuf() : &channels[i]->writer()};
+
+		// Output gets flushed before waiting for input, so that the next stage has all of it while this one waits. The
+		// standard input cannot tell when it would block, so the first stage flushes before every read instead, only
+		// when it is a terminal: waking the next stage for every byte of a file would cost more than the run.
+		if (i != 0)
+		{
+			channels[i - 1]->tie_reader(out.rdbuf());
+		}
+		else if (isatty(STDIN_FILENO))
+		{
+			in.tie(&out);
+		}
+
+		stage.status = bf::interpret(
+			bf::VmParams{
+				.memory_size = stage.memory_size,
+				.in_stream = &in,
+				.out_stream = &out,
+				.data = stage.bfi.data,
+				.tape_padding = stage.tape_padding
+			},
+			stage.bytecode
+		);
+
+		out.flush();
+
+		if (i + 1 < stage_count)
+		{
+			channels[i]->close_writer();
+		}
+
+		if (i != 0)
+		{
+			channels[i - 1]->close_reader();
+		}
+	};
+
+	std::vector<std::thread> threads;
+
+	for (std::size_t i = 0; i + 1 < stage_count; ++i)
+	{
+		threads.emplace_back(run_stage, i);
+	}
+
+	// The last stage runs on the calling thread, which would only wait otherwise.
+	run_stage(stage_count - 1);
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	bool ok = true;
+
+	for (std::size_t i = 0; i < stage_count; ++i)
+	{
+		const auto& stage = stages[i];
+
+		if (stage.status == bf::VmStatus::out_of_bounds)
+		{
+			fmt::print(
+				errout(pipelineinfo),
+				"Program '{}' accessed a cell out of the tape of {} cells\n",
+				stage.path,
+				stage.memory_size
+			);
+			ok = false;
+		}
+
+		// Stages before the last stop that way when the next one ends, which is how pipelines end early.
+		if (stage.status == bf::VmStatus::output_failed && i + 1 == stage_count)
+		{
+			fmt::print(errout(pipelineinfo), "Failed to write the output of program '{}'\n", stage.path);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
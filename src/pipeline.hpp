@@ -0,0 +1,34 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+struct PipelineParams
+{
+	//! Programs of the stages, in order. The first reads the standard input and the last writes the standard output.
+	std::vector<std::string_view> program_paths;
+
+	//! Optimizer threads, as with `-optimize-threads`.
+	std::size_t thread_count = 0;
+
+	bool optimize = true;
+	bool legal_overflow = false;
+	bool allow_suz = true;
+	bool sanitize = false;
+
+	//! Cells of every stage, 0 for as many as each program needs when that can be told.
+	std::size_t memory_size = 0;
+};
+
+//! Runs the programs of `params` as a pipeline, each on its own thread, the output of a stage feeding the input of the
+//! next through an in-memory `bf::ByteChannel`.
+//!
+//! A stage blocks when it reads input nobody wrote yet or when the channel to the next stage is full. Its output is
+//! published to the next stage when it reads input and when it ends, much as a line-buffered stream would be, and in
+//! chunks in between. A stage whose successor has ended gets stopped once its output fails to be published, as a process
+//! writing to a pipe nobody reads gets stopped by SIGPIPE, which ends its own predecessor in turn.
+bool run_pipeline(const PipelineParams& params);
+
+#endif // PIPELINE_HPP
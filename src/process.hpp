@@ -0,0 +1,132 @@
+#ifndef PROCESS_HPP
+#define PROCESS_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+//! Runs `args`, looked up in `PATH`, with the file at `input_path` as its input. Returns its output if it exited with
+//! status 0 before `timeout` and without writing more than `output_limit` bytes, past which it gets killed.
+inline std::optional<std::string> run_process(
+	const std::vector<std::string>& args,
+	const std::filesystem::path& input_path,
+	std::chrono::milliseconds timeout = std::chrono::milliseconds::max(),
+	size_t output_limit = std::numeric_limits<size_t>::max()
+)
+{
+	int pipe_fds[2];
+
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+	{
+		return std::nullopt;
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, input_path.c_str(), O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+
+	// Files other threads are writing must not stay open in the child, or executing them fails with ETXTBSY.
+	posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+	std::vector<char*> argv;
+	for (const auto& arg : args)
+	{
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	const auto spawn = [&](pid_t& pid) { return posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ); };
+
+	pid_t pid;
+	int error = spawn(pid);
+
+	// A child spawned by another thread may still hold such a file until it gets to close it.
+	for (int attempt = 0; error == ETXTBSY && attempt < 100; ++attempt)
+	{
+		usleep(1000);
+		error = spawn(pid);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipe_fds[1]);
+
+	if (error != 0)
+	{
+		close(pipe_fds[0]);
+		return std::nullopt;
+	}
+
+	const auto deadline = (timeout == std::chrono::milliseconds::max())
+		? std::chrono::steady_clock::time_point::max()
+		: std::chrono::steady_clock::now() + timeout;
+
+	std::string output;
+	char buffer[1 << 14];
+	bool killed = false;
+
+	for (;;)
+	{
+		const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		pollfd fd{.fd = pipe_fds[0], .events = POLLIN, .revents = 0};
+		const int ready = (left.count() > 0) ? poll(&fd, 1, int(std::min<long long>(left.count(), INT_MAX))) : 0;
+
+		if (ready < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ready == 0)
+		{
+			killed = true;
+			break;
+		}
+
+		const ssize_t count = read(pipe_fds[0], buffer, sizeof(buffer));
+
+		if (count <= 0)
+		{
+			break;
+		}
+
+		output.append(buffer, size_t(count));
+
+		if (output.size() > output_limit)
+		{
+			killed = true;
+			break;
+		}
+	}
+
+	if (killed)
+	{
+		kill(pid, SIGKILL);
+	}
+
+	close(pipe_fds[0]);
+
+	int status;
+	if (waitpid(pid, &status, 0) != pid || killed || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		return std::nullopt;
+	}
+
+	return output;
+}
+
+#endif // PROCESS_HPP
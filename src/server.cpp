@@ -0,0 +1,620 @@
+#include "server.hpp"
+
+#include "bf/bf.hpp"
+#include "bf/hash.hpp"
+#include "bf/logger.hpp"
+#include "bf/optimizer.hpp"
+#include "bf/run.hpp"
+#include "bf/threadpool.hpp"
+#include "bf/vm.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+constexpr std::string_view serverinfo = "Server";
+
+//! How long a connection may stall in the middle of a request or response before it gets dropped, so that a client
+//! cannot hold a worker forever.
+constexpr timeval io_timeout{.tv_sec = 10, .tv_usec = 0};
+
+//! Woken up by SIGINT and SIGTERM.
+int wake_fd = -1;
+volatile std::sig_atomic_t interrupted = 0;
+
+void on_signal(int)
+{
+	interrupted = 1;
+
+	const std::uint64_t one = 1;
+	[[maybe_unused]] const auto written = write(wake_fd, &one, sizeof(one));
+}
+
+//! Program compiled for the interpreter, along with what running it needs.
+struct CompiledProgram
+{
+	bf::Bytecode bytecode;
+	bf::DataSegment data;
+
+	//! Cells the program needs, or 0 when that cannot be told.
+	std::size_t required_memory_size = 0;
+
+	std::size_t tape_padding = 0;
+};
+
+//! Compiled programs keyed by the hash of their unoptimized form, the least recently used getting evicted first.
+class ProgramCache
+{
+public:
+	explicit ProgramCache(std::size_t capacity) : capacity(capacity) {}
+
+	std::shared_ptr<const CompiledProgram> find(std::uint64_t hash)
+	{
+		std::lock_guard lock{mutex};
+
+		const auto it = entries.find(hash);
+		if (it == entries.end())
+		{
+			return nullptr;
+		}
+
+		recent.splice(recent.begin(), recent, it->second.position);
+		return it->second.program;
+	}
+
+	void insert(std::uint64_t hash, std::shared_ptr<const CompiledProgram> program)
+	{
+		std::lock_guard lock{mutex};
+
+		// Another request may have compiled the same program meanwhile.
+		if (capacity == 0 || entries.contains(hash))
+		{
+			return;
+		}
+
+		if (entries.size() >= capacity)
+		{
+			entries.erase(recent.back());
+			recent.pop_back();
+		}
+
+		recent.push_front(hash);
+		entries.emplace(hash, Entry{std::move(program), recent.begin()});
+	}
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<const CompiledProgram> program;
+		std::list<std::uint64_t>::iterator position;
+	};
+
+	std::size_t capacity;
+
+	std::mutex mutex;
+	std::list<std::uint64_t> recent;
+	std::unordered_map<std::uint64_t, Entry> entries;
+};
+
+std::uint64_t load_u64(const unsigned char* bytes)
+{
+	std::uint64_t value = 0;
+	for (int i = 7; i >= 0; --i)
+	{
+		value = (value << 8) | bytes[i];
+	}
+	return value;
+}
+
+void store_u64(unsigned char* bytes, std::uint64_t value)
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		bytes[i] = std::uint8_t(value >> (i * 8));
+	}
+}
+
+bool read_exact(int fd, void* buffer, std::size_t size)
+{
+	auto* bytes = static_cast<unsigned char*>(buffer);
+
+	while (size != 0)
+	{
+		const ssize_t count = read(fd, bytes, size);
+
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (count <= 0)
+		{
+			return false;
+		}
+
+		bytes += count;
+		size -= size_t(count);
+	}
+
+	return true;
+}
+
+bool write_exact(int fd, const void* buffer, std::size_t size)
+{
+	const auto* bytes = static_cast<const unsigned char*>(buffer);
+
+	while (size != 0)
+	{
+		// Clients hanging up early must not kill the server with SIGPIPE.
+		const ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (count <= 0)
+		{
+			return false;
+		}
+
+		bytes += count;
+		size -= size_t(count);
+	}
+
+	return true;
+}
+
+//! Streams the output of a program to the connection `fd` as chunks preceded by their size, a chunk getting sent whenever
+//! the buffer fills up or gets flushed. Writing fails past `limit` bytes, or once the connection failed, which stops the
+//! program.
+class ChunkedOutput : public std::streambuf
+{
+public:
+	static constexpr std::size_t buffer_size = 1 << 16;
+
+	ChunkedOutput(int fd, std::size_t limit) : fd(fd), limit(limit), buffer(std::make_unique<char[]>(buffer_size))
+	{
+		setp(buffer.get(), buffer.get() + buffer_size);
+	}
+
+	//! Whether the program wrote more than `limit` bytes, only the first `limit` of which got sent.
+	bool limit_reached = false;
+
+	//! Whether sending failed, after which the connection cannot carry on.
+	bool connection_failed = false;
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (!send_chunk())
+		{
+			return traits_type::eof();
+		}
+
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+
+		return traits_type::not_eof(c);
+	}
+
+	int sync() override { return send_chunk() ? 0 : -1; }
+
+private:
+	bool send_chunk()
+	{
+		if (limit_reached || connection_failed)
+		{
+			return false;
+		}
+
+		std::size_t size = std::size_t(pptr() - pbase());
+
+		if (size > limit - sent)
+		{
+			size = limit - sent;
+			limit_reached = true;
+		}
+
+		if (size != 0)
+		{
+			unsigned char header[chunk_header_size];
+			store_u64(header, size);
+
+			connection_failed = !write_exact(fd, header, sizeof(header)) || !write_exact(fd, pbase(), size);
+			sent += size;
+		}
+
+		if (limit_reached || connection_failed)
+		{
+			setp(nullptr, nullptr);
+			return false;
+		}
+
+		setp(buffer.get(), buffer.get() + buffer_size);
+		return true;
+	}
+
+	int fd;
+	std::size_t limit;
+	std::size_t sent = 0;
+	std::unique_ptr<char[]> buffer;
+};
+
+ResponseStatus response_status(bf::VmStatus status)
+{
+	switch (status)
+	{
+	case bf::VmStatus::ok: return ResponseStatus::ok;
+	case bf::VmStatus::out_of_bounds: return ResponseStatus::out_of_bounds;
+	case bf::VmStatus::step_limit_reached: return ResponseStatus::step_limit_reached;
+	// Output only fails past the limit, as requests whose connection fails get dropped.
+	case bf::VmStatus::output_failed: return ResponseStatus::output_limit_reached;
+	}
+
+	return ResponseStatus::bad_request;
+}
+
+bool has_balanced_brackets(std::string_view source)
+{
+	long depth = 0;
+
+	for (const char c : source)
+	{
+		depth += (c == '[') - (c == ']');
+
+		if (depth < 0)
+		{
+			return false;
+		}
+	}
+
+	return depth == 0;
+}
+
+//! Compiles `parsed` as the command line would with `-sanitize=1`. The bounds check of the initial segment is always
+//! kept, as the program is shared by requests with different tape sizes.
+std::shared_ptr<const CompiledProgram> compile(const ServerParams& params, bf::Brainfuck& parsed)
+{
+	bf::Optimizer opt;
+	opt.legal_overflow = params.legal_overflow;
+	opt.allow_suz = params.allow_suz;
+	opt.warnings = false;
+	opt.thread_count = 1;
+
+	auto runnable = bf::compile_for_run(parsed, {
+		.optimizer = params.optimize ? &opt : nullptr,
+		.sanitize = true,
+		.any_memory_size = true
+	});
+
+	if (!runnable)
+	{
+		return nullptr;
+	}
+
+	auto compiled = std::make_shared<CompiledProgram>();
+	compiled->bytecode = std::move(runnable->bytecode);
+	compiled->data = std::move(parsed.data);
+	compiled->required_memory_size = runnable->required_memory_size;
+	compiled->tape_padding = runnable->tape_padding;
+	return compiled;
+}
+
+//! Serves the next request of the connection `fd`. Returns whether the connection may carry on with another request.
+bool serve_request(const ServerParams& params, ProgramCache& cache, int fd)
+{
+	unsigned char header[request_header_size];
+
+	if (!read_exact(fd, header, sizeof(header)))
+	{
+		return false;
+	}
+
+	const auto kind = RequestKind(header[0]);
+	const std::uint64_t program = load_u64(header + 1);
+	const std::uint64_t input_size = load_u64(header + 9);
+	const std::uint64_t requested_memory_size = load_u64(header + 17);
+	const std::uint64_t requested_steps = load_u64(header + 25);
+
+	// Ends the output, if any got sent, with a chunk of size 0.
+	const auto respond = [&](ResponseStatus status, std::uint64_t hash) {
+		unsigned char response[chunk_header_size + response_trailer_size];
+		store_u64(response, 0);
+		response[chunk_header_size] = std::uint8_t(status);
+		store_u64(response + chunk_header_size + 1, hash);
+
+		return write_exact(fd, response, sizeof(response));
+	};
+
+	const bool sends_source = kind == RequestKind::source;
+
+	// The payload of a malformed request cannot be skipped reliably, so the connection gets dropped after answering.
+	if ((!sends_source && kind != RequestKind::cached) || input_size > params.max_payload_size
+		|| (sends_source && program > params.max_payload_size))
+	{
+		respond(ResponseStatus::bad_request, 0);
+		return false;
+	}
+
+	std::string source(sends_source ? program : 0, '\0');
+	std::string input(input_size, '\0');
+
+	if (!read_exact(fd, source.data(), source.size()) || !read_exact(fd, input.data(), input.size()))
+	{
+		return false;
+	}
+
+	std::uint64_t hash = sends_source ? 0 : program;
+	std::shared_ptr<const CompiledProgram> compiled;
+
+	if (sends_source)
+	{
+		if (!has_balanced_brackets(source))
+		{
+			return respond(ResponseStatus::compile_error, 0);
+		}
+
+		bf::Brainfuck parsed;
+		parsed.compile(source);
+		hash = bf::hash_program(parsed.program);
+
+		compiled = cache.find(hash);
+
+		if (compiled == nullptr)
+		{
+			compiled = compile(params, parsed);
+
+			if (compiled == nullptr)
+			{
+				return respond(ResponseStatus::compile_error, hash);
+			}
+
+			cache.insert(hash, compiled);
+		}
+	}
+	else
+	{
+		compiled = cache.find(hash);
+
+		if (compiled == nullptr)
+		{
+			return respond(ResponseStatus::unknown_program, hash);
+		}
+	}
+
+	std::size_t memory_size = requested_memory_size;
+
+	if (memory_size == 0)
+	{
+		memory_size = params.default_memory_size;
+	}
+
+	if (memory_size == 0)
+	{
+		memory_size = (compiled->required_memory_size != 0) ? compiled->required_memory_size : bf::fallback_memory_size;
+	}
+
+	if (memory_size > params.max_memory_size)
+	{
+		return respond(ResponseStatus::bad_request, hash);
+	}
+
+	std::size_t step_limit = params.max_steps;
+
+	if (requested_steps != 0)
+	{
+		step_limit = (step_limit == 0) ? requested_steps : std::min<std::size_t>(step_limit, requested_steps);
+	}
+
+	std::istringstream in{std::move(input)};
+	ChunkedOutput output{fd, params.max_output_size};
+	std::ostream out{&output};
+
+	const auto status = bf::interpret(
+		bf::VmParams{
+			.memory_size = memory_size,
+			.in_stream = &in,
+			.out_stream = &out,
+			.data = compiled->data,
+			.step_limit = step_limit,
+			.tape_padding = compiled->tape_padding
+		},
+		compiled->bytecode
+	);
+
+	out.flush();
+
+	if (output.connection_failed)
+	{
+		return false;
+	}
+
+	return respond(output.limit_reached ? ResponseStatus::output_limit_reached : response_status(status), hash);
+}
+
+//! Creates the socket listening at `path`, replacing a socket left behind by a previous server.
+int listen_at(const std::string& path)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		fmt::print(errout(serverinfo), "Socket path '{}' is too long\n", path);
+		return -1;
+	}
+
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	if (struct stat status; lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+	{
+		unlink(path.c_str());
+	}
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0 || bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+	{
+		fmt::print(errout(serverinfo), "Failed to listen on '{}': {}\n", path, std::strerror(errno));
+
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	return fd;
+}
+}
+
+bool serve(const ServerParams& params)
+{
+	const int listener = listen_at(params.socket_path);
+
+	if (listener < 0)
+	{
+		return false;
+	}
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	// A second signal gets the default action, so that a server stuck on a request can still be killed.
+	struct sigaction action{};
+	action.sa_handler = on_signal;
+	action.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	ProgramCache cache{params.cache_size};
+	bf::ThreadPool pool{params.thread_count};
+
+	fmt::print(infoout(serverinfo), "Listening on '{}' with {} workers\n", params.socket_path, pool.size());
+
+	// Connections waiting for their next request get polled here. Those being served are handed over to a worker, which
+	// hands them back through `returned` once done.
+	std::vector<int> idle;
+
+	std::mutex returned_mutex;
+	std::vector<int> returned;
+
+	std::vector<pollfd> fds;
+
+	while (!interrupted)
+	{
+		fds.clear();
+		fds.push_back({.fd = listener, .events = POLLIN, .revents = 0});
+		fds.push_back({.fd = wake_fd, .events = POLLIN, .revents = 0});
+
+		for (const int fd : idle)
+		{
+			fds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			fmt::print(errout(serverinfo), "Failed to poll connections: {}\n", std::strerror(errno));
+			break;
+		}
+
+		std::vector<int> still_idle;
+
+		for (size_t i = 2; i < fds.size(); ++i)
+		{
+			const int fd = fds[i].fd;
+
+			if (fds[i].revents == 0)
+			{
+				still_idle.push_back(fd);
+				continue;
+			}
+
+			pool.submit([&, fd] {
+				if (!serve_request(params, cache, fd))
+				{
+					close(fd);
+					return;
+				}
+
+				{
+					std::lock_guard lock{returned_mutex};
+					returned.push_back(fd);
+				}
+
+				const std::uint64_t one = 1;
+				[[maybe_unused]] const auto written = write(wake_fd, &one, sizeof(one));
+			});
+		}
+
+		idle = std::move(still_idle);
+
+		if (fds[1].revents != 0)
+		{
+			std::uint64_t count;
+			[[maybe_unused]] const auto read_count = read(wake_fd, &count, sizeof(count));
+
+			std::lock_guard lock{returned_mutex};
+			idle.insert(idle.end(), returned.begin(), returned.end());
+			returned.clear();
+		}
+
+		if (fds[0].revents != 0)
+		{
+			const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+			if (fd >= 0)
+			{
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+				idle.push_back(fd);
+			}
+		}
+	}
+
+	fmt::print(infoout(serverinfo), "Shutting down once running requests are done\n");
+
+	pool.wait();
+
+	for (const int fd : idle)
+	{
+		close(fd);
+	}
+
+	for (const int fd : returned)
+	{
+		close(fd);
+	}
+
+	close(listener);
+	close(wake_fd);
+	unlink(params.socket_path.c_str());
+
+	return true;
+}
@@ -0,0 +1,85 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//! Kinds of program a request runs.
+enum class RequestKind : std::uint8_t
+{
+	//! The source of the program follows the header.
+	source = 0,
+
+	//! The program is one the server compiled for a previous request, identified by the hash that got returned then.
+	cached = 1
+};
+
+//! Outcome of a request, as sent back in the response.
+enum class ResponseStatus : std::uint8_t
+{
+	ok = 0,
+	out_of_bounds,
+	step_limit_reached,
+
+	//! The hash of a `cached` request is not (or no longer) in the cache: the client should send the source again.
+	unknown_program,
+
+	//! The program has unbalanced brackets.
+	compile_error,
+
+	//! The request is malformed or exceeds the limits of the server.
+	bad_request,
+
+	//! The program wrote more than the server lets a request write, and got stopped once the output sent reached that.
+	output_limit_reached
+};
+
+//! Size of a request header on the wire: the kind byte, then the program, input size, memory size and step limit as
+//! little endian 64-bit integers.
+constexpr std::size_t request_header_size = 1 + 4 * 8;
+
+//! Size of the header of an output chunk on the wire: the size of the chunk as a little endian 64-bit integer. A chunk of
+//! size 0 ends the output, and is followed by the response trailer.
+constexpr std::size_t chunk_header_size = 8;
+
+//! Size of a response trailer on the wire: the status byte, then the program hash as a little endian 64-bit integer.
+constexpr std::size_t response_trailer_size = 1 + 8;
+
+struct ServerParams
+{
+	std::string socket_path;
+
+	//! Requests executed concurrently. 0 picks one per hardware thread.
+	std::size_t thread_count = 0;
+
+	bool optimize = true;
+	bool legal_overflow = false;
+	bool allow_suz = true;
+
+	//! Cells given to requests that do not ask for a size, 0 for as many as the program needs when that can be told.
+	std::size_t default_memory_size = 0;
+
+	//! Most cells and steps a request may use. A step limit of 0 lets requests run for as long as they want.
+	std::size_t max_memory_size = 1 << 24;
+	std::size_t max_steps = 100000000;
+
+	//! Most bytes of output a request may write. Output is streamed to the client as it gets written, so this bounds what
+	//! a request sends rather than what the server holds.
+	std::size_t max_output_size = 1 << 24;
+
+	//! Most bytes of source or input a request may send.
+	std::size_t max_payload_size = 1 << 26;
+
+	//! Compiled programs kept around for `cached` requests, the least recently used getting evicted first.
+	std::size_t cache_size = 1024;
+};
+
+//! Listens on the Unix socket at `params.socket_path` and runs the programs of requests until interrupted by SIGINT or
+//! SIGTERM. Clients may send any number of requests over a connection, one after the other: every request gets answered
+//! by the output of the program in chunks, sent as the program writes it, followed by a response trailer.
+//!
+//! Programs are compiled with bounds checks regardless of `-sanitize`, as a server cannot afford to trust them.
+bool serve(const ServerParams& params);
+
+#endif // SERVER_HPP
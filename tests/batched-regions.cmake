@@ -0,0 +1,24 @@
+# Programs large enough to get optimized in batches must optimize to the same IL as when optimized serially, which
+# `-optimize-verbose` forces. Regions get cut after top-level I/O, so couts end up on both sides of a cut.
+include("${CMAKE_CURRENT_LIST_DIR}/common.cmake")
+
+string(REPEAT "+>" 8200 fill)
+string(REPEAT "<" 8200 rewind)
+
+set(programs
+	",${fill}${rewind}...."
+	",${fill}${rewind}.+-..."
+	",${fill}${rewind}.${fill}${rewind}.,"
+)
+
+set(index 0)
+foreach(source IN LISTS programs)
+	math(EXPR index "${index} + 1")
+	write_program(regions${index} "${source}")
+
+	run_ashbf(batched ARGS "${regions${index}_PATH}" -print-il -execute=0)
+	run_ashbf(serial ARGS "${regions${index}_PATH}" -print-il -execute=0 -optimize-verbose)
+
+	expect_equal("Program ${index} exit code" "${batched_RESULT}" 0)
+	expect_equal("IL of program ${index} optimized in batches" "${batched_OUTPUT}" "${serial_OUTPUT}")
+endforeach()
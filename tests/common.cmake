@@ -0,0 +1,43 @@
+# Helpers of the regression tests. Every test is a script run by `cmake -P`, with `ASHBF` set to the path of ashbf and
+# `WORK_DIR` to a directory of its own for the files it writes.
+
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# Writes `source` to `<name>.b` in the work directory, storing its path in `<name>_PATH`.
+function(write_program name source)
+	set(path "${WORK_DIR}/${name}.b")
+	file(WRITE "${path}" "${source}")
+	set(${name}_PATH "${path}" PARENT_SCOPE)
+endfunction()
+
+# Runs ashbf with `ARGS`, feeding it `INPUT`, for at most `TIMEOUT` seconds (10 by default). Its output, errors and exit
+# code, or the reason it did not exit, are stored in `<prefix>_OUTPUT`, `<prefix>_ERROR` and `<prefix>_RESULT`.
+function(run_ashbf prefix)
+	cmake_parse_arguments(RUN "" "INPUT;TIMEOUT" "ARGS" ${ARGN})
+
+	if(NOT RUN_TIMEOUT)
+		set(RUN_TIMEOUT 10)
+	endif()
+
+	set(input_path "${WORK_DIR}/${prefix}.in")
+	file(WRITE "${input_path}" "${RUN_INPUT}")
+
+	execute_process(
+		COMMAND "${ASHBF}" ${RUN_ARGS}
+		INPUT_FILE "${input_path}"
+		OUTPUT_VARIABLE output
+		ERROR_VARIABLE error
+		RESULT_VARIABLE result
+		TIMEOUT ${RUN_TIMEOUT}
+	)
+
+	set(${prefix}_OUTPUT "${output}" PARENT_SCOPE)
+	set(${prefix}_ERROR "${error}" PARENT_SCOPE)
+	set(${prefix}_RESULT "${result}" PARENT_SCOPE)
+endfunction()
+
+function(expect_equal what actual expected)
+	if(NOT "${actual}" STREQUAL "${expected}")
+		message(FATAL_ERROR "${what}: expected\n${expected}\ngot\n${actual}")
+	endif()
+endfunction()
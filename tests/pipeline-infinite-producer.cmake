@@ -0,0 +1,15 @@
+# A stage whose successor has ended must get stopped, as SIGPIPE would stop a process, rather than run forever. Every
+# stage before it has to stop in turn for the pipeline to exit.
+include("${CMAKE_CURRENT_LIST_DIR}/common.cmake")
+
+write_program(gen "++++++++[>++++++++<-]>+[.]")
+write_program(cat ",+[-.,+]")
+write_program(take ",.")
+
+run_ashbf(two_stages ARGS "${gen_PATH}" "${take_PATH}")
+expect_equal("Output of two stages" "${two_stages_OUTPUT}" "A")
+expect_equal("Exit code of two stages" "${two_stages_RESULT}" 0)
+
+run_ashbf(three_stages ARGS "${gen_PATH}" "${cat_PATH}" "${take_PATH}")
+expect_equal("Output of three stages" "${three_stages_OUTPUT}" "A")
+expect_equal("Exit code of three stages" "${three_stages_RESULT}" 0)
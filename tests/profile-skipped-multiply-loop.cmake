@@ -0,0 +1,18 @@
+# A multiply loop that a profile shows to be mostly skipped keeps its multiply-accumulates behind its condition, which
+# must not change the output of the program.
+include("${CMAKE_CURRENT_LIST_DIR}/common.cmake")
+
+write_program(skipped "++++++++++[>[->+>++<<]<-]>>>++++++++[-<++++++++>]<+.")
+set(profile_path "${WORK_DIR}/skipped.profile")
+
+run_ashbf(generate ARGS "${skipped_PATH}" "-profile-generate=${profile_path}")
+expect_equal("Output of the profiled run" "${generate_OUTPUT}" "A")
+
+run_ashbf(use ARGS "${skipped_PATH}" "-profile-use=${profile_path}" -time-passes)
+expect_equal("Output of the run using the profile" "${use_OUTPUT}" "A")
+
+string(FIND "${use_ERROR}" "guard multiply-accumulate of a mostly skipped loop" guard_position)
+
+if(guard_position EQUAL -1)
+	message(FATAL_ERROR "The mostly skipped loop was not guarded:\n${use_ERROR}")
+endif()
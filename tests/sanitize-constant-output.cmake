@@ -0,0 +1,29 @@
+# Under -sanitize, output folded into constant writes must not be moved past an access out of the tape: the program has
+# to print what it printed before that access, optimized or not.
+include("${CMAKE_CURRENT_LIST_DIR}/common.cmake")
+
+write_program(out_of_bounds "++++++++[>++++++++<-]>+.<<<+")
+write_program(in_bounds "++++++++[>++++++++<-]>+.+.")
+
+foreach(level 0 1)
+	run_ashbf(faulting ARGS "${out_of_bounds_PATH}" -sanitize -O${level})
+	expect_equal("Output at -O${level}" "${faulting_OUTPUT}" "A")
+	expect_equal("Exit code at -O${level}" "${faulting_RESULT}" 1)
+
+	if(NOT faulting_ERROR MATCHES "out of the tape")
+		message(FATAL_ERROR "No out of bounds error at -O${level}:\n${faulting_ERROR}")
+	endif()
+
+	run_ashbf(clean ARGS "${in_bounds_PATH}" -sanitize -O${level})
+	expect_equal("Output of the program staying in bounds at -O${level}" "${clean_OUTPUT}" "AB")
+	expect_equal("Exit code of the program staying in bounds at -O${level}" "${clean_RESULT}" 0)
+endforeach()
+
+# The output of a cell out of the tape must not get folded away along with the access.
+write_program(outputs_out_of_bounds "<.")
+
+foreach(level 0 1)
+	run_ashbf(faulting_output ARGS "${outputs_out_of_bounds_PATH}" -sanitize -O${level})
+	expect_equal("Output of a cell out of the tape at -O${level}" "${faulting_output_OUTPUT}" "")
+	expect_equal("Exit code of outputting a cell out of the tape at -O${level}" "${faulting_output_RESULT}" 1)
+endforeach()
@@ -0,0 +1,17 @@
+# Under -sanitize, a multiply loop lowered to multiply-accumulates must not access the cells it would add to when it
+# never runs: the program must succeed as it does unoptimized.
+include("${CMAKE_CURRENT_LIST_DIR}/common.cmake")
+
+write_program(left_add "[-<+>]")
+write_program(left_sub "[<->-]")
+write_program(runs ">++++++++[-<++++++++>]<+.")
+
+foreach(level 0 1)
+	foreach(program left_add left_sub)
+		run_ashbf(${program} ARGS "${${program}_PATH}" -sanitize -O${level})
+		expect_equal("Exit code of ${program} at -O${level}" "${${program}_RESULT}" 0)
+	endforeach()
+
+	run_ashbf(running ARGS "${runs_PATH}" -sanitize -O${level})
+	expect_equal("Output of a multiply loop that runs at -O${level}" "${running_OUTPUT}" "A")
+endforeach()